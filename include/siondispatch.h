@@ -10,10 +10,16 @@
 
 #include "config.h"
 #include <stddef.h> /* size_t, ptrdiff_t */
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/types.h> /* off_t */
+#include <pthread.h>
 #include <netcdf.h>
 #include <ncdispatch.h>
 
 #define SION_NDIMS3 3
+#define SION_NDIMS2 2
 #define SION_NDIMS1 1
 #define NUM_SION_VAR_ATTS 4
 #define TIME_NAME "day"
@@ -23,17 +29,245 @@
 #define I_NAME "i"
 #define J_NAME "j"
 
+/* Records in the A file are padded to a multiple of this many
+ * words. */
+#define SION_REC_PAD 4096
+
+/* Flags for SION_set_open_flags(). */
+#define SION_OPEN_HUGEPAGES 0x0001 /* Back staging buffers with huge pages. */
+#define SION_OPEN_DIRECT 0x0002 /* Stream whole records with O_DIRECT. */
+#define SION_OPEN_INSTANT 0x0004 /* Read only the B file header at open. */
+#define SION_OPEN_GRID 0x0008 /* Add coordinate vars from regional.grid. */
+#define SION_OPEN_REDUCE 0x0010 /* Add time mean, min and max vars. */
+#define SION_OPEN_VERIFY 0x0020 /* Check records against their checksums. */
+
+/* Access pattern hints, for SION_set_access_hint(). */
+#define SION_HINT_NONE 0
+#define SION_HINT_SEQUENTIAL 1 /* Records in time order. */
+#define SION_HINT_RANDOM 2 /* Records in no order. */
+#define SION_HINT_TIME_SERIES 3 /* A few points of many records. */
+#define SION_HINT_BOX 4 /* Small boxes within records. */
+#define SION_HINT_SCAN 5 /* Every record once. */
+
+/* How reads were served, for SION_inq_read_stats(). */
+#define SION_SERVED_SHM 0 /* From the shared record cache. */
+#define SION_SERVED_SPANS 1 /* Rows merged into spans by the scheduler. */
+#define SION_SERVED_ROWS 2 /* One read per row. */
+#define SION_NSERVED 3
+
+/* The time reductions, in the order of their vars. */
+#define SION_STAT_MEAN 0
+#define SION_STAT_MIN 1
+#define SION_STAT_MAX 2
+#define SION_NSTATS 3
+
+/* Formats for SION_get_vara_half(). */
+#define SION_HALF_IEEE 1 /* IEEE 754 binary16. */
+#define SION_HALF_BFLOAT16 2 /* bfloat16, the top half of a float. */
+
+/* Most staging buffers a file will hold at once. */
+#define SION_POOL_MAX 8
+
+/* A pool of page-aligned staging buffers, each one record long. */
+typedef struct SION_POOL
+{
+   pthread_mutex_t lock;
+   pthread_cond_t freed; /* Signalled when a buffer comes back. */
+   size_t buf_len; /* Length of each buffer in bytes. */
+   size_t align;
+   int huge; /* Buffers use transparent huge pages. */
+   int nbufr; /* Number of buffers allocated. */
+   int nfree; /* Number of buffers in free_bufr. */
+   void *free_bufr[SION_POOL_MAX];
+} SION_POOL_T;
+
+/* Double-buffered whole-record reads, for SION_OPEN_DIRECT. */
+typedef struct SION_STREAM
+{
+   int fd; /* A file, opened with O_DIRECT if possible. */
+   int direct; /* O_DIRECT is in effect. */
+   pthread_t thread; /* Reads the next record ahead. */
+   int started;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   void *bufr[2];
+   long rec[2]; /* Record in each buffer, -1 for none. */
+   int state[2];
+   int status[2]; /* Result of the read into each buffer. */
+   long want; /* Record to read ahead, -1 for none. */
+   int quit;
+} SION_STREAM_T;
+
+/* Seekable zstd state of a compressed A file, see sionzstd.c. */
+typedef struct SION_ZSTD SION_ZSTD_T;
+
+/* Decompressed frames cached per compressed file. */
+#define SION_ZCACHE_SLOTS 16
+
+/* Suffix of a seekable zstd compressed A file. */
+#define SION_ZSTD_SUFFIX ".zst"
+
+/* Node-wide shared memory record cache, see sionshm.c. */
+typedef struct SION_SHM SION_SHM_T;
+
+/* Most overview levels, see sionovr.c. */
+#define SION_OVR_MAX_LEVELS 16
+
+/* Overview levels of a file, from its sidecar, see sionovr.c. */
+typedef struct SION_OVR SION_OVR_T;
+
+/* Time reductions of a file, see sionreduce.c. */
+typedef struct SION_REDUCE SION_REDUCE_T;
+
+/* An iterator over the records of a file, see sioniter.c. */
+typedef struct SION_ITER SION_ITER_T;
+
+/* Decoded records kept for reads between records, see sioninterp.c. */
+typedef struct SION_INTERP SION_INTERP_T;
+
+/* Record checksums of a file, see sioncrc.c. */
+typedef struct SION_CRC SION_CRC_T;
+
+/* MPI-IO state of a file opened in parallel, see sionmpi.c. */
+typedef struct SION_MPI SION_MPI_T;
+
+/* Header and grid of a file, shared by files with the same ones, see
+ * sionfile.c. */
+typedef struct SION_HEADER SION_HEADER_T;
+
+/* Most fields read from a regional grid. */
+#define SION_GRID_MAX_FIELDS 32
+
+/* Regional grid fields with the longitude and latitude of p points. */
+#define SION_GRID_LON "plon"
+#define SION_GRID_LAT "plat"
+
+/* A HYCOM regional grid, shared by all files on it, see siongrid.c. */
+typedef struct SION_GRID
+{
+   struct SION_GRID *next;
+   char b_path[PATH_MAX]; /* Real path of regional.grid.b. */
+   int refs;
+   int i_len;
+   int j_len;
+   int nfields;
+   char name[SION_GRID_MAX_FIELDS][NC_MAX_NAME + 1];
+   float range[SION_GRID_MAX_FIELDS][2]; /* Min and max from the B file. */
+   float *field[SION_GRID_MAX_FIELDS]; /* Decoded fields, NULL until read. */
+   pthread_mutex_t lock; /* Protects field. */
+} SION_GRID_T;
+
 /* This is the metadata we need to keep track of for each
    netcdf-4/HDF5 file. */
 typedef struct  SION_FILE_INFO
 {
-   FILE *a_file;
+   FILE *a_file; /* NULL if the A file is in memory. */
    FILE *b_file;
+   const char *a_mem; /* The A file, if opened from memory. */
+   off_t a_mem_len;
+   pthread_mutex_t a_lock; /* Serializes seek/read pairs on a_file. */
+   int t_len;
+   int j_len;
+   int i_len;
+   size_t rec_len; /* Padded record length in bytes. */
+   size_t gap; /* Coalescing gap for batched reads, in bytes. */
+   int hint; /* SION_HINT_* for the data var. */
+   size_t served[SION_NSERVED]; /* Reads served each way. */
+   int flags; /* SION_OPEN_* flags in effect when opened. */
+   SION_POOL_T pool; /* Staging buffers for reads. */
+   SION_STREAM_T *stream; /* Non-NULL for SION_OPEN_DIRECT. */
+   SION_ZSTD_T *zstd; /* Non-NULL if the A file is compressed. */
+   off_t rec_pos; /* Offset of the first record line in b_file. */
+   off_t b_end; /* Offset in b_file after the last record line read. */
+   int b_recs; /* Number of record lines read. */
+   float *rec_time; /* Time and span of each record, t_len each. NULL
+                     * until read. Interned; never changed. */
+   float *rec_range; /* Min and max of each record, the same way. */
+   SION_HEADER_T *header; /* Header and grid, shared by files with the
+                           * same ones. Interned; never changed. */
+   int varid; /* Varid of the data var. */
+   int rec_atts_added; /* Non-zero once the per-record atts are attached. */
+   SION_SHM_T *shm; /* Shared record cache, or NULL. */
+   uint64_t shm_dev; /* Device, inode and mtime of the A file, the */
+   uint64_t shm_ino; /* cache key of its records. */
+   int64_t shm_mtime;
+   int swap; /* Non-zero if the A file is not in host byte order. */
+   SION_GRID_T *grid; /* Regional grid, or NULL. */
+   SION_OVR_T *ovr; /* Overview levels, or NULL. */
+   SION_CRC_T *crc; /* Record checksums, if verified, or NULL. */
+   SION_REDUCE_T *reduce; /* Time reductions, or NULL. */
+   SION_INTERP_T *interp; /* Records kept by SION_get_vara_time(), or NULL. */
+   int reduce_varid; /* Varid of the first time reduction var. */
+   int reduce_dimid; /* Dimid of the window dimension. */
+   int grid_varid; /* Varid of the first grid var. */
+   SION_MPI_T *mpi; /* MPI-IO state if opened in parallel, or NULL. */
+   int collective; /* Non-zero for collective reads of the data var. */
 } SION_FILE_INFO_T;
 
+/* Per-record attributes in rec_time; the rest are in rec_range. */
+#define SION_REC_TIME_ATTS 2
+
+/* The t_len values of per-record attribute a, in the order of
+ * TIME_NAME, SPAN_NAME, MIN_NAME, MAX_NAME. */
+#define SION_REC_ATT(ab_file, a) ((a) < SION_REC_TIME_ATTS ?             \
+   (ab_file)->rec_time + (size_t)(a) * (ab_file)->t_len :                \
+   (ab_file)->rec_range + (size_t)((a) - SION_REC_TIME_ATTS) * (ab_file)->t_len)
+
+/* HYCOM marks land and missing values with 2^100; anything this big
+ * is taken to be a data void. */
+#define SION_VOID 1.0e30f
+
+/* The HYCOM data void, 2^100. */
+#define SION_VOID_VALUE 1.2676506e30f
+
+/* Byte order detection: the number of floats of the first record
+ * looked at, the relative slack allowed on the B file min and max,
+ * and the magnitudes beyond which a float is taken to be nonsense
+ * when those are not known. */
+#define SION_ORDER_SAMPLE 4096
+#define SION_ORDER_SLACK 1.0e-4f
+#define SION_ORDER_TINY 1.0e-30f
+#define SION_ORDER_HUGE 1.0e20f
+
+/* Reads that are no further apart than this many bytes are merged
+ * into one read by the batch scheduler. */
+#define SION_DEFAULT_GAP (256 * 1024)
+
+/* One hyperslab read in a batch. */
+typedef struct SION_READ
+{
+   SION_FILE_INFO_T *ab_file;
+   size_t start[SION_NDIMS3];
+   size_t count[SION_NDIMS3];
+   float *value;
+   int status; /* Return code of this read. */
+} SION_READ_T;
+
+/* One request for SION_get_vara_batch(). */
+typedef struct SION_VARA_REQ
+{
+   int ncid;
+   int varid;
+   size_t start[SION_NDIMS3];
+   size_t count[SION_NDIMS3];
+   float *value;
+   int status; /* Gets the return code of this request. */
+} SION_VARA_REQ_T;
+
 #define MAX_B_LINE_LEN 80
 #define MAX_HEADER_ATTS 10
 
+/* What the B file header holds, besides the record layout. */
+typedef struct SION_B_INFO
+{
+   int num_header_atts;
+   char header_att[MAX_HEADER_ATTS][MAX_B_LINE_LEN];
+   char var_name[NC_MAX_NAME + 1];
+} SION_B_INFO_T;
+
+/* Most threads SION_open_many() will use. */
+#define SION_OPEN_THREADS_MAX 64
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -50,8 +284,234 @@ extern "C" {
    extern int SION_get_vara(int ncid, int varid, const size_t *start, const size_t *count,
                             void *value, nc_type);
 
+   extern int SION_inq_att(int ncid, int varid, const char *name, nc_type *xtypep,
+                           size_t *lenp);
+
+   extern int SION_inq_attid(int ncid, int varid, const char *name, int *idp);
+
+   extern int SION_inq_attname(int ncid, int varid, int attnum, char *name);
+
+   extern int SION_get_att(int ncid, int varid, const char *name, void *value,
+                           nc_type memtype);
+
+   extern int SION_inq_var_all(int ncid, int varid, char *name, nc_type *xtypep,
+                               int *ndimsp, int *dimidsp, int *nattsp,
+                               int *shufflep, int *deflatep, int *deflate_levelp,
+                               int *fletcher32p, int *contiguousp,
+                               size_t *chunksizesp, int *no_fill,
+                               void *fill_valuep, int *endiannessp,
+                               unsigned int *idp, size_t *nparamsp,
+                               unsigned int *params);
+
    extern int ab_set_log_level(int new_level);
 
+   /* Extensions to the netCDF API for AB files. */
+   extern int SION_iget_vara(int ncid, int varid, const size_t *startp,
+                             const size_t *countp, float *value, int *requestp);
+
+   extern int SION_wait(int request);
+
+   extern int SION_test(int request, int *flagp);
+
+   extern int SION_get_vara_batch(int nreq, SION_VARA_REQ_T *reqs);
+
+   extern int SION_iter_open(int ncid, int varid, size_t start, size_t count,
+                             SION_ITER_T **iterp);
+
+   extern int SION_iter_next(SION_ITER_T *iter, size_t *recp,
+                             const float **datap);
+
+   extern int SION_iter_release(SION_ITER_T *iter, const float *data);
+
+   extern int SION_iter_close(SION_ITER_T *iter);
+
+   extern int SION_get_vara_half(int ncid, int varid, const size_t *startp,
+                                 const size_t *countp, int format,
+                                 float void_value, uint16_t *data);
+
+   extern int SION_set_coalesce_gap(int ncid, size_t gap);
+
+   extern int SION_set_open_flags(int flags);
+
+   extern int SION_set_access_hint(int ncid, int varid, int hint);
+
+   extern int SION_inq_read_stats(int ncid, int varid, int *hintp,
+                                  size_t *servedp);
+
+   extern int SION_refresh(int ncid, size_t *t_lenp);
+
+   extern int SION_set_reduce_window(int window);
+
+   extern int SION_build_overviews(const char *path, int nlevels);
+
+   extern int SION_build_checksums(const char *path);
+
+   extern int SION_verify_checksums(const char *path, size_t nbad_max,
+                                    size_t *bad, size_t *nbadp);
+
+   extern int SION_inq_level(int ncid, int level, int *nlevelsp,
+                             size_t *t_lenp, size_t *j_lenp, size_t *i_lenp);
+
+   extern int SION_get_vara_level(int ncid, int varid, int level,
+                                  const size_t *startp, const size_t *countp,
+                                  float *data);
+
+   extern int SION_get_vara_time(int ncid, int varid, double time,
+                                 const size_t *startp, const size_t *countp,
+                                 float *data);
+
+   extern int SION_open_mem(const char *path, int mode, const void *b_data,
+                            size_t b_size, const void *a_data, size_t a_size,
+                            int *ncidp);
+
+   extern int SION_open_many(int nfiles, const char **paths, int mode,
+                             int *ncids);
+
+   extern int SION_var_par_access(int ncid, int varid, int par_access);
+
+   extern int SION_set_shm_cache(const char *name, size_t budget,
+                                 size_t slot_bytes);
+
+   /* Used internally by the AB dispatch layer. */
+   extern size_t ab_rec_len(int j_len, int i_len);
+
+   extern int ab_check_layout(int t_len, int j_len, int i_len);
+
+   extern int ab_check_vara(SION_FILE_INFO_T *ab_file, const size_t *startp,
+                            const size_t *countp);
+
+   extern int ab_add_rec_atts(int ncid, int varid);
+
+   extern int ab_load_b_records(SION_FILE_INFO_T *ab_file);
+
+   extern int ab_prepare_file(const char *path, SION_FILE_INFO_T **ab_filep,
+                              SION_B_INFO_T *b_info);
+
+   extern int ab_prepare_mem(const char *path, const void *b_data,
+                             size_t b_size, const void *a_data, size_t a_size,
+                             SION_FILE_INFO_T **ab_filep,
+                             SION_B_INFO_T *b_info);
+
+   extern int ab_prepare_bare(int t_len, int j_len, int i_len,
+                              SION_FILE_INFO_T **ab_filep);
+
+   extern void ab_free_file(SION_FILE_INFO_T *ab_file);
+
+   extern int ab_intern(void **datap, size_t len);
+
+   extern int ab_intern_rec_data(SION_FILE_INFO_T *ab_file, float *rec_time,
+                                 float *rec_range, int t_len);
+
+   extern int ab_shm_attach(SION_FILE_INFO_T *ab_file);
+
+   extern int ab_grid_open(SION_FILE_INFO_T *ab_file, const char *path);
+
+   extern void ab_grid_close(SION_GRID_T *grid);
+
+   extern int ab_ovr_open(SION_FILE_INFO_T *ab_file, const char *path);
+
+   extern int ab_reduce_open(SION_FILE_INFO_T *ab_file, int window);
+
+   extern void ab_reduce_close(SION_REDUCE_T *r);
+
+   extern int ab_reduce_refresh(SION_REDUCE_T *r, int t_len);
+
+   extern int ab_reduce_nwin(SION_REDUCE_T *r);
+
+   extern int ab_reduce_get_vara(SION_FILE_INFO_T *ab_file, int stat,
+                                 const size_t *startp, const size_t *countp,
+                                 void *data, nc_type memtype, size_t type_size);
+
+   extern void ab_ovr_close(SION_OVR_T *ovr);
+
+   extern uint32_t ab_crc32c(uint32_t crc, const void *buf, size_t len);
+
+   extern int ab_crc_open(SION_FILE_INFO_T *ab_file, const char *path);
+
+   extern void ab_crc_close(SION_CRC_T *crc);
+
+   extern void ab_interp_close(SION_INTERP_T *interp);
+
+   extern int ab_crc_wanted(SION_FILE_INFO_T *ab_file, size_t t);
+
+   extern int ab_crc_record(SION_FILE_INFO_T *ab_file, size_t t,
+                            uint32_t sum);
+
+   extern int ab_crc_span(SION_FILE_INFO_T *ab_file, off_t off, size_t len,
+                          const void *buf);
+
+   extern int ab_mpi_prepare(const char *path, void *parameters,
+                             SION_FILE_INFO_T **ab_filep,
+                             SION_B_INFO_T *b_info);
+
+   extern void ab_mpi_close(SION_MPI_T *mpi);
+
+   extern int ab_mpi_threaded(SION_MPI_T *mpi);
+
+   extern int ab_mpi_read_raw(SION_FILE_INFO_T *ab_file, off_t pos, size_t len,
+                              void *bufr);
+
+   extern int ab_mpi_read_vara(SION_FILE_INFO_T *ab_file, const size_t *startp,
+                               const size_t *countp, float *data);
+
+   extern int ab_grid_get_vara(SION_FILE_INFO_T *ab_file, int f,
+                               const size_t *startp, const size_t *countp,
+                               void *data, nc_type memtype, size_t type_size);
+
+   extern int ab_shm_read(SION_FILE_INFO_T *ab_file, const size_t *startp,
+                          const size_t *countp, float *data);
+
+   extern void ab_unintern(void *data);
+
+   extern int ab_stash_take(const char *path, SION_FILE_INFO_T **ab_filep,
+                            SION_B_INFO_T *b_info);
+
+   extern int ab_read_vara(SION_FILE_INFO_T *ab_file, const size_t *startp,
+                           const size_t *countp, float *data);
+
+   extern int ab_read_batch(int nread, SION_READ_T **reads);
+
+   extern int ab_hint_strategy(SION_FILE_INFO_T *ab_file);
+
+   extern void ab_hint_done(SION_FILE_INFO_T *ab_file, const size_t *startp,
+                            const size_t *countp, int served);
+
+   extern int ab_read_raw(SION_FILE_INFO_T *ab_file, off_t pos, size_t len,
+                          void *bufr);
+
+   extern int ab_stream_open(SION_FILE_INFO_T *ab_file, const char *a_path);
+
+   extern void ab_stream_close(SION_STREAM_T *st);
+
+   extern int ab_zstd_open(SION_FILE_INFO_T *ab_file);
+
+   extern void ab_zstd_close(SION_ZSTD_T *z);
+
+   extern off_t ab_zstd_size(SION_ZSTD_T *z);
+
+   extern long ab_zstd_frame(SION_ZSTD_T *z, off_t pos);
+
+   extern int ab_zstd_prefetch(SION_ZSTD_T *z, const long *frames, int n);
+
+   extern int ab_zstd_read(SION_ZSTD_T *z, off_t pos, size_t len, void *bufr);
+
+   extern int ab_pool_init(SION_POOL_T *pool, size_t len, int huge);
+
+   extern int ab_pool_get(SION_POOL_T *pool, void **bufrp);
+
+   extern void ab_pool_put(SION_POOL_T *pool, void *bufr);
+
+   extern void ab_pool_free(SION_POOL_T *pool);
+
+   extern int ab_reverse_floats(float *bufr_in, float *bufr_out, size_t num);
+
+   extern int ab_decode_floats(SION_FILE_INFO_T *ab_file, float *bufr_in,
+                               float *bufr_out, size_t num);
+
+   extern int ab_float_order(const float *raw, size_t num, const float *range);
+
+   extern void ab_async_drain(SION_FILE_INFO_T *ab_file);
+
 #if defined(__cplusplus)
 }
 #endif
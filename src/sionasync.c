@@ -0,0 +1,367 @@
+/**
+ * @file
+ * @internal Non-blocking reads for the AB dispatch layer.
+ *
+ * SION_iget_vara() queues a hyperslab read and returns a request
+ * ID. A single background I/O thread picks up everything that is
+ * queued at the time it wakes and runs it as one batch through
+ * ab_read_batch(), which orders and merges the reads by file
+ * offset. SION_wait() and SION_test() collect the result.
+ *
+ * The I/O thread may not call MPI unless MPI allows every thread to,
+ * so reads of files opened in parallel at a lower thread level are
+ * done at once, and come back as requests that are already done.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal States of an async read request. */
+#define SION_REQ_QUEUED 0
+#define SION_REQ_ACTIVE 1
+#define SION_REQ_DONE 2
+
+/** @internal One queued hyperslab read. */
+typedef struct SION_REQ
+{
+   struct SION_REQ *next;
+   int id;
+   int state;
+   SION_READ_T read; /* The read, and its status once done. */
+} SION_REQ_T;
+
+/* All requests not yet collected by SION_wait(), oldest first. */
+static SION_REQ_T *req_list = NULL;
+static int next_req_id = 1;
+static pthread_mutex_t req_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t req_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t req_done = PTHREAD_COND_INITIALIZER;
+static pthread_t io_thread;
+static int io_thread_started = 0;
+
+/**
+ * @internal The background I/O thread. Sleeps until requests are
+ * queued, then takes all of them and reads them as one batch.
+ *
+ * @param arg Ignored.
+ *
+ * @return Never returns.
+ */
+static void *
+io_thread_main(void *arg)
+{
+   SION_READ_T **batch = NULL;
+   SION_REQ_T **batch_req = NULL;
+   int batch_alloc = 0;
+
+   for (;;)
+   {
+      SION_REQ_T *req;
+      int nbatch = 0;
+      int ret;
+
+      /* Wait for work and claim everything that is queued. */
+      pthread_mutex_lock(&req_lock);
+      for (;;)
+      {
+         for (req = req_list; req; req = req->next)
+            if (req->state == SION_REQ_QUEUED)
+               break;
+         if (req)
+            break;
+         pthread_cond_wait(&req_queued, &req_lock);
+      }
+      for (req = req_list; req; req = req->next)
+      {
+         if (req->state != SION_REQ_QUEUED)
+            continue;
+         if (nbatch == batch_alloc)
+         {
+            SION_READ_T **b;
+            SION_REQ_T **br;
+            int new_alloc = batch_alloc ? batch_alloc * 2 : 16;
+
+            if ((b = realloc(batch, new_alloc * sizeof(SION_READ_T *))))
+               batch = b;
+            if ((br = realloc(batch_req, new_alloc * sizeof(SION_REQ_T *))))
+               batch_req = br;
+            if (!b || !br)
+            {
+               req->read.status = NC_ENOMEM;
+               req->state = SION_REQ_DONE;
+               pthread_cond_broadcast(&req_done);
+               continue;
+            }
+            batch_alloc = new_alloc;
+         }
+         req->state = SION_REQ_ACTIVE;
+         batch_req[nbatch] = req;
+         batch[nbatch++] = &req->read;
+      }
+      pthread_mutex_unlock(&req_lock);
+
+      /* Read the batch in file order; each read gets its status. */
+      LOG((3, "%s: batch of %d requests", __func__, nbatch));
+      if ((ret = ab_read_batch(nbatch, batch)))
+         LOG((1, "%s: batch of %d requests failed: %d", __func__, nbatch, ret));
+
+      pthread_mutex_lock(&req_lock);
+      for (int r = 0; r < nbatch; r++)
+         batch_req[r]->state = SION_REQ_DONE;
+      pthread_cond_broadcast(&req_done);
+      pthread_mutex_unlock(&req_lock);
+   }
+
+   return NULL;
+}
+
+/**
+ * @internal Add a request to the end of the list and hand out its
+ * ID. The I/O thread is started on first use. Must be called with
+ * req_lock held.
+ *
+ * @param req Pointer to the new request.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Could not start I/O thread.
+ */
+static int
+req_add(SION_REQ_T *req)
+{
+   SION_REQ_T **tail;
+
+   if (!io_thread_started)
+   {
+      if (pthread_create(&io_thread, NULL, io_thread_main, NULL))
+         return NC_EIO;
+      pthread_detach(io_thread);
+      io_thread_started++;
+   }
+
+   req->id = next_req_id++;
+   for (tail = &req_list; *tail; tail = &(*tail)->next)
+      ;
+   *tail = req;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Find a request by ID. Must be called with req_lock held.
+ *
+ * @param request Request ID.
+ *
+ * @return Pointer to the request, or NULL if not found.
+ */
+static SION_REQ_T *
+req_find(int request)
+{
+   SION_REQ_T *req;
+
+   for (req = req_list; req; req = req->next)
+      if (req->id == request)
+         break;
+   return req;
+}
+
+/**
+ * Start reading a hyperslab without waiting for the data. The read
+ * is done on a background I/O thread; reads queued close together
+ * are ordered by file offset before they are run. The value buffer
+ * must not be touched until SION_wait() returns for the request.
+ * Files opened in parallel are read at once unless MPI was started
+ * with MPI_THREAD_MULTIPLE.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID.
+ * @param startp Array of start indicies.
+ * @param countp Array of counts.
+ * @param value Pointer that gets the data, as native floats.
+ * @param requestp Pointer that gets the request ID.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_EINVAL Invalid input.
+ * @return ::NC_EINVALCOORDS Start out of range.
+ * @return ::NC_EEDGE Start plus count out of range.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+SION_iget_vara(int ncid, int varid, const size_t *startp,
+               const size_t *countp, float *value, int *requestp)
+{
+   NC *nc;
+   NC_GRP_INFO_T *grp;
+   NC_HDF5_FILE_INFO_T *h5;
+   NC_VAR_INFO_T *var;
+   SION_FILE_INFO_T *ab_file;
+   SION_REQ_T *req;
+   int ret;
+
+   LOG((2, "%s: ncid 0x%x varid %d", __func__, ncid, varid));
+
+   if (!startp || !countp || !value || !requestp)
+      return NC_EINVAL;
+
+   /* Look up the metadata now, on the caller's thread; the netCDF
+    * metadata lists are not thread-safe. */
+   if (!(nc = nc4_find_nc_file(ncid, &h5)))
+      return NC_EBADID;
+   if ((ret = nc4_find_g_var_nc(nc, ncid, varid, &grp, &var)))
+      return ret;
+   assert(h5 && h5->format_file_info && var && var->name);
+   ab_file = h5->format_file_info;
+
+   if (!(req = calloc(1, sizeof(SION_REQ_T))))
+      return NC_ENOMEM;
+
+   /* Coordinate vars are in memory or cached, so read them now and
+    * hand back a request that is already done. */
+   if (varid != ab_file->varid)
+   {
+      req->read.status = SION_get_vara(ncid, varid, startp, countp, value,
+                                       NC_FLOAT);
+      req->state = SION_REQ_DONE;
+   }
+   else
+   {
+      if ((ret = ab_check_vara(ab_file, startp, countp)))
+      {
+         free(req);
+         return ret;
+      }
+      if (ab_file->mpi && !ab_mpi_threaded(ab_file->mpi))
+      {
+         req->read.status = ab_read_vara(ab_file, startp, countp, value);
+         req->state = SION_REQ_DONE;
+      }
+      else
+      {
+         req->read.ab_file = ab_file;
+         memcpy(req->read.start, startp, SION_NDIMS3 * sizeof(size_t));
+         memcpy(req->read.count, countp, SION_NDIMS3 * sizeof(size_t));
+         req->read.value = value;
+         req->state = SION_REQ_QUEUED;
+      }
+   }
+
+   pthread_mutex_lock(&req_lock);
+   if ((ret = req_add(req)))
+   {
+      pthread_mutex_unlock(&req_lock);
+      free(req);
+      return ret;
+   }
+   *requestp = req->id;
+   if (req->state == SION_REQ_QUEUED)
+      pthread_cond_signal(&req_queued);
+   pthread_mutex_unlock(&req_lock);
+
+   return NC_NOERR;
+}
+
+/**
+ * Wait for a request started with SION_iget_vara() to finish, and
+ * release it. After this the request ID is no longer valid.
+ *
+ * @param request Request ID.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL No such request.
+ * @return Any error returned by the read itself.
+ * @author Ed Hartnett
+ */
+int
+SION_wait(int request)
+{
+   SION_REQ_T *req;
+   SION_REQ_T **prev;
+   int status;
+
+   pthread_mutex_lock(&req_lock);
+   if (!(req = req_find(request)))
+   {
+      pthread_mutex_unlock(&req_lock);
+      return NC_EINVAL;
+   }
+   while (req->state != SION_REQ_DONE)
+      pthread_cond_wait(&req_done, &req_lock);
+
+   /* Take it out of the list. */
+   for (prev = &req_list; *prev != req; prev = &(*prev)->next)
+      ;
+   *prev = req->next;
+   pthread_mutex_unlock(&req_lock);
+
+   status = req->read.status;
+   free(req);
+   return status;
+}
+
+/**
+ * Find out whether a request started with SION_iget_vara() has
+ * finished, without waiting. The request must still be collected
+ * with SION_wait().
+ *
+ * @param request Request ID.
+ * @param flagp Pointer that gets 1 if the request is done, 0
+ * otherwise.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL No such request, or NULL flagp.
+ * @author Ed Hartnett
+ */
+int
+SION_test(int request, int *flagp)
+{
+   SION_REQ_T *req;
+
+   if (!flagp)
+      return NC_EINVAL;
+
+   pthread_mutex_lock(&req_lock);
+   if (!(req = req_find(request)))
+   {
+      pthread_mutex_unlock(&req_lock);
+      return NC_EINVAL;
+   }
+   *flagp = (req->state == SION_REQ_DONE);
+   pthread_mutex_unlock(&req_lock);
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Wait until no queued or running request refers to a
+ * file. Called before the file is closed.
+ *
+ * @param ab_file Pointer to AB file info.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_async_drain(SION_FILE_INFO_T *ab_file)
+{
+   SION_REQ_T *req;
+
+   pthread_mutex_lock(&req_lock);
+   for (;;)
+   {
+      for (req = req_list; req; req = req->next)
+         if (req->read.ab_file == ab_file && req->state != SION_REQ_DONE)
+            break;
+      if (!req)
+         break;
+      pthread_cond_wait(&req_done, &req_lock);
+   }
+
+   /* Requests not yet waited on no longer need the file. */
+   for (req = req_list; req; req = req->next)
+      if (req->read.ab_file == ab_file)
+         req->read.ab_file = NULL;
+   pthread_mutex_unlock(&req_lock);
+}
@@ -0,0 +1,144 @@
+/**
+ * @file
+ * @internal Attribute functions for the AB dispatch layer.
+ *
+ * The per-record attributes of the data var (day, span, min, max)
+ * are as long as the time axis, so they are not built at open. These
+ * functions attach them the first time an attribute of the data var
+ * is asked about, then hand off to the netCDF-4 functions.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include "nc4internal.h"
+#include "nc4dispatch.h"
+#include "siondispatch.h"
+
+/**
+ * @internal Learn about an attribute.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID.
+ * @param name Name of attribute.
+ * @param xtypep Pointer that gets the type of the attribute.
+ * @param lenp Pointer that gets the length of the attribute.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTATT Attribute not found.
+ * @author Ed Hartnett
+ */
+int
+SION_inq_att(int ncid, int varid, const char *name, nc_type *xtypep,
+             size_t *lenp)
+{
+   int ret;
+
+   if ((ret = ab_add_rec_atts(ncid, varid)))
+      return ret;
+   return NC4_inq_att(ncid, varid, name, xtypep, lenp);
+}
+
+/**
+ * @internal Find the ID of an attribute.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID.
+ * @param name Name of attribute.
+ * @param idp Pointer that gets the attribute number.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTATT Attribute not found.
+ * @author Ed Hartnett
+ */
+int
+SION_inq_attid(int ncid, int varid, const char *name, int *idp)
+{
+   int ret;
+
+   if ((ret = ab_add_rec_atts(ncid, varid)))
+      return ret;
+   return NC4_inq_attid(ncid, varid, name, idp);
+}
+
+/**
+ * @internal Find the name of an attribute.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID.
+ * @param attnum Attribute number.
+ * @param name Pointer that gets the name.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTATT Attribute not found.
+ * @author Ed Hartnett
+ */
+int
+SION_inq_attname(int ncid, int varid, int attnum, char *name)
+{
+   int ret;
+
+   if ((ret = ab_add_rec_atts(ncid, varid)))
+      return ret;
+   return NC4_inq_attname(ncid, varid, attnum, name);
+}
+
+/**
+ * @internal Get the value of an attribute.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID.
+ * @param name Name of attribute.
+ * @param value Pointer that gets the attribute data.
+ * @param memtype The type the data should be converted to.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTATT Attribute not found.
+ * @return ::NC_ERANGE Range error when converting data.
+ * @author Ed Hartnett
+ */
+int
+SION_get_att(int ncid, int varid, const char *name, void *value,
+             nc_type memtype)
+{
+   int ret;
+
+   if ((ret = ab_add_rec_atts(ncid, varid)))
+      return ret;
+   return NC4_get_att(ncid, varid, name, value, memtype);
+}
+
+/**
+ * @internal Learn about a variable. The attribute count of the data
+ * var includes the per-record attributes, so they are attached
+ * first.
+ *
+ * See NC4_inq_var_all() for the parameters.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTVAR Bad varid.
+ * @author Ed Hartnett
+ */
+int
+SION_inq_var_all(int ncid, int varid, char *name, nc_type *xtypep,
+                 int *ndimsp, int *dimidsp, int *nattsp, int *shufflep,
+                 int *deflatep, int *deflate_levelp, int *fletcher32p,
+                 int *contiguousp, size_t *chunksizesp, int *no_fill,
+                 void *fill_valuep, int *endiannessp, unsigned int *idp,
+                 size_t *nparamsp, unsigned int *params)
+{
+   int ret;
+
+   /* Only the count of atts needs them. */
+   if (nattsp && (ret = ab_add_rec_atts(ncid, varid)))
+      return ret;
+   return NC4_inq_var_all(ncid, varid, name, xtypep, ndimsp, dimidsp, nattsp,
+                          shufflep, deflatep, deflate_levelp, fletcher32p,
+                          contiguousp, chunksizesp, no_fill, fill_valuep,
+                          endiannessp, idp, nparamsp, params);
+}
@@ -0,0 +1,296 @@
+/**
+ * @file
+ * @internal Opening many AB files at once.
+ *
+ * SION_open_many() opens and parses the A and B files of many AB
+ * files on a pool of threads, with ab_prepare_file(). The prepared
+ * files are then opened with nc_open() one at a time, in order, since
+ * the netCDF file and metadata lists are not thread-safe. Each
+ * prepared file is left in a stash, where ab_open_file() finds it
+ * instead of parsing the file again. The stash belongs to the thread
+ * calling nc_open(), which is the thread that runs ab_open_file(), so
+ * another thread opening the same path at the same time gets its own
+ * file.
+ *
+ * SION_open_mem() uses the same stash to open an AB file held in
+ * memory, since nc_open() only passes on a path.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <unistd.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal A prepared file, waiting for nc_open(). */
+typedef struct SION_STASH
+{
+   const char *path;
+   SION_FILE_INFO_T *ab_file;
+   SION_B_INFO_T *b_info;
+} SION_STASH_T;
+
+/* The prepared file of this thread not yet taken by
+ * ab_open_file(). */
+static __thread SION_STASH_T *stash = NULL;
+
+/** @internal Work shared by the threads of one SION_open_many(). */
+typedef struct SION_BULK
+{
+   const char **paths;
+   SION_FILE_INFO_T **ab_file; /* Prepared files, one per path. */
+   SION_B_INFO_T *b_info; /* Header info, one per path. */
+   int *status; /* Result of preparing each path. */
+   int nfiles;
+   int next; /* Next path to prepare. */
+   pthread_mutex_t lock; /* Protects next. */
+} SION_BULK_T;
+
+/**
+ * @internal Leave a prepared file for the ab_open_file() of the next
+ * nc_open() on this thread to find.
+ *
+ * @param entry Pointer to the stash entry.
+ */
+static void
+stash_put(SION_STASH_T *entry)
+{
+   assert(!stash);
+   stash = entry;
+}
+
+/**
+ * @internal Take a stash entry out of the stash, if it is still
+ * there.
+ *
+ * @param entry Pointer to the stash entry.
+ *
+ * @return 1 if it was there, 0 if already taken.
+ */
+static int
+stash_remove(SION_STASH_T *entry)
+{
+   int found = (stash == entry);
+
+   stash = NULL;
+   return found;
+}
+
+/**
+ * @internal Take the prepared file left by this thread for a path
+ * out of the stash, if there is one.
+ *
+ * @param path The B file name, as given to nc_open().
+ * @param ab_filep Pointer that gets the AB file info.
+ * @param b_info Pointer that gets a copy of the header info.
+ *
+ * @return 1 if a prepared file was found, 0 if not.
+ * @author Ed Hartnett
+ */
+int
+ab_stash_take(const char *path, SION_FILE_INFO_T **ab_filep,
+              SION_B_INFO_T *b_info)
+{
+   SION_STASH_T *entry = stash;
+
+   assert(path && ab_filep && b_info);
+
+   if (!entry || strcmp(entry->path, path))
+      return 0;
+   stash = NULL;
+   *ab_filep = entry->ab_file;
+   memcpy(b_info, entry->b_info, sizeof(SION_B_INFO_T));
+   return 1;
+}
+
+/**
+ * @internal A thread of SION_open_many(). Prepares files until there
+ * are none left.
+ *
+ * @param arg Pointer to the shared work.
+ *
+ * @return NULL.
+ */
+static void *
+bulk_main(void *arg)
+{
+   SION_BULK_T *bulk = arg;
+
+   for (;;)
+   {
+      int f;
+
+      pthread_mutex_lock(&bulk->lock);
+      f = bulk->next++;
+      pthread_mutex_unlock(&bulk->lock);
+      if (f >= bulk->nfiles)
+         break;
+
+      bulk->status[f] = ab_prepare_file(bulk->paths[f], &bulk->ab_file[f],
+                                        &bulk->b_info[f]);
+   }
+
+   return NULL;
+}
+
+/**
+ * Open an AB file whose B and A files are held in memory, for
+ * example as fetched from an object store, with no need to write
+ * them out first. The B file is parsed from its buffer, and data is
+ * read straight from the A file buffer. Both buffers must stay
+ * unchanged until the file is closed. The A file must not be
+ * compressed, and the shared record cache, overview levels and
+ * ::SION_OPEN_DIRECT do not apply. The other SION_OPEN_* flags in
+ * effect do.
+ *
+ * @param path Name for the file. Nothing is read from it, but the
+ * regional grid is looked for in its directory.
+ * @param mode Open mode, as for nc_open(). Must select the AB
+ * dispatch layer, for example NC_UF0.
+ * @param b_data The B file text.
+ * @param b_size Length of the B file text in bytes.
+ * @param a_data The A file bytes.
+ * @param a_size Length of the A file in bytes.
+ * @param ncidp Pointer that gets the ncid.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Invalid input, or bad B file.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the A file.
+ * @author Ed Hartnett
+ */
+int
+SION_open_mem(const char *path, int mode, const void *b_data, size_t b_size,
+              const void *a_data, size_t a_size, int *ncidp)
+{
+   SION_STASH_T entry;
+   SION_B_INFO_T b_info;
+   int ret;
+
+   LOG((1, "%s: path %s mode %d", __func__, path, mode));
+
+   if (!path || !b_data || !a_data || !ncidp)
+      return NC_EINVAL;
+
+   if ((ret = ab_prepare_mem(path, b_data, b_size, a_data, a_size,
+                             &entry.ab_file, &b_info)))
+      return ret;
+   entry.path = path;
+   entry.b_info = &b_info;
+   stash_put(&entry);
+   ret = nc_open(path, mode, ncidp);
+
+   /* If netCDF never got to the AB layer, it is still here. */
+   if (stash_remove(&entry))
+      ab_free_file(entry.ab_file);
+
+   return ret;
+}
+
+/**
+ * Open many AB files. The A and B files are opened and parsed in
+ * parallel, on up to one thread per processor, then the files are
+ * opened with nc_open() in order. The SION_OPEN_* flags in effect
+ * apply to all of them.
+ *
+ * Every file that can be opened is opened, even if others fail. Each
+ * file opened must be closed with nc_close() as usual.
+ *
+ * @param nfiles Number of files.
+ * @param paths Array of B file names.
+ * @param mode Open mode, as for nc_open(). Must select the AB
+ * dispatch layer, for example NC_UF0.
+ * @param ncids Array that gets the ncid of each file, or -1 for files
+ * that could not be opened.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Invalid input.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return The first error from any of the files.
+ * @author Ed Hartnett
+ */
+int
+SION_open_many(int nfiles, const char **paths, int mode, int *ncids)
+{
+   SION_BULK_T bulk;
+   SION_STASH_T *entry;
+   pthread_t thread[SION_OPEN_THREADS_MAX];
+   long nthreads;
+   int started = 0;
+   int ret = NC_NOERR;
+
+   LOG((1, "%s: nfiles %d mode %d", __func__, nfiles, mode));
+
+   if (nfiles < 0 || (nfiles && (!paths || !ncids)))
+      return NC_EINVAL;
+   if (!nfiles)
+      return NC_NOERR;
+
+   memset(&bulk, 0, sizeof(SION_BULK_T));
+   bulk.paths = paths;
+   bulk.nfiles = nfiles;
+   bulk.ab_file = calloc(nfiles, sizeof(SION_FILE_INFO_T *));
+   bulk.b_info = malloc(nfiles * sizeof(SION_B_INFO_T));
+   bulk.status = malloc(nfiles * sizeof(int));
+   entry = malloc(nfiles * sizeof(SION_STASH_T));
+   if (!bulk.ab_file || !bulk.b_info || !bulk.status || !entry)
+   {
+      free(entry);
+      free(bulk.status);
+      free(bulk.b_info);
+      free(bulk.ab_file);
+      return NC_ENOMEM;
+   }
+   pthread_mutex_init(&bulk.lock, NULL);
+
+   /* Prepare the files on a thread per processor, but no more
+    * threads than files. */
+   if ((nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+      nthreads = 1;
+   if (nthreads > SION_OPEN_THREADS_MAX)
+      nthreads = SION_OPEN_THREADS_MAX;
+   if (nthreads > nfiles)
+      nthreads = nfiles;
+   LOG((2, "%s: %ld threads", __func__, nthreads));
+   for (int t = 1; t < nthreads; t++)
+   {
+      if (pthread_create(&thread[t], NULL, bulk_main, &bulk))
+         break;
+      started++;
+   }
+   bulk_main(&bulk);
+   for (int t = 1; t <= started; t++)
+      pthread_join(thread[t], NULL);
+   pthread_mutex_destroy(&bulk.lock);
+
+   /* Now open them with netCDF, in order, one at a time. */
+   for (int f = 0; f < nfiles; f++)
+   {
+      int status = bulk.status[f];
+
+      ncids[f] = -1;
+      if (!status)
+      {
+         entry[f].path = paths[f];
+         entry[f].ab_file = bulk.ab_file[f];
+         entry[f].b_info = &bulk.b_info[f];
+         stash_put(&entry[f]);
+         status = nc_open(paths[f], mode, &ncids[f]);
+
+         /* If netCDF never got to the AB layer, it is still here. */
+         if (stash_remove(&entry[f]))
+            ab_free_file(entry[f].ab_file);
+         if (status)
+            ncids[f] = -1;
+      }
+      if (status && !ret)
+         ret = status;
+   }
+
+   free(entry);
+   free(bulk.status);
+   free(bulk.b_info);
+   free(bulk.ab_file);
+   return ret;
+}
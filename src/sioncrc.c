@@ -0,0 +1,543 @@
+/**
+ * @file
+ * @internal Record checksums of AB files, to catch silent corruption.
+ *
+ * SION_build_checksums() makes a sidecar file next to an AB file,
+ * named like the B file but ending in .crc, holding the CRC32C of the
+ * data of every record of the A file, not counting its padding, in
+ * one pass over it. Files opened with ::SION_OPEN_VERIFY check a
+ * record against the sidecar the first time a read fetches the whole
+ * record from the A file, on the bytes that read fetched, so checking
+ * costs no extra I/O. The result is remembered, so a record is checked
+ * once per open. A record that does not match cannot be read; NC_EIO
+ * is returned for every read of it after that.
+ *
+ * Reads of part of a record are not checked, unless the record is
+ * already known to be bad. Records found in the shared memory cache
+ * are not read, so are not checked. Iterators over verified files
+ * read their records rather than map them, so they are checked.
+ *
+ * SION_verify_checksums() checks a whole file against its sidecar.
+ *
+ * The CRC32C instruction of SSE 4.2 is used when the library is built
+ * for it (e.g. -msse4.2 or -march=native); otherwise a table driven
+ * version, 8 bytes at a time.
+ *
+ * The sidecar is a header, then one CRC per record, in host byte
+ * order. Records appended after it was built are not checked. It is
+ * not used by files opened in parallel.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+/** @internal Starts every checksum sidecar. */
+#define SION_CRC_MAGIC "SIONCRC2"
+
+/** @internal Reads back as this only in the byte order it was
+ * written in. */
+#define SION_CRC_ORDER 0x01020304
+
+/** @internal Ending of checksum sidecar names. */
+#define SION_CRC_SUFFIX ".crc"
+
+/** @internal CRC32C polynomial, reflected. */
+#define SION_CRC_POLY 0x82f63b78
+
+/** @internal States of a record of a file being verified. */
+#define SION_CRC_UNCHECKED 0
+#define SION_CRC_GOOD 1
+#define SION_CRC_BAD 2
+
+/** @internal Header of a checksum sidecar. */
+typedef struct SION_CRC_HDR
+{
+   char magic[8];
+   uint32_t order;
+   int32_t t_len;
+   int32_t j_len;
+   int32_t i_len;
+} SION_CRC_HDR_T;
+
+/** @internal Record checksums of an open file. */
+struct SION_CRC
+{
+   int t_len; /* Records with a checksum. */
+   uint32_t *sum;
+   uint8_t *state; /* SION_CRC_* of each record. */
+};
+
+#ifndef __SSE4_2__
+/** @internal Tables for 8 bytes at a time. */
+static uint32_t crc_table[8][256];
+
+/** @internal Makes the tables once. */
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @internal Make the CRC32C tables.
+ */
+static void
+make_crc_table(void)
+{
+   for (uint32_t n = 0; n < 256; n++)
+   {
+      uint32_t c = n;
+
+      for (int k = 0; k < 8; k++)
+         c = c & 1 ? (c >> 1) ^ SION_CRC_POLY : c >> 1;
+      crc_table[0][n] = c;
+   }
+   for (int k = 1; k < 8; k++)
+      for (int n = 0; n < 256; n++)
+         crc_table[k][n] = (crc_table[k - 1][n] >> 8) ^
+            crc_table[0][crc_table[k - 1][n] & 0xff];
+}
+#endif
+
+/**
+ * @internal Find the CRC32C of some bytes.
+ *
+ * @param crc CRC of the bytes before, 0 to start.
+ * @param buf The bytes.
+ * @param len Number of bytes.
+ *
+ * @return The CRC32C.
+ * @author Ed Hartnett
+ */
+uint32_t
+ab_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+   const unsigned char *p = buf;
+
+   crc = ~crc;
+#ifdef __SSE4_2__
+   for (; len >= 8; p += 8, len -= 8)
+   {
+      uint64_t v;
+
+      memcpy(&v, p, sizeof(v));
+      crc = (uint32_t)_mm_crc32_u64(crc, v);
+   }
+   for (; len; len--)
+      crc = _mm_crc32_u8(crc, *p++);
+#else
+   pthread_once(&crc_table_once, make_crc_table);
+   for (; len >= 8; p += 8, len -= 8)
+   {
+      uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+
+      crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+         crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+         crc_table[3][p[4]] ^ crc_table[2][p[5]] ^ crc_table[1][p[6]] ^
+         crc_table[0][p[7]];
+   }
+   for (; len; len--)
+      crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+#endif
+   return ~crc;
+}
+
+/**
+ * @internal Get the name of the checksum sidecar of an AB file.
+ *
+ * @param path Path of the B file.
+ * @param crc_path Buffer of PATH_MAX that gets the sidecar path.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Name does not end in .b, or is too long.
+ */
+static int
+crc_name(const char *path, char *crc_path)
+{
+   size_t len = strlen(path);
+
+   if (len < 2 || strcmp(path + len - 2, ".b") ||
+       len - 2 + sizeof(SION_CRC_SUFFIX) > PATH_MAX)
+      return NC_EINVAL;
+   memcpy(crc_path, path, len - 2);
+   strcpy(crc_path + len - 2, SION_CRC_SUFFIX);
+   return NC_NOERR;
+}
+
+/**
+ * @internal Read the checksum sidecar of an AB file.
+ *
+ * @param ab_file Pointer to AB file info, with the shape set.
+ * @param path Path of the B file.
+ * @param crcp Pointer that gets the checksums.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOTFOUND No sidecar.
+ * @return ::NC_EINVAL Sidecar is not for this file.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the sidecar.
+ */
+static int
+crc_read(SION_FILE_INFO_T *ab_file, const char *path, SION_CRC_T **crcp)
+{
+   char crc_path[PATH_MAX];
+   SION_CRC_HDR_T hdr;
+   SION_CRC_T *crc;
+   FILE *f;
+   int ret = NC_NOERR;
+
+   if ((ret = crc_name(path, crc_path)))
+      return ret;
+   if (!(f = fopen(crc_path, "r")))
+      return NC_ENOTFOUND;
+   if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+      ret = NC_EIO;
+   else if (memcmp(hdr.magic, SION_CRC_MAGIC, sizeof(hdr.magic)) ||
+            hdr.order != SION_CRC_ORDER || hdr.t_len < 0 ||
+            hdr.j_len != ab_file->j_len || hdr.i_len != ab_file->i_len)
+      ret = NC_EINVAL;
+   if (ret)
+   {
+      fclose(f);
+      return ret;
+   }
+
+   if (!(crc = calloc(1, sizeof(SION_CRC_T))) ||
+       !(crc->sum = malloc((hdr.t_len + 1) * sizeof(uint32_t))) ||
+       !(crc->state = calloc(hdr.t_len + 1, sizeof(uint8_t))))
+      ret = NC_ENOMEM;
+   else if (fread(crc->sum, sizeof(uint32_t), hdr.t_len, f) != hdr.t_len)
+      ret = NC_EIO;
+   fclose(f);
+   if (ret)
+   {
+      ab_crc_close(crc);
+      return ret;
+   }
+   crc->t_len = hdr.t_len;
+   *crcp = crc;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Open the checksum sidecar of an AB file opened with
+ * ::SION_OPEN_VERIFY. A missing or unmatched sidecar is not an error;
+ * the file is simply not verified.
+ *
+ * @param ab_file Pointer to AB file info, with the shape set.
+ * @param path Path of the B file.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_crc_open(SION_FILE_INFO_T *ab_file, const char *path)
+{
+   int ret;
+
+   assert(ab_file && path);
+
+   ret = crc_read(ab_file, path, &ab_file->crc);
+   if (ret == NC_ENOMEM)
+      return ret;
+   if (ret)
+      LOG((2, "%s: no usable checksums for %s", __func__, path));
+   return NC_NOERR;
+}
+
+/**
+ * @internal Free the checksums of a file.
+ *
+ * @param crc Pointer to the checksums. Ignored if NULL.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_crc_close(SION_CRC_T *crc)
+{
+   if (!crc)
+      return;
+   free(crc->state);
+   free(crc->sum);
+   free(crc);
+}
+
+/**
+ * @internal Find the length of the data of a record, without its
+ * padding. This is what the checksums cover.
+ *
+ * @param ab_file Pointer to AB file info.
+ *
+ * @return The length in bytes.
+ */
+static size_t
+data_len(SION_FILE_INFO_T *ab_file)
+{
+   return (size_t)ab_file->j_len * ab_file->i_len * sizeof(float);
+}
+
+/**
+ * @internal Find the CRC32C of the data of one record of the A file.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param bufr Buffer of rec_len bytes.
+ * @param t Record.
+ * @param sump Pointer that gets the CRC.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Could not read the A file.
+ */
+static int
+rec_crc(SION_FILE_INFO_T *ab_file, void *bufr, size_t t, uint32_t *sump)
+{
+   int ret;
+
+   if ((ret = ab_read_raw(ab_file, (off_t)t * ab_file->rec_len,
+                          data_len(ab_file), bufr)))
+      return ret;
+   *sump = ab_crc32c(0, bufr, data_len(ab_file));
+   return NC_NOERR;
+}
+
+/**
+ * @internal Find out if a record of a file is still to be checked.
+ * Reads that fetch the whole record use this to decide whether to
+ * work out its CRC.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param t Record.
+ *
+ * @return Non-zero if the record has a checksum, not yet checked.
+ * @author Ed Hartnett
+ */
+int
+ab_crc_wanted(SION_FILE_INFO_T *ab_file, size_t t)
+{
+   SION_CRC_T *crc = ab_file->crc;
+
+   return crc && t < crc->t_len &&
+      __atomic_load_n(&crc->state[t], __ATOMIC_ACQUIRE) == SION_CRC_UNCHECKED;
+}
+
+/**
+ * @internal Check the CRC of the data of a record, worked out by the
+ * read that fetched it, and remember the result. Two threads may
+ * check the same record; both get the same answer.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param t Record.
+ * @param sum CRC32C of the data of the record, as read.
+ *
+ * @return ::NC_NOERR No error, or the record has no checksum.
+ * @return ::NC_EIO The record does not match its checksum.
+ * @author Ed Hartnett
+ */
+int
+ab_crc_record(SION_FILE_INFO_T *ab_file, size_t t, uint32_t sum)
+{
+   SION_CRC_T *crc = ab_file->crc;
+   int state;
+
+   if (!crc || t >= crc->t_len)
+      return NC_NOERR;
+   state = sum == crc->sum[t] ? SION_CRC_GOOD : SION_CRC_BAD;
+   __atomic_store_n(&crc->state[t], state, __ATOMIC_RELEASE);
+   if (state == SION_CRC_BAD)
+   {
+      LOG((0, "%s: record %zu does not match its checksum", __func__, t));
+      return NC_EIO;
+   }
+   return NC_NOERR;
+}
+
+/**
+ * @internal Check bytes just read from the A file of a verified file.
+ * If they are the whole data of a record not yet checked, its CRC is
+ * worked out and checked. Otherwise, only a record already found bad
+ * is refused.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param off Offset of the bytes in the A file.
+ * @param len Number of bytes. They must all be in one record.
+ * @param buf The bytes, as read.
+ *
+ * @return ::NC_NOERR No error, or the file is not verified.
+ * @return ::NC_EIO The record does not match its checksum.
+ * @author Ed Hartnett
+ */
+int
+ab_crc_span(SION_FILE_INFO_T *ab_file, off_t off, size_t len, const void *buf)
+{
+   SION_CRC_T *crc = ab_file->crc;
+   size_t t;
+   int state;
+
+   if (!crc)
+      return NC_NOERR;
+   t = off / ab_file->rec_len;
+   if (t >= crc->t_len)
+      return NC_NOERR;
+
+   state = __atomic_load_n(&crc->state[t], __ATOMIC_ACQUIRE);
+   if (state == SION_CRC_BAD)
+      return NC_EIO;
+   if (state == SION_CRC_UNCHECKED && off == (off_t)t * ab_file->rec_len &&
+       len >= data_len(ab_file))
+      return ab_crc_record(ab_file, t, ab_crc32c(0, buf, data_len(ab_file)));
+   return NC_NOERR;
+}
+
+/**
+ * Build the checksums of an AB file, in a sidecar named like the B
+ * file but ending in .crc, with the CRC32C of the data of every
+ * record of the A file. Build it again after the A file is rewritten; records
+ * appended later are not checked until then.
+ *
+ * Files already open do not see the new sidecar.
+ *
+ * @param path Path of the B file.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Invalid input.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the AB file or write the sidecar.
+ * @author Ed Hartnett
+ */
+int
+SION_build_checksums(const char *path)
+{
+   char crc_path[PATH_MAX], tmp_path[PATH_MAX + 4];
+   SION_FILE_INFO_T *ab_file;
+   SION_B_INFO_T b_info;
+   SION_CRC_HDR_T hdr;
+   void *bufr = NULL;
+   FILE *f;
+   int ret;
+
+   LOG((1, "%s: path %s", __func__, path));
+
+   if (!path)
+      return NC_EINVAL;
+   if ((ret = crc_name(path, crc_path)))
+      return ret;
+   if ((ret = ab_prepare_file(path, &ab_file, &b_info)))
+      return ret;
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, SION_CRC_MAGIC, sizeof(hdr.magic));
+   hdr.order = SION_CRC_ORDER;
+   hdr.t_len = ab_file->t_len;
+   hdr.j_len = ab_file->j_len;
+   hdr.i_len = ab_file->i_len;
+
+   /* Write to a temporary file, and rename it when done, so readers
+    * never see half a sidecar. */
+   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", crc_path);
+   if (!(f = fopen(tmp_path, "w")))
+   {
+      ab_free_file(ab_file);
+      return NC_EIO;
+   }
+   if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+      ret = NC_EIO;
+   if (!ret)
+      ret = ab_pool_get(&ab_file->pool, &bufr);
+
+   /* One pass over the A file. */
+   for (int t = 0; !ret && t < hdr.t_len; t++)
+   {
+      uint32_t sum;
+
+      if (!(ret = rec_crc(ab_file, bufr, t, &sum)) &&
+          fwrite(&sum, sizeof(sum), 1, f) != 1)
+         ret = NC_EIO;
+   }
+
+   if (bufr)
+      ab_pool_put(&ab_file->pool, bufr);
+   ab_free_file(ab_file);
+   if (fclose(f) && !ret)
+      ret = NC_EIO;
+   if (!ret && rename(tmp_path, crc_path))
+      ret = NC_EIO;
+   if (ret)
+      remove(tmp_path);
+
+   return ret;
+}
+
+/**
+ * Check every record of an AB file against the checksums in its
+ * sidecar, made by SION_build_checksums().
+ *
+ * @param path Path of the B file.
+ * @param nbad_max Most bad record numbers to put in bad.
+ * @param bad Array that gets the first nbad_max bad record numbers.
+ * Ignored if NULL.
+ * @param nbadp Pointer that gets the number of bad records. Ignored if
+ * NULL.
+ *
+ * @return ::NC_NOERR No error, whether or not records are bad.
+ * @return ::NC_ENOTFOUND No sidecar.
+ * @return ::NC_EINVAL Invalid input, or sidecar not for this file.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the AB file or sidecar, or the
+ * sidecar has more records than the A file.
+ * @author Ed Hartnett
+ */
+int
+SION_verify_checksums(const char *path, size_t nbad_max, size_t *bad,
+                      size_t *nbadp)
+{
+   SION_FILE_INFO_T *ab_file;
+   SION_B_INFO_T b_info;
+   SION_CRC_T *crc;
+   void *bufr = NULL;
+   size_t nbad = 0;
+   int ret;
+
+   LOG((1, "%s: path %s", __func__, path));
+
+   if (!path)
+      return NC_EINVAL;
+   if ((ret = ab_prepare_file(path, &ab_file, &b_info)))
+      return ret;
+   if ((ret = crc_read(ab_file, path, &crc)))
+   {
+      ab_free_file(ab_file);
+      return ret;
+   }
+   if (crc->t_len > ab_file->t_len)
+      ret = NC_EIO;
+   if (!ret)
+      ret = ab_pool_get(&ab_file->pool, &bufr);
+
+   for (int t = 0; !ret && t < crc->t_len; t++)
+   {
+      uint32_t sum;
+
+      if ((ret = rec_crc(ab_file, bufr, t, &sum)))
+         break;
+      if (sum != crc->sum[t])
+      {
+         if (bad && nbad < nbad_max)
+            bad[nbad] = t;
+         nbad++;
+      }
+   }
+   if (bufr)
+      ab_pool_put(&ab_file->pool, bufr);
+
+   ab_crc_close(crc);
+   ab_free_file(ab_file);
+   if (!ret && nbadp)
+      *nbadp = nbad;
+
+   return ret;
+}
@@ -40,12 +40,12 @@ NC4_inq_dim,
 NC4_inq_unlimdim,
 NC_RO_rename_dim,
 
-NC4_inq_att,
-NC4_inq_attid,
-NC4_inq_attname,
+SION_inq_att,
+SION_inq_attid,
+SION_inq_attname,
 NC_RO_rename_att,
 NC_RO_del_att,
-NC4_get_att,
+SION_get_att,
 NC_RO_put_att,
 
 NC_RO_def_var,
@@ -58,9 +58,9 @@ NCDEFAULT_put_vars,
 NCDEFAULT_get_varm,
 NCDEFAULT_put_varm,
 
-NC4_inq_var_all,
+SION_inq_var_all,
 
-NC_NOTNC4_var_par_access,
+SION_var_par_access,
 NC_RO_def_var_fill,
 
 NC4_show_metadata,
@@ -20,12 +20,47 @@
 #define PNAME_NAME "long_name"
 #define SNAME_NAME "standard_name"
 #define CONVENTIONS "Conventions"
+#define COORDINATES_NAME "coordinates"
+#define CELL_METHODS_NAME "cell_methods"
+#define WINDOW_NAME "window"
 #define CF_VERSION "CF-1.0"
    
 extern int nc4_vararray_add(NC_GRP_INFO_T *grp, NC_VAR_INFO_T *var);
 
 /** @internal These flags may not be set for open mode. */
+#ifdef HAVE_MPI
+static const int ILLEGAL_OPEN_FLAGS = (NC_MMAP|NC_64BIT_OFFSET|NC_MPIPOSIX|NC_DISKLESS);
+#else
 static const int ILLEGAL_OPEN_FLAGS = (NC_MMAP|NC_64BIT_OFFSET|NC_MPIIO|NC_MPIPOSIX|NC_DISKLESS);
+#endif
+
+/** @internal SION_OPEN_* flags used for files opened from now on. */
+static int ab_open_flags = 0;
+
+/** @internal Records in each window of the time reductions of files
+ * opened from now on, 0 for all. */
+static int ab_reduce_window = 0;
+
+/** @internal The header and grid of a file. Files with the same
+ * ones share one, with the header attribute text, the type info of
+ * every var and the fill value, which netCDF sees through pointers
+ * taken back by ab_detach_shared() at close. It is interned, so
+ * compared as bytes, and must be zeroed before it is filled in. */
+struct SION_HEADER
+{
+   int j_len;
+   int i_len;
+   int num_header_atts;
+   char header_att[MAX_HEADER_ATTS][MAX_B_LINE_LEN];
+   char var_name[NC_MAX_NAME + 1];
+   NC_TYPE_INFO_T type_info; /* NC_FLOAT, the type of every var. */
+   float fill_value; /* Of the data var and its time reductions. */
+};
+
+/** @internal All the SION_OPEN_* flags. */
+static const int SION_OPEN_ALL = (SION_OPEN_HUGEPAGES|SION_OPEN_DIRECT|
+                                  SION_OPEN_INSTANT|SION_OPEN_GRID|
+                                  SION_OPEN_REDUCE|SION_OPEN_VERIFY);
 
 static void
 trim(char *s)
@@ -42,78 +77,73 @@ trim(char *s)
 }   
 
 /**
- * @internal Parse the B file for metadata info.
+ * @internal Is this line blank?
  *
- * @param h5 Pointer to file info.
- * @param num_header_atts Pointer that gets the number of header
- * attributes.
- * @param header_att Pointer to an array of fixed size which gets the
- * header atts.
- * @param var_name Pointer that gets variable name.
- * @param t_len Pointer that gets length of time dimension.
+ * @param line The line.
+ *
+ * @return 1 if the line is all white space, 0 otherwise.
+ */
+static int
+blank_line(const char *line)
+{
+   for (int p = 0; p < strlen(line); p++)
+      if (!isspace(line[p]))
+         return 0;
+   return 1;
+}
+
+/**
+ * @internal Parse the header of the B file for metadata info. This
+ * reads up to the i/jdm line, and then the first record line, for
+ * the name of the variable. The offset of the record lines is kept
+ * in rec_pos, for ab_load_b_records().
+ *
+ * @param ab_file Pointer to AB file info, with b_file open.
+ * @param b_info Pointer that gets the header atts and variable name.
+ * @param t_len Pointer that gets length of time dimension, the
+ * number of record lines. If NULL, the record lines are not read
+ * past the first.
  * @param i_len Pointer that gets length of the i dimension.
  * @param j_len Pointer that gets length of the j dimension.
- * @param time Pointer to a pointer that gets array of time values,
- * of length t_len. Must be freed by caller.
- * @param span Pointer to a pointer that gets array of span values,
- * of length t_len. Must be freed by caller.
- * @param min Pointer to a pointer that gets array of minimum values,
- * of length t_len. Must be freed by caller.
- * @param max Pointer to a pointer that gets array of maximum values,
- * of length t_len. Must be freed by caller.
  *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL No i/jdm line or no records.
  * @author Ed Hartnett
  */
 static int
-parse_b_file(NC_HDF5_FILE_INFO_T *h5, int *num_header_atts,
-             char header_att[MAX_HEADER_ATTS][MAX_B_LINE_LEN],
-             char *var_name, int *t_len, int *i_len, int *j_len, float **time,
-             float **span, float **min, float **max)
+parse_b_file(SION_FILE_INFO_T *ab_file, SION_B_INFO_T *b_info, int *t_len,
+             int *i_len, int *j_len)
 {
-   SION_FILE_INFO_T *ab_file;
+   int *num_header_atts = &b_info->num_header_atts;
+   char *var_name = b_info->var_name;
    char line[MAX_B_LINE_LEN + 1];
    int header = 1;
-   int time_start_pos = 0;
-   int time_count = 0;
 
    /* Check inputs. */
-   assert(h5 && h5->format_file_info && t_len && i_len && j_len && num_header_atts
-          && header_att && var_name && time && span && min && max);
-
-   /* Get the AB-specific file metadata. */
-   ab_file = h5->format_file_info;
-   assert(ab_file->b_file);
+   assert(ab_file && ab_file->b_file && b_info && i_len && j_len);
 
-   /* Start record and header atts count at zero. */
-   *t_len = 0;
+   /* Start header atts count at zero. */
    *num_header_atts = 0;
+   var_name[0] = 0;
 
-   /* Read the B file line by line. */
-   while(fgets(line, sizeof(line), ab_file->b_file))
+   /* Read the B file header line by line. */
+   while(header && fgets(line, sizeof(line), ab_file->b_file))
    {
-      /* Is this line blank? */
-      int blank = 1;
-      for (int p = 0; p < strlen(line); p++)
-         if (!isspace(line[p]))
-         {
-            blank = 0;
-            break;
-         }
-
       /* Skip blank lines. */
-      if (blank)
+      if (blank_line(line))
          continue;
 
       /* Have we reached last line of header? */
       if (!(strncmp(line, SION_DIMSIZE_STRING, sizeof(SION_DIMSIZE_STRING) - 1)))
       {
          char *tok = line;
-         char i_val[SION_MAX_DIM_DIGITS + 1];
-         char j_val[SION_MAX_DIM_DIGITS + 1];
+         char *save;
+         char i_val[SION_MAX_DIM_DIGITS + 1] = "";
+         char j_val[SION_MAX_DIM_DIGITS + 1] = "";
          int tok_count = 0;
 
          /* Get the i/j values. */
-         while ((tok = strtok(tok, " ")) != NULL)
+         while ((tok = strtok_r(tok, " ", &save)) != NULL)
          {
             if (tok_count == 2)
                strncpy(i_val, tok, SION_MAX_DIM_DIGITS);
@@ -128,100 +158,335 @@ parse_b_file(NC_HDF5_FILE_INFO_T *h5, int *num_header_atts,
 
          /* Remember we are done with header. */
          header = 0;
+         ab_file->rec_pos = ftello(ab_file->b_file);
       }
-      
-      if (header)
+      else
       {
          LOG((3, "header = %d %s", header, line));
          if (*num_header_atts < MAX_HEADER_ATTS)
          {
-            char hdr[MAX_B_LINE_LEN + 1];
+            char hdr[MAX_B_LINE_LEN + 1] = "";
             /* Lose last char - a line feed. */
             strncpy(hdr, line, strlen(line) - 1);
             trim(hdr);
             LOG((3, "hdr %s!", hdr));
-            strncpy(header_att[*num_header_atts], hdr, MAX_B_LINE_LEN);
+            strncpy(b_info->header_att[*num_header_atts], hdr, MAX_B_LINE_LEN);
             (*num_header_atts)++;
          }
       }
-      else
+   }
+   if (header)
+      return NC_EINVAL;
+
+   /* The variable is named at the start of each record line. Count
+    * the record lines, unless told not to. */
+   if (t_len)
+      *t_len = 0;
+   while(fgets(line, sizeof(line), ab_file->b_file))
+   {
+      if (blank_line(line))
+         continue;
+      if (!strlen(var_name))
       {
-         if (!time_start_pos)
-            time_start_pos = ftell(ab_file->b_file);
-         (*t_len)++;
+         char *colon;
+
+         if (!(colon = index(line, ':')) || colon - line > NC_MAX_NAME)
+            return NC_EINVAL;
+         strncpy(var_name, line, colon - line);
+         var_name[colon - line] = 0;
+         trim(var_name);
       }
+      if (!t_len)
+         break;
+      (*t_len)++;
    }
-   (*t_len)--;
+   if (!strlen(var_name))
+      return NC_EINVAL;
 
-   /* Allocate storage for the time, span, min, and max values. */
-   if (!(*time = malloc(*t_len * sizeof(float))))
-      return NC_ENOMEM;
-   if (!(*span = malloc(*t_len * sizeof(float))))
+   return NC_NOERR;
+}
+
+/**
+ * @internal Get the time, span, min, and max from a record line of
+ * the B file. Values not on the line are left as they are.
+ *
+ * @param line The line. It is changed by strtok_r().
+ * @param val Array that gets the NUM_SION_VAR_ATTS values.
+ */
+static void
+parse_rec_line(char *line, float *val)
+{
+   char *tok = line;
+   char *save;
+   int tok_count = 0;
+
+   while ((tok = strtok_r(tok, " ", &save)) != NULL)
+   {
+      LOG((3, "tok_count %d tok %s", tok_count, tok));
+      if (tok_count >= 3 && tok_count < 3 + NUM_SION_VAR_ATTS)
+         sscanf(tok, "%f", &val[tok_count - 3]);
+      tok_count++;
+      tok = NULL;
+   }
+}
+
+/**
+ * @internal Allocate per-record arrays for t_len records, holding
+ * the float fill value. One extra value each, so a file with no
+ * records still gets arrays.
+ *
+ * @param t_len Number of records.
+ * @param rec_timep Pointer that gets the time and span array.
+ * @param rec_rangep Pointer that gets the min and max array.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ */
+static int
+new_rec_data(int t_len, float **rec_timep, float **rec_rangep)
+{
+   size_t n_time = SION_REC_TIME_ATTS * (size_t)t_len + 1;
+   size_t n_range = (NUM_SION_VAR_ATTS - SION_REC_TIME_ATTS) * (size_t)t_len + 1;
+   float *rec_time = malloc(n_time * sizeof(float));
+   float *rec_range = malloc(n_range * sizeof(float));
+
+   if (!rec_time || !rec_range)
+   {
+      free(rec_range);
+      free(rec_time);
       return NC_ENOMEM;
-   if (!(*min = malloc(*t_len * sizeof(float))))
+   }
+   for (size_t v = 0; v < n_time; v++)
+      rec_time[v] = NC_FILL_FLOAT;
+   for (size_t v = 0; v < n_range; v++)
+      rec_range[v] = NC_FILL_FLOAT;
+   *rec_timep = rec_time;
+   *rec_rangep = rec_range;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Put the time, span, min and max of one record into
+ * per-record arrays.
+ *
+ * @param rec_time The time and span array.
+ * @param rec_range The min and max array.
+ * @param t_len Number of records the arrays hold.
+ * @param t The record.
+ * @param val The NUM_SION_VAR_ATTS values of the record.
+ */
+static void
+put_rec_data(float *rec_time, float *rec_range, int t_len, int t,
+             const float *val)
+{
+   for (int a = 0; a < NUM_SION_VAR_ATTS; a++)
+      if (a < SION_REC_TIME_ATTS)
+         rec_time[(size_t)a * t_len + t] = val[a];
+      else
+         rec_range[(size_t)(a - SION_REC_TIME_ATTS) * t_len + t] = val[a];
+}
+
+/**
+ * @internal Intern new per-record arrays of a file, in place of the
+ * ones it had. The days and spans are kept apart from the data
+ * ranges, since files with the same records often differ only in
+ * their data.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param rec_time Time and span array for t_len records, from
+ * new_rec_data() or malloc(). Freed on error.
+ * @param rec_range Min and max array, the same way.
+ * @param t_len Number of records.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_intern_rec_data(SION_FILE_INFO_T *ab_file, float *rec_time,
+                   float *rec_range, int t_len)
+{
+   size_t time_len = (SION_REC_TIME_ATTS * (size_t)t_len + 1) * sizeof(float);
+   size_t range_len = ((NUM_SION_VAR_ATTS - SION_REC_TIME_ATTS) *
+                       (size_t)t_len + 1) * sizeof(float);
+
+   assert(ab_file && rec_time && rec_range);
+
+   if (ab_intern((void **)&rec_time, time_len))
+   {
+      free(rec_range);
+      free(rec_time);
       return NC_ENOMEM;
-   if (!(*max = malloc(*t_len * sizeof(float))))
+   }
+   if (ab_intern((void **)&rec_range, range_len))
+   {
+      free(rec_range);
+      ab_unintern(rec_time);
       return NC_ENOMEM;
+   }
+   ab_unintern(ab_file->rec_time);
+   ab_unintern(ab_file->rec_range);
+   ab_file->rec_time = rec_time;
+   ab_file->rec_range = rec_range;
 
-   /* Now go back and get the time info. */
-   fseek(ab_file->b_file, time_start_pos, SEEK_SET);
-   while(fgets(line, sizeof(line), ab_file->b_file))
-   {
-      char *tok = line;
-      int tok_count = 0;
-      int var_named = 0;
+   return NC_NOERR;
+}
 
-      /* Is this line blank? */
-      int blank = 1;
-      for (int p = 0; p < strlen(line); p++)
-         if (!isspace(line[p]))
-         {
-            blank = 0;
-            break;
-         }
+/**
+ * @internal Read the time, span, min, and max of each record from
+ * the record lines of the B file, if not already read. They go in
+ * two arrays, see SION_REC_ATT(), which are interned, so files with
+ * the same records share them. Records missing from the B file get
+ * the float fill value.
+ *
+ * @param ab_file Pointer to AB file info, with t_len and rec_pos
+ * set.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the B file.
+ * @author Ed Hartnett
+ */
+int
+ab_load_b_records(SION_FILE_INFO_T *ab_file)
+{
+   char line[MAX_B_LINE_LEN + 1];
+   float *rec_time, *rec_range;
+   int time_count = 0;
+   int ret;
+
+   assert(ab_file);
+   if (ab_file->rec_time)
+      return NC_NOERR;
+   assert(ab_file->b_file);
+   LOG((2, "%s: t_len %d", __func__, ab_file->t_len));
+
+   if ((ret = new_rec_data(ab_file->t_len, &rec_time, &rec_range)))
+      return ret;
+
+   /* Go to the record lines and get the time info. */
+   if (fseeko(ab_file->b_file, ab_file->rec_pos, SEEK_SET))
+   {
+      free(rec_range);
+      free(rec_time);
+      return NC_EIO;
+   }
+   while(time_count < ab_file->t_len &&
+         fgets(line, sizeof(line), ab_file->b_file))
+   {
+      float val[NUM_SION_VAR_ATTS] = {NC_FILL_FLOAT, NC_FILL_FLOAT,
+                                      NC_FILL_FLOAT, NC_FILL_FLOAT};
 
       /* Skip blank lines. */
-      if (blank)
+      if (blank_line(line))
          continue;
 
-      /* Get the time values. */
-      while ((tok = strtok(tok, " ")) != NULL)
+      /* Get the time, span, min, and max values, in that order. */
+      parse_rec_line(line, val);
+      LOG((3, "t %d time %f span %f min %f max %f", time_count, val[0],
+           val[1], val[2], val[3]));
+      put_rec_data(rec_time, rec_range, ab_file->t_len, time_count, val);
+      time_count++;
+   }
+
+   /* Remember where to pick up if the file grows. */
+   ab_file->b_recs = time_count;
+   ab_file->b_end = ftello(ab_file->b_file);
+
+   /* Files with the same records share the arrays. */
+   return ab_intern_rec_data(ab_file, rec_time, rec_range, ab_file->t_len);
+}
+
+/**
+ * @internal Work out the byte order of the A file, from the start of
+ * its first record, and the min and max of that record if the B file
+ * records have been read. HYCOM writes big-endian A files, but some
+ * builds write them in host order, and those need no swapping.
+ *
+ * @param ab_file Pointer to AB file info, ready to read the A file.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the A file.
+ * @author Ed Hartnett
+ */
+static int
+detect_byte_order(SION_FILE_INFO_T *ab_file)
+{
+   size_t num = (size_t)ab_file->j_len * ab_file->i_len;
+   float range[2];
+   float *bufr;
+   int ret;
+
+   /* With nothing to go on, files are big-endian. */
+   ab_file->swap = ab_float_order(NULL, 0, NULL);
+   if (!ab_file->t_len || !num)
+      return NC_NOERR;
+   if (num > SION_ORDER_SAMPLE)
+      num = SION_ORDER_SAMPLE;
+
+   if ((ret = ab_pool_get(&ab_file->pool, (void **)&bufr)))
+      return ret;
+   if (!(ret = ab_read_raw(ab_file, 0, num * sizeof(float), bufr)))
+   {
+      int have_range = 0;
+
+      /* Per-record atts are in the order day, span, min, max. */
+      if (ab_file->rec_time)
       {
-         LOG((3, "tok_count %d tok %s", tok_count, tok));
-         if (tok_count == 0 && !var_named)
-         {
-            strncpy(var_name, tok, strlen(tok) - strlen(index(tok, ':')));
-            var_named++;
-         }
-         else if (tok_count == 3)
-         {
-            sscanf(tok, "%f", &(*time)[time_count]);
-         }
-         else if (tok_count == 4)
-         {
-            sscanf(tok, "%f", &(*span)[time_count]);
-         }
-         else if (tok_count == 5)
-         {
-            sscanf(tok, "%f", &(*min)[time_count]);
-         }
-         else if (tok_count == 6)
-         {
-            sscanf(tok, "%f", &(*max)[time_count]);
-         }
-         
-         tok_count++;
-         tok = NULL;
+         range[0] = SION_REC_ATT(ab_file, 2)[0];
+         range[1] = SION_REC_ATT(ab_file, 3)[0];
+         have_range = range[0] != NC_FILL_FLOAT && range[1] != NC_FILL_FLOAT;
       }
-      time_count++;
-      LOG((3, "%s", line));
+      ab_file->swap = ab_float_order(bufr, num, have_range ? range : NULL);
    }
-   
+   ab_pool_put(&ab_file->pool, bufr);
+   LOG((2, "%s: swap %d", __func__, ab_file->swap));
+
+   return ret;
+}
+
+/**
+ * @internal Find the number of records from the size of the A
+ * file. A partial record at the end is not counted.
+ *
+ * @param ab_file Pointer to AB file info, with rec_len set, and
+ * the zstd state set up if the A file is compressed.
+ * @param t_len Pointer that gets the number of records.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Could not find size of A file.
+ * @author Ed Hartnett
+ */
+static int
+a_file_records(SION_FILE_INFO_T *ab_file, int *t_len)
+{
+   off_t a_len;
+
+   assert(ab_file && ab_file->rec_len && t_len);
+
+   if (ab_file->zstd)
+      a_len = ab_zstd_size(ab_file->zstd);
+   else if (ab_file->a_mem)
+      a_len = ab_file->a_mem_len;
+   else
+   {
+      if (fseeko(ab_file->a_file, 0, SEEK_END) ||
+          (a_len = ftello(ab_file->a_file)) < 0)
+         return NC_EIO;
+   }
+   if (a_len / ab_file->rec_len > INT_MAX)
+      return NC_EDIMSIZE;
+   *t_len = a_len / ab_file->rec_len;
+   LOG((3, "%s: a_len %lld t_len %d", __func__, (long long)a_len, *t_len));
+
    return NC_NOERR;
 }
 
 /**
- * @internal Add an attribute to the netCDF-4 internal data model.
+ * @internal Add attribute metadata to the netCDF-4 internal data
+ * model, with no data.
  *
  * @param h5 Pointer to the netCDF-4 file metadata.
  * @param var Pointer to the netCDF-4 variable metadata. NULL for
@@ -229,20 +494,18 @@ parse_b_file(NC_HDF5_FILE_INFO_T *h5, int *num_header_atts,
  * @param name Name of the attribute.
  * @param xtype Type of the attribute.
  * @param len Number of elements in the attribute array.
- * @param op Pointer to attribute array data array of length len and
- * type xtype.
+ * @param attp Pointer that gets the new attribute.
  *
  * @return ::NC_NOERR No error.
  * @return ::NC_ENOMEM Out of memory.
  * @author Ed Hartnett
  */
 static int
-nc4_put_att(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var, char *name, nc_type xtype,
-            size_t len, const void *op)
+nc4_add_att(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var, char *name,
+            nc_type xtype, size_t len, NC_ATT_INFO_T **attp)
 {
    NC_ATT_INFO_T *att;
    NC_ATT_INFO_T **attlist;
-   size_t type_size;
    int ret;
 
    /* Check inputs. */
@@ -268,6 +531,37 @@ nc4_put_att(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var, char *name, nc_type xty
    LOG((4, "att->name %s att->nc_typeid %d att->len %d", att->name,
         att->nc_typeid, att->len));
 
+   *attp = att;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Add an attribute to the netCDF-4 internal data model.
+ *
+ * @param h5 Pointer to the netCDF-4 file metadata.
+ * @param var Pointer to the netCDF-4 variable metadata. NULL for
+ * global attributes.
+ * @param name Name of the attribute.
+ * @param xtype Type of the attribute.
+ * @param len Number of elements in the attribute array.
+ * @param op Pointer to attribute array data array of length len and
+ * type xtype.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+static int
+nc4_put_att(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var, char *name, nc_type xtype,
+            size_t len, const void *op)
+{
+   NC_ATT_INFO_T *att;
+   size_t type_size;
+   int ret;
+
+   if ((ret = nc4_add_att(h5, var, name, xtype, len, &att)))
+      return ret;
+
    /* Find the size of the type. */
    if ((ret = nc4_get_typelen_mem(h5, xtype, 0, &type_size)))
       return ret;
@@ -283,34 +577,36 @@ nc4_put_att(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var, char *name, nc_type xty
 }
 
 /**
- * @internal Add global attributes for the AB file.
+ * @internal Add global attributes for the AB file. The text of the
+ * header attributes is the shared header itself.
  *
- * @param h5 Pointer to file info.
- * @param num_header_atts The number of global attributes to add.
- * @param header_att Fixed size array with global atts.
+ * @param h5 Pointer to file info, with the shared header set.
  *
  * @return NC_NOERR No error.
  * @return NC_ENOMEM Out of memory.
  * @author Ed Hartnett
  */
 static int
-add_ab_global_atts(NC_HDF5_FILE_INFO_T *h5, int num_header_atts,
-                   char header_att[MAX_HEADER_ATTS][MAX_B_LINE_LEN])
+add_ab_global_atts(NC_HDF5_FILE_INFO_T *h5)
 {
+   SION_FILE_INFO_T *ab_file = h5->format_file_info;
+   SION_HEADER_T *hdr = ab_file->header;
    int ret;
 
    /* One attribute for each header record in the B file. */
-   for (int a = 0; a < num_header_atts; a++)
+   for (int a = 0; a < hdr->num_header_atts; a++)
    {
       char att_name[NC_MAX_NAME + 1];
+      NC_ATT_INFO_T *att;
       
       /* Come up with a name. */
       sprintf(att_name, "att_%d", a);
 
       /* Put the att in the metadata. */
-      if ((ret = nc4_put_att(h5, NULL, att_name, NC_CHAR, strlen(header_att[a]),
-                             header_att[a])))
+      if ((ret = nc4_add_att(h5, NULL, att_name, NC_CHAR,
+                             strnlen(hdr->header_att[a], MAX_B_LINE_LEN), &att)))
          return ret;
+      att->data = hdr->header_att[a];
    }
 
    /* Some attributes from force2nc.f. */
@@ -353,7 +649,7 @@ add_ab_dims(NC_HDF5_FILE_INFO_T *h5, NC_DIM_INFO_T **dim, int *dim_len)
 /**
  * @internal Add a variable to the metadata structures.
  *
- * @param h5 Pointer to file info.
+ * @param h5 Pointer to file info, with the shared header set.
  * @param var Pointer to the variable.
  * @param var_name Pointer that gets variable name.
  * 
@@ -366,6 +662,8 @@ static int
 add_ab_var(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T **varp, char *var_name,
            nc_type xtype, int ndims, const int *dimids, int use_fill_value)
 {
+   SION_FILE_INFO_T *ab_file = h5->format_file_info;
+   SION_HEADER_T *hdr = ab_file->header;
    NC_VAR_INFO_T *var;   
    int ret;
 
@@ -395,25 +693,28 @@ add_ab_var(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T **varp, char *var_name,
    /* Create hash for names for quick lookups. */
    var->hash = hash_fast(var->name, strlen(var->name));
 
-   /* Fill special type_info struct for variable type information. */
-   if (!(var->type_info = calloc(1, sizeof(NC_TYPE_INFO_T)))) 
-      return NC_ENOMEM;
-   var->type_info->nc_typeid = xtype;
-
-   /* Indicate that the variable has a pointer to the type */
-   var->type_info->rc++;
+   /* Floats use the type info and fill value of the shared header;
+    * anything else gets its own type info. */
+   if (xtype == hdr->type_info.nc_typeid)
+      var->type_info = &hdr->type_info;
+   else
+   {
+      if (!(var->type_info = calloc(1, sizeof(NC_TYPE_INFO_T))))
+         return NC_ENOMEM;
+      var->type_info->nc_typeid = xtype;
 
-   /* Get the size of the type. */
-   if ((ret = nc4_get_typelen_mem(h5, var->type_info->nc_typeid, 0,
-                                     &var->type_info->size))) 
-      return ret;
+      /* Indicate that the variable has a pointer to the type */
+      var->type_info->rc++;
 
-   /* Allocate storage for the fill value. */
+      /* Get the size of the type. */
+      if ((ret = nc4_get_typelen_mem(h5, var->type_info->nc_typeid, 0,
+                                     &var->type_info->size)))
+         return ret;
+   }
    if (use_fill_value)
    {
-      if (!(var->fill_value = malloc(var->type_info->size))) 
-         return NC_ENOMEM;
-      *((float *)var->fill_value) = powf(2, 100);
+      assert(xtype == NC_FLOAT);
+      var->fill_value = &hdr->fill_value;
    }
    
    /* AB files are always contiguous. */
@@ -488,40 +789,29 @@ ab_find_var_atts(char *var_name, char *pname, char *sname, char *units)
 }
 
 /**
- * @internal Add attributes to an AB variable.
+ * @internal Add attributes to an AB variable. The per-record
+ * attributes are not added here, but by ab_add_rec_atts() when they
+ * are first asked for.
  *
  * @param h5 Pointer to file info.
  * @param var Pointer to the variable.
- * @param t_len Length of time dimension, and all variable attribute
- * arrays.
- * @param 
- * @param var_name Pointer that gets variable name.
  * 
  * @return NC_NOERR No error.
  * @return NC_ENOMEM Out of memory.
  * @author Ed Hartnett
  */
 static int
-add_ab_var_atts(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var, int t_len,
-                float *time, float *span, float *min, float *max)
+add_ab_var_atts(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var)
 {
-   char att_name[NUM_SION_VAR_ATTS][NC_MAX_NAME + 1] = {TIME_NAME, SPAN_NAME,
-                                                      MIN_NAME, MAX_NAME};
-   float *att_data[NUM_SION_VAR_ATTS] = {time, span, min, max};
    char pname[NC_MAX_NAME + 1] = "";
    char sname[NC_MAX_NAME + 1] = "";
    char units[NC_MAX_NAME + 1] = "";
    int ret;
 
    /* Check inputs. */
-   assert(h5 && var && t_len > 0 && time && span && min && max);
+   assert(h5 && var);
    LOG((2, "%s", __func__));
 
-   /* Put the four float array attributes. */
-   for (int a = 0; a < NUM_SION_VAR_ATTS; a++)
-      if ((ret = nc4_put_att(h5, var, att_name[a], NC_FLOAT, t_len, att_data[a])))
-         return ret;
-
    if ((ret = ab_find_var_atts(var->name, pname, sname, units)))
       return ret;
    LOG((3, "var->name %s pname %s sname %s units %s", var->name, pname, sname, units));
@@ -543,100 +833,687 @@ add_ab_var_atts(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var, int t_len,
 }
 
 /**
- * @internal Open an AB format file. The .b file should be given as
- * the path. A matching .a file will be expected in the same
- * directory.
+ * @internal Add the fields of the regional grid as (j, i) coordinate
+ * variables, and point the data var at the longitude and latitude
+ * of its points. The data is read when first asked for.
  *
- * @param path The file name of the new file.
- * @param mode The open mode flag.
- * @param nc Pointer that gets the NC file info struct.
+ * @param h5 Pointer to file info.
+ * @param var Pointer to the data var.
  *
- * @return ::NC_NOERR No error.
+ * @return NC_NOERR No error.
  * @return NC_ENOMEM Out of memory.
  * @author Ed Hartnett
  */
 static int
-ab_open_file(const char *path, int mode, NC *nc)
+add_ab_grid_vars(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var)
 {
-   NC_HDF5_FILE_INFO_T *h5;
-   NC_VAR_INFO_T *var;
-   NC_VAR_INFO_T *time_var;
-   NC_DIM_INFO_T *dim[SION_NDIMS3];
-   SION_FILE_INFO_T *ab_file;
-   char *a_path;
-   char *dot_loc;
-   int num_header_atts;
-   char header_att[MAX_HEADER_ATTS][MAX_B_LINE_LEN];
-   int t_len, i_len, j_len;
-   float *time;
-   float *span;
-   float *min;
-   float *max;
-   char var_name[NC_MAX_NAME + 1];
-   int dimids[SION_NDIMS3] = {0, 1, 2};
-   int time_dimid = 0;
+   SION_FILE_INFO_T *ab_file = h5->format_file_info;
+   SION_GRID_T *grid = ab_file->grid;
+   int dimids[SION_NDIMS2] = {1, 2};
+   int have_lon = 0, have_lat = 0;
    int ret;
 
-   /* Check inputs. */
-   assert(nc && path);
-   LOG((1, "%s: path %s mode %d", __func__, path, mode));
+   for (int f = 0; f < grid->nfields; f++)
+   {
+      NC_VAR_INFO_T *grid_var;
+      char *name = grid->name[f];
+      size_t len = strlen(name);
+      char *units = NULL;
+      char *sname = NULL;
 
-   /* B file name must end in .b. */
-   if (!(dot_loc = rindex(path, '.')))
-      return NC_EINVAL;
-   if (strcmp(dot_loc, ".b"))
-      return NC_EINVAL;
+      if ((ret = add_ab_var(h5, &grid_var, name, NC_FLOAT, SION_NDIMS2, dimids, 0)))
+         return ret;
+      if (!f)
+         ab_file->grid_varid = grid_var->varid;
 
-   /* Get the A file name. */
-   if (!(a_path = strdup(path)))
-      return NC_ENOMEM;
-   a_path[strlen(path) - 1] = 'a';
-   
-   /* Add necessary structs to hold file metadata. */
-   if ((ret = nc4_nc4f_list_add(nc, path, mode)))
-      return ret;
-   h5 = (NC_HDF5_FILE_INFO_T *)nc->dispatchdata;
-   assert(h5 && h5->root_grp);
-   h5->no_write = NC_TRUE;
-   h5->root_grp->nc4_info->controller = nc;
+      /* Longitudes and latitudes of p, q, u and v points. */
+      if (len > 3 && !strcmp(name + len - 3, "lon"))
+      {
+         units = "degrees_east";
+         if (!strcmp(name, SION_GRID_LON))
+            sname = "longitude";
+      }
+      else if (len > 3 && !strcmp(name + len - 3, "lat"))
+      {
+         units = "degrees_north";
+         if (!strcmp(name, SION_GRID_LAT))
+            sname = "latitude";
+      }
+      if (units)
+         if ((ret = nc4_put_att(h5, grid_var, UNITS_NAME, NC_CHAR, strlen(units),
+                                units)))
+            return ret;
+      if (sname)
+         if ((ret = nc4_put_att(h5, grid_var, SNAME_NAME, NC_CHAR, strlen(sname),
+                                sname)))
+            return ret;
+      have_lon += !strcmp(name, SION_GRID_LON);
+      have_lat += !strcmp(name, SION_GRID_LAT);
+   }
+
+   /* CF: the data is on the p points. */
+   if (have_lon && have_lat)
+   {
+      char coords[] = SION_GRID_LON " " SION_GRID_LAT;
+
+      if ((ret = nc4_put_att(h5, var, COORDINATES_NAME, NC_CHAR, strlen(coords),
+                             coords)))
+         return ret;
+   }
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Add the time mean, min and max of the data var, on a
+ * dimension of windows of records. The data is worked out when first
+ * read.
+ *
+ * @param h5 Pointer to file info.
+ * @param var Pointer to the data var.
+ *
+ * @return NC_NOERR No error.
+ * @return NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+static int
+add_ab_reduce_vars(NC_HDF5_FILE_INFO_T *h5, NC_VAR_INFO_T *var)
+{
+   SION_FILE_INFO_T *ab_file = h5->format_file_info;
+   const char *suffix[SION_NSTATS] = {"_mean", "_min", "_max"};
+   const char *method[SION_NSTATS] = {TIME_NAME ": mean", TIME_NAME ": minimum",
+                                      TIME_NAME ": maximum"};
+   char pname[NC_MAX_NAME + 1] = "";
+   char sname[NC_MAX_NAME + 1] = "";
+   char units[NC_MAX_NAME + 1] = "";
+   NC_DIM_INFO_T *dim;
+   int dimids[SION_NDIMS3];
+   int ret;
+
+   /* The window dimension. */
+   if ((ret = nc4_dim_list_add(&h5->root_grp->dim, &dim)))
+      return ret;
+   if (!(dim->name = strdup(WINDOW_NAME)))
+      return NC_ENOMEM;
+   dim->dimid = h5->root_grp->nc4_info->next_dimid++;
+   dim->hash = hash_fast(WINDOW_NAME, strlen(WINDOW_NAME));
+   dim->len = ab_reduce_nwin(ab_file->reduce);
+   ab_file->reduce_dimid = dim->dimid;
+   dimids[0] = dim->dimid;
+   dimids[1] = 1;
+   dimids[2] = 2;
+
+   if ((ret = ab_find_var_atts(var->name, pname, sname, units)))
+      return ret;
+
+   for (int s = 0; s < SION_NSTATS; s++)
+   {
+      NC_VAR_INFO_T *stat_var;
+      char name[NC_MAX_NAME + 1];
+
+      snprintf(name, sizeof(name), "%.*s%s",
+               (int)(NC_MAX_NAME - strlen(suffix[s])), var->name, suffix[s]);
+      if ((ret = add_ab_var(h5, &stat_var, name, NC_FLOAT, SION_NDIMS3, dimids, 1)))
+         return ret;
+      if (!s)
+         ab_file->reduce_varid = stat_var->varid;
+      if (strlen(units))
+         if ((ret = nc4_put_att(h5, stat_var, UNITS_NAME, NC_CHAR, strlen(units),
+                                units)))
+            return ret;
+      if ((ret = nc4_put_att(h5, stat_var, CELL_METHODS_NAME, NC_CHAR,
+                             strlen(method[s]), (void *)method[s])))
+         return ret;
+   }
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Attach the per-record attributes (day, span, min, max)
+ * to the data var, the first time any attribute of that var is
+ * asked about. They are numbered ahead of the other attributes of
+ * the var, as they were when added at open.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID. Nothing is done unless this is the data
+ * var.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTVAR Bad varid.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_add_rec_atts(int ncid, int varid)
+{
+   char att_name[NUM_SION_VAR_ATTS][NC_MAX_NAME + 1] = {TIME_NAME, SPAN_NAME,
+                                                      MIN_NAME, MAX_NAME};
+   NC *nc;
+   NC_GRP_INFO_T *grp;
+   NC_HDF5_FILE_INFO_T *h5;
+   NC_VAR_INFO_T *var;
+   NC_ATT_INFO_T *att;
+   SION_FILE_INFO_T *ab_file;
+   int natts;
+   int ret;
+
+   if ((ret = nc4_find_nc_grp_h5(ncid, &nc, &grp, &h5)))
+      return ret;
+   assert(h5 && h5->format_file_info);
+   ab_file = h5->format_file_info;
+
+   /* Only the data var has them, and only once. */
+   if (varid != ab_file->varid || ab_file->rec_atts_added)
+      return NC_NOERR;
+   if ((ret = nc4_find_g_var_nc(nc, ncid, varid, &grp, &var)))
+      return ret;
+   LOG((2, "%s: var %s t_len %d", __func__, var->name, ab_file->t_len));
+   if ((ret = ab_load_b_records(ab_file)))
+      return ret;
+
+   /* Put the four float array attributes at the end of the list.
+    * Their data is the shared per-record array itself, which is
+    * taken back by ab_detach_shared() before netCDF frees the
+    * atts. */
+   natts = var->natts;
+   for (int a = 0; a < NUM_SION_VAR_ATTS; a++)
+   {
+      if ((ret = nc4_add_att(h5, var, att_name[a], NC_FLOAT, ab_file->t_len,
+                             &att)))
+         return ret;
+      att->data = SION_REC_ATT(ab_file, a);
+   }
+
+   /* Then move them to the front of the numbering. */
+   for (att = var->att; att; att = att->l.next)
+      att->attnum = att->attnum >= natts ? att->attnum - natts :
+         att->attnum + NUM_SION_VAR_ATTS;
+   ab_file->rec_atts_added++;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Free the AB specific info of a file, and close its A
+ * and B files. Works on partly set up info too.
+ *
+ * @param ab_file Pointer to AB file info.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_free_file(SION_FILE_INFO_T *ab_file)
+{
+   assert(ab_file);
+
+   if (ab_file->a_file)
+      fclose(ab_file->a_file);
+   if (ab_file->b_file)
+      fclose(ab_file->b_file);
+   ab_stream_close(ab_file->stream);
+   ab_zstd_close(ab_file->zstd);
+   pthread_mutex_destroy(&ab_file->a_lock);
+   if (ab_file->pool.buf_len)
+      ab_pool_free(&ab_file->pool);
+   ab_unintern(ab_file->rec_time);
+   ab_unintern(ab_file->rec_range);
+   ab_unintern(ab_file->header);
+   ab_grid_close(ab_file->grid);
+   ab_ovr_close(ab_file->ovr);
+   ab_reduce_close(ab_file->reduce);
+   ab_crc_close(ab_file->crc);
+   ab_interp_close(ab_file->interp);
+   ab_mpi_close(ab_file->mpi);
+   free(ab_file);
+}
+
+/**
+ * @internal Take the shared per-record arrays, header attribute text,
+ * type info and fill values back from the netCDF metadata, so that
+ * netCDF does not free them with the atts and vars.
+ *
+ * @param h5 Pointer to file info.
+ *
+ * @author Ed Hartnett
+ */
+static void
+ab_detach_shared(NC_HDF5_FILE_INFO_T *h5)
+{
+   char att_name[NUM_SION_VAR_ATTS][NC_MAX_NAME + 1] = {TIME_NAME, SPAN_NAME,
+                                                      MIN_NAME, MAX_NAME};
+   SION_FILE_INFO_T *ab_file = h5->format_file_info;
+   SION_HEADER_T *hdr = ab_file->header;
+   NC_VARARRAY *vars = &h5->root_grp->vars;
+
+   /* Some may be there even if adding them failed part way. */
+   for (int a = 0; a < NUM_SION_VAR_ATTS; a++)
+   {
+      NC_ATT_INFO_T *att;
+
+      if (!nc4_find_grp_att(h5->root_grp, ab_file->varid, att_name[a], 0, &att))
+         att->data = NULL;
+   }
+   if (!hdr)
+      return;
+   for (int a = 0; a < hdr->num_header_atts; a++)
+   {
+      char name[NC_MAX_NAME + 1];
+      NC_ATT_INFO_T *att;
+
+      sprintf(name, "att_%d", a);
+      if (!nc4_find_grp_att(h5->root_grp, NC_GLOBAL, name, 0, &att) &&
+          att->data == hdr->header_att[a])
+         att->data = NULL;
+   }
+   for (int v = 0; v < vars->nelems; v++)
+   {
+      NC_VAR_INFO_T *var = vars->value[v];
+
+      if (!var)
+         continue;
+      if (var->type_info == &hdr->type_info)
+         var->type_info = NULL;
+      if (var->fill_value == &hdr->fill_value)
+         var->fill_value = NULL;
+   }
+}
+
+/**
+ * @internal Intern the header and grid of a file being opened, so
+ * files with the same ones share them.
+ *
+ * @param ab_file Pointer to AB file info, with j_len and i_len set.
+ * @param b_info Pointer to the header atts and variable name.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ */
+static int
+intern_header(SION_FILE_INFO_T *ab_file, const SION_B_INFO_T *b_info)
+{
+   SION_HEADER_T *hdr;
+
+   if (!(hdr = calloc(1, sizeof(SION_HEADER_T))))
+      return NC_ENOMEM;
+   hdr->j_len = ab_file->j_len;
+   hdr->i_len = ab_file->i_len;
+   hdr->num_header_atts = b_info->num_header_atts;
+   for (int a = 0; a < b_info->num_header_atts; a++)
+      strncpy(hdr->header_att[a], b_info->header_att[a], MAX_B_LINE_LEN);
+   strncpy(hdr->var_name, b_info->var_name, NC_MAX_NAME);
+   hdr->type_info.nc_typeid = NC_FLOAT;
+   hdr->type_info.size = sizeof(float);
+   hdr->type_info.rc = 1;
+   hdr->fill_value = powf(2, 100);
+
+   if (ab_intern((void **)&hdr, sizeof(SION_HEADER_T)))
+   {
+      free(hdr);
+      return NC_ENOMEM;
+   }
+   ab_file->header = hdr;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Allocate the AB file info for a file being opened.
+ *
+ * @return Pointer to the AB file info, or NULL if out of memory.
+ */
+static SION_FILE_INFO_T *
+new_ab_file(void)
+{
+   SION_FILE_INFO_T *ab_file;
+
+   if (!(ab_file = calloc(1, sizeof(SION_FILE_INFO_T))))
+      return NULL;
+   pthread_mutex_init(&ab_file->a_lock, NULL);
+   ab_file->flags = ab_open_flags;
+   return ab_file;
+}
+
+/**
+ * @internal Set up the AB file info of a file whose record layout is
+ * already known, with no A or B file open. Used on the ranks that
+ * do not read the B file of a file opened in parallel.
+ *
+ * @param t_len Number of records.
+ * @param j_len Length of j dim.
+ * @param i_len Length of i dim.
+ * @param ab_filep Pointer that gets the AB file info. Free with
+ * ab_free_file().
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Bad layout.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_prepare_bare(int t_len, int j_len, int i_len, SION_FILE_INFO_T **ab_filep)
+{
+   SION_FILE_INFO_T *ab_file;
+   int ret;
+
+   assert(ab_filep);
+   if ((ret = ab_check_layout(t_len, j_len, i_len)))
+      return ret;
+   if (!(ab_file = new_ab_file()))
+      return NC_ENOMEM;
+   ab_file->t_len = t_len;
+   ab_file->j_len = j_len;
+   ab_file->i_len = i_len;
+   ab_file->rec_len = ab_rec_len(j_len, i_len);
+   ab_file->gap = SION_DEFAULT_GAP;
+   if ((ret = ab_pool_init(&ab_file->pool, ab_file->rec_len,
+                           ab_file->flags & SION_OPEN_HUGEPAGES)))
+   {
+      ab_free_file(ab_file);
+      return ret;
+   }
+
+   *ab_filep = ab_file;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Parse the B file of an AB file whose A and B files are
+ * open, and set up for reading the A file. On error the AB file info
+ * is freed.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param path The B file name.
+ * @param a_path The A file name, or NULL if the A file is in memory.
+ * @param is_zstd Non-zero if the A file is compressed.
+ * @param b_info Pointer that gets the header atts and variable name.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Bad B file.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read A or B file.
+ */
+static int
+prepare_open_file(SION_FILE_INFO_T *ab_file, const char *path,
+                  const char *a_path, int is_zstd, SION_B_INFO_T *b_info)
+{
+   int t_len = 0, i_len = 0, j_len = 0;
+   int ret;
+
+   /* Parse the B file. With SION_OPEN_INSTANT only the header is
+    * read; the number of records comes from the A file. */
+   ret = parse_b_file(ab_file, b_info,
+                      (ab_file->flags & SION_OPEN_INSTANT) ? NULL : &t_len,
+                      &i_len, &j_len);
+
+   /* Remember the record layout, needed to read the A file. Every
+    * offset in the file must be computable. */
+   if (!ret)
+      ret = ab_check_layout(t_len, j_len, i_len);
+   if (!ret)
+   {
+      ab_file->t_len = t_len;
+      ab_file->j_len = j_len;
+      ab_file->i_len = i_len;
+      ab_file->rec_len = ab_rec_len(j_len, i_len);
+      ab_file->gap = SION_DEFAULT_GAP;
+      ret = ab_pool_init(&ab_file->pool, ab_file->rec_len,
+                         ab_file->flags & SION_OPEN_HUGEPAGES);
+   }
+
+   /* Compressed files are read by frame; they can't be streamed
+    * with direct I/O. Full-archive scans read whole records around
+    * the page cache. */
+   if (!ret && is_zstd)
+      ret = ab_zstd_open(ab_file);
+   else if (!ret && a_path && (ab_file->flags & SION_OPEN_DIRECT))
+      ret = ab_stream_open(ab_file, a_path);
+
+   /* Share decoded records with other processes, if asked to. */
+   if (!ret)
+      ret = ab_shm_attach(ab_file);
+
+   /* Find the regional grid, if asked to. */
+   if (!ret && (ab_file->flags & SION_OPEN_GRID))
+      ret = ab_grid_open(ab_file, path);
+
+   /* Use overview levels, if they have been built for the A file. */
+   if (!ret && a_path)
+      ret = ab_ovr_open(ab_file, path);
+
+   /* Load the record checksums, if asked to verify. */
+   if (!ret && a_path && (ab_file->flags & SION_OPEN_VERIFY))
+      ret = ab_crc_open(ab_file, path);
+
+   /* Get the record times now, or when they are first needed. */
+   if (!ret && (ab_file->flags & SION_OPEN_INSTANT))
+      ret = a_file_records(ab_file, &ab_file->t_len);
+   else if (!ret)
+      ret = ab_load_b_records(ab_file);
+
+   /* Find out if the A file needs byte swapping. */
+   if (!ret)
+      ret = detect_byte_order(ab_file);
+
+   /* Set up the time reductions, if asked to. */
+   if (!ret && (ab_file->flags & SION_OPEN_REDUCE))
+      ret = ab_reduce_open(ab_file, ab_reduce_window);
+
+   if (ret)
+   {
+      ab_free_file(ab_file);
+      return ret;
+   }
+   LOG((3, "num_header_atts %d var_name %s t_len %d i_len %d j_len %d",
+        b_info->num_header_atts, b_info->var_name, ab_file->t_len, i_len,
+        j_len));
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Open the A and B files of an AB file, parse the B file,
+ * and set up for reading the A file. Nothing here touches the netCDF
+ * metadata lists, so this may run on any thread, for many files at
+ * once. The SION_OPEN_* flags set at the time are used.
+ *
+ * @param path The B file name. A matching .a file will be expected
+ * in the same directory.
+ * @param ab_filep Pointer that gets the AB file info. Free with
+ * ab_free_file().
+ * @param b_info Pointer that gets the header atts and variable name.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Name does not end in .b, or bad B file.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not open or read A or B file.
+ * @author Ed Hartnett
+ */
+int
+ab_prepare_file(const char *path, SION_FILE_INFO_T **ab_filep,
+                SION_B_INFO_T *b_info)
+{
+   SION_FILE_INFO_T *ab_file;
+   char *a_path;
+   char *dot_loc;
+   int is_zstd = 0;
+   int ret = NC_NOERR;
+
+   /* Check inputs. */
+   assert(path && ab_filep && b_info);
+   LOG((2, "%s: path %s", __func__, path));
+
+   /* B file name must end in .b. */
+   if (!(dot_loc = rindex(path, '.')))
+      return NC_EINVAL;
+   if (strcmp(dot_loc, ".b"))
+      return NC_EINVAL;
+
+   /* Get the A file name, with room for a compression suffix. */
+   if (!(a_path = malloc(strlen(path) + sizeof(SION_ZSTD_SUFFIX))))
+      return NC_ENOMEM;
+   strcpy(a_path, path);
+   a_path[strlen(path) - 1] = 'a';
 
    /* Allocate data to hold AB specific file data. */
-   if (!(ab_file = malloc(sizeof(SION_FILE_INFO_T))))
+   if (!(ab_file = new_ab_file()))
+   {
+      free(a_path);
       return NC_ENOMEM;
-   h5->format_file_info = ab_file;
+   }
 
-   /* Open the A file. */
+   /* Open the A file. If there is none, look for a seekable zstd
+    * compressed one. */
    LOG((3, "a_file path %s", a_path));
    if (!(ab_file->a_file = fopen(a_path, "r")))
-      return NC_EIO;
+   {
+      strcat(a_path, SION_ZSTD_SUFFIX);
+      if (!(ab_file->a_file = fopen(a_path, "r")))
+         ret = NC_EIO;
+      is_zstd++;
+   }
 
    /* Open the B file. */
-   if (!(ab_file->b_file = fopen(path, "r")))
-      return NC_EIO;
+   if (!ret && !(ab_file->b_file = fopen(path, "r")))
+      ret = NC_EIO;
 
-   /* Parse the B file. */
-   if ((ret = parse_b_file(h5, &num_header_atts, header_att, var_name, &t_len,
-                              &i_len, &j_len, &time, &span, &min, &max)))
+   if (ret)
+      ab_free_file(ab_file);
+   else
+      ret = prepare_open_file(ab_file, path, a_path, is_zstd, b_info);
+   free(a_path);
+   if (ret)
       return ret;
-   LOG((3, "num_header_atts %d var_name %s t_len %d i_len %d j_len %d",
-        num_header_atts, var_name, t_len, i_len, j_len));
 
-   for (int h = 0; h < num_header_atts; h++)
+   *ab_filep = ab_file;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Set up an AB file held in memory, as ab_prepare_file()
+ * does for one on disk. The B file is parsed through a memory
+ * stream, and the A file is read straight from its buffer, which must
+ * not be changed or freed until the file is closed. The A file must
+ * not be compressed.
+ *
+ * @param path The name the file will be opened with.
+ * @param b_data The B file text.
+ * @param b_size Length of the B file text in bytes.
+ * @param a_data The A file bytes.
+ * @param a_size Length of the A file in bytes.
+ * @param ab_filep Pointer that gets the AB file info. Free with
+ * ab_free_file().
+ * @param b_info Pointer that gets the header atts and variable name.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Bad B file.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read A or B file.
+ * @author Ed Hartnett
+ */
+int
+ab_prepare_mem(const char *path, const void *b_data, size_t b_size,
+               const void *a_data, size_t a_size, SION_FILE_INFO_T **ab_filep,
+               SION_B_INFO_T *b_info)
+{
+   SION_FILE_INFO_T *ab_file;
+   int ret;
+
+   assert(path && b_data && a_data && ab_filep && b_info);
+   LOG((2, "%s: path %s b_size %d a_size %d", __func__, path, b_size, a_size));
+
+   if (!(ab_file = new_ab_file()))
+      return NC_ENOMEM;
+   ab_file->a_mem = a_data;
+   ab_file->a_mem_len = a_size;
+
+   /* The stream only reads the buffer, whatever its mode says. */
+   if (!(ab_file->b_file = fmemopen((void *)b_data, b_size, "r")))
    {
-      LOG((3, "h %d header_att %s!", h, header_att[h]));
+      ab_free_file(ab_file);
+      return NC_ENOMEM;
    }
-   for (int t = 0; t < t_len; t++)
+   if ((ret = prepare_open_file(ab_file, path, NULL, 0, b_info)))
+      return ret;
+
+   *ab_filep = ab_file;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Open an AB format file. The .b file should be given as
+ * the path. A matching .a file will be expected in the same
+ * directory. If the file was already prepared by SION_open_many(),
+ * that is used, and only the netCDF metadata is built here.
+ *
+ * @param path The file name of the new file.
+ * @param mode The open mode flag.
+ * @param use_parallel Non-zero to open on all ranks with MPI.
+ * @param parameters The NC_MPI_INFO from nc_open_par(), if parallel.
+ * @param nc Pointer that gets the NC file info struct.
+ *
+ * @return ::NC_NOERR No error.
+ * @return NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+static int
+ab_open_file(const char *path, int mode, int use_parallel, void *parameters,
+             NC *nc)
+{
+   NC_HDF5_FILE_INFO_T *h5;
+   NC_VAR_INFO_T *var;
+   NC_VAR_INFO_T *time_var;
+   NC_DIM_INFO_T *dim[SION_NDIMS3];
+   SION_FILE_INFO_T *ab_file;
+   SION_B_INFO_T b_info;
+   int dimids[SION_NDIMS3] = {0, 1, 2};
+   int time_dimid = 0;
+   int ret;
+
+   /* Check inputs. */
+   assert(nc && path);
+   LOG((1, "%s: path %s mode %d", __func__, path, mode));
+
+   /* Open and parse the file, unless that is already done. */
+   if (use_parallel)
+   {
+      if ((ret = ab_mpi_prepare(path, parameters, &ab_file, &b_info)))
+         return ret;
+   }
+   else if (!ab_stash_take(path, &ab_file, &b_info))
+      if ((ret = ab_prepare_file(path, &ab_file, &b_info)))
+         return ret;
+
+   /* Files with the same header and grid share them. */
+   if ((ret = intern_header(ab_file, &b_info)))
+   {
+      ab_free_file(ab_file);
+      return ret;
+   }
+
+   /* Add necessary structs to hold file metadata. */
+   if ((ret = nc4_nc4f_list_add(nc, path, mode)))
+   {
+      ab_free_file(ab_file);
+      return ret;
+   }
+   h5 = (NC_HDF5_FILE_INFO_T *)nc->dispatchdata;
+   assert(h5 && h5->root_grp);
+   h5->no_write = NC_TRUE;
+   h5->root_grp->nc4_info->controller = nc;
+   h5->format_file_info = ab_file;
+
+   for (int h = 0; h < b_info.num_header_atts; h++)
    {
-      LOG((3, "t %d time %f span %f min %f max %f", t, time[t], span[t],
-           min[t], max[t]));
+      LOG((3, "h %d header_att %s!", h, b_info.header_att[h]));
    }
 
    /* Add the global attributes. */
-   if ((ret = add_ab_global_atts(h5, num_header_atts, header_att)))
+   if ((ret = add_ab_global_atts(h5)))
       return ret;
 
    /* Add the dimensions. */
-   int dim_lens[SION_NDIMS3] = {t_len, j_len, i_len};
+   int dim_lens[SION_NDIMS3] = {ab_file->t_len, ab_file->j_len, ab_file->i_len};
    if ((ret = add_ab_dims(h5, dim, dim_lens)))
       return ret;
 
@@ -645,19 +1522,22 @@ ab_open_file(const char *path, int mode, NC *nc)
       return ret;
 
    /* Add the data variable. */
-   if ((ret = add_ab_var(h5, &var, var_name, NC_FLOAT, SION_NDIMS3, dimids, 1)))
+   if ((ret = add_ab_var(h5, &var, b_info.var_name, NC_FLOAT, SION_NDIMS3, dimids, 1)))
       return ret;
 
+   ab_file->varid = var->varid;
+
    /* Variable attributes. */
-   if ((ret = add_ab_var_atts(h5, var, t_len, time, span, min, max)))
+   if ((ret = add_ab_var_atts(h5, var)))
+      return ret;
+
+   /* Coordinate vars from the regional grid. */
+   if (ab_file->grid && (ret = add_ab_grid_vars(h5, var)))
+      return ret;
+
+   /* Time reductions of the data var. */
+   if (ab_file->reduce && (ret = add_ab_reduce_vars(h5, var)))
       return ret;
-   
-   /* Free resources. */
-   free(a_path);
-   free(time);
-   free(span);
-   free(min);
-   free(max);
 
 #ifdef LOGGING
    /* This will print out the names, types, lens, etc of the vars and
@@ -674,8 +1554,7 @@ ab_open_file(const char *path, int mode, NC *nc)
  * @param mode The open mode flag.
  * @param basepe Ignored by this function.
  * @param chunksizehintp Ignored by this function.
- * @param use_parallel Must be 0 for sequential, access. Parallel
- * access not supported for AB.
+ * @param use_parallel Non-zero for parallel access, which needs MPI.
  * @param parameters pointer to struct holding extra data (e.g. for
  * parallel I/O) layer. Ignored if NULL.
  * @param dispatch Pointer to the dispatch table for this file.
@@ -696,7 +1575,7 @@ SION_open(const char *path, int mode, int basepe, size_t *chunksizehintp,
         parameters));
 
    /* Check inputs. */
-   assert(path && !use_parallel);
+   assert(path);
 
    /* Check the mode for validity */
    if (mode & ILLEGAL_OPEN_FLAGS)
@@ -706,7 +1585,48 @@ SION_open(const char *path, int mode, int basepe, size_t *chunksizehintp,
    nc_file->int_ncid = nc_file->ext_ncid;
 
    /* Open the file. */
-   return ab_open_file(path, mode, nc_file);
+   return ab_open_file(path, mode, use_parallel, parameters, nc_file);
+}
+
+/**
+ * Set the SION_OPEN_* flags for AB files opened after this call. The
+ * netCDF open mode has no room for them, so they are set here
+ * instead. Files already open are not changed.
+ *
+ * @param flags Bitwise OR of SION_OPEN_* flags, or 0 for none.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Unknown flag.
+ * @author Ed Hartnett
+ */
+int
+SION_set_open_flags(int flags)
+{
+   if (flags & ~SION_OPEN_ALL)
+      return NC_EINVAL;
+   ab_open_flags = flags;
+   return NC_NOERR;
+}
+
+/**
+ * Set the number of records in each window of the time reduction
+ * vars of AB files opened with ::SION_OPEN_REDUCE after this call.
+ * The last window may be short.
+ *
+ * @param window Records in each window, or 0 for one window of all
+ * records.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Negative window.
+ * @author Ed Hartnett
+ */
+int
+SION_set_reduce_window(int window)
+{
+   if (window < 0)
+      return NC_EINVAL;
+   ab_reduce_window = window;
+   return NC_NOERR;
 }
 
 /**
@@ -737,12 +1657,12 @@ SION_close(int ncid)
    /* Get the AB specific info. */
    ab_file = h5->format_file_info;
 
-   /* Close the A/B files. */
-   fclose(ab_file->a_file);
-   fclose(ab_file->b_file);
+   /* Let any queued async reads of this file finish. */
+   ab_async_drain(ab_file);
 
-   /* Free AB file info struct. */
-   free(h5->format_file_info);
+   /* Close the A/B files, and free AB file info struct. */
+   ab_detach_shared(h5);
+   ab_free_file(ab_file);
 
    /* Delete all the list contents for vars, dims, and atts, in each
     * group. */
@@ -755,3 +1675,167 @@ SION_close(int ncid)
 
    return NC_NOERR;
 }
+
+/**
+ * Pick up records appended to an AB file since it was opened or last
+ * refreshed, as by a model that is still running. Only the new
+ * record lines of the B file are read. A record is added once its B
+ * file line is complete and the whole record is in the A file. The
+ * day dimension and the per-record attributes grow to match, as do
+ * the window dimension of the time reductions.
+ *
+ * This must not be called while other calls are using the same
+ * ncid.
+ *
+ * @param ncid File ID.
+ * @param t_lenp Pointer that gets the number of records. Ignored if
+ * NULL.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_EINVAL File opened in parallel.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the A or B file.
+ * @author Ed Hartnett
+ */
+int
+SION_refresh(int ncid, size_t *t_lenp)
+{
+   char att_name[NUM_SION_VAR_ATTS][NC_MAX_NAME + 1] = {TIME_NAME, SPAN_NAME,
+                                                      MIN_NAME, MAX_NAME};
+   char line[MAX_B_LINE_LEN + 1];
+   NC_GRP_INFO_T *grp;
+   NC *nc;
+   NC_HDF5_FILE_INFO_T *h5;
+   NC_DIM_INFO_T *dim;
+   SION_FILE_INFO_T *ab_file;
+   float *new_val = NULL;
+   float *rec_time, *rec_range;
+   off_t b_end;
+   int a_recs, nnew = 0, t_len;
+   int ret;
+
+   LOG((1, "%s: ncid 0x%x", __func__, ncid));
+
+   if ((ret = nc4_find_nc_grp_h5(ncid, &nc, &grp, &h5)))
+      return ret;
+   assert(h5 && h5->format_file_info);
+   ab_file = h5->format_file_info;
+
+   /* Only rank 0 has the B file of a file opened in parallel. */
+   if (ab_file->mpi)
+      return NC_EINVAL;
+
+   /* Compressed A files are never written in place. */
+   if (ab_file->zstd)
+   {
+      if (t_lenp)
+         *t_lenp = ab_file->t_len;
+      return NC_NOERR;
+   }
+
+   ab_async_drain(ab_file);
+   if ((ret = ab_load_b_records(ab_file)))
+      return ret;
+
+   /* How many whole records does the A file hold now? */
+   pthread_mutex_lock(&ab_file->a_lock);
+   ret = a_file_records(ab_file, &a_recs);
+   pthread_mutex_unlock(&ab_file->a_lock);
+   if (ret)
+      return ret;
+
+   /* Read the new record lines, but not one that is still being
+    * written, or one for a record not yet in the A file. */
+   clearerr(ab_file->b_file);
+   if (fseeko(ab_file->b_file, ab_file->b_end, SEEK_SET))
+      return NC_EIO;
+   b_end = ab_file->b_end;
+   while (ab_file->b_recs + nnew < a_recs &&
+          fgets(line, sizeof(line), ab_file->b_file))
+   {
+      float *more;
+
+      if (!index(line, '\n'))
+         break;
+      b_end = ftello(ab_file->b_file);
+      if (blank_line(line))
+         continue;
+      if (!(more = realloc(new_val, (nnew + 1) * NUM_SION_VAR_ATTS *
+                           sizeof(float))))
+      {
+         free(new_val);
+         return NC_ENOMEM;
+      }
+      new_val = more;
+      for (int a = 0; a < NUM_SION_VAR_ATTS; a++)
+         new_val[nnew * NUM_SION_VAR_ATTS + a] = NC_FILL_FLOAT;
+      parse_rec_line(line, &new_val[nnew * NUM_SION_VAR_ATTS]);
+      nnew++;
+   }
+   LOG((2, "%s: a_recs %d b_recs %d nnew %d", __func__, a_recs,
+        ab_file->b_recs, nnew));
+   if (!nnew)
+   {
+      if (t_lenp)
+         *t_lenp = ab_file->t_len;
+      return NC_NOERR;
+   }
+
+   /* Make new per-record arrays. The old ones may be shared, so
+    * they are never changed. */
+   t_len = ab_file->t_len;
+   if (ab_file->b_recs + nnew > t_len)
+      t_len = ab_file->b_recs + nnew;
+   if ((ret = new_rec_data(t_len, &rec_time, &rec_range)))
+   {
+      free(new_val);
+      return ret;
+   }
+   for (int t = 0; t < ab_file->t_len; t++)
+   {
+      float val[NUM_SION_VAR_ATTS];
+
+      for (int a = 0; a < NUM_SION_VAR_ATTS; a++)
+         val[a] = SION_REC_ATT(ab_file, a)[t];
+      put_rec_data(rec_time, rec_range, t_len, t, val);
+   }
+   for (int n = 0; n < nnew; n++)
+      put_rec_data(rec_time, rec_range, t_len, ab_file->b_recs + n,
+                   &new_val[n * NUM_SION_VAR_ATTS]);
+   free(new_val);
+   if ((ret = ab_intern_rec_data(ab_file, rec_time, rec_range, t_len)))
+      return ret;
+   ab_file->t_len = t_len;
+   ab_file->b_recs += nnew;
+   ab_file->b_end = b_end;
+
+   /* Grow the day dimension, and the per-record atts if attached. */
+   if ((ret = nc4_find_dim(h5->root_grp, 0, &dim, NULL)))
+      return ret;
+   dim->len = t_len;
+   for (int a = 0; ab_file->rec_atts_added && a < NUM_SION_VAR_ATTS; a++)
+   {
+      NC_ATT_INFO_T *att;
+
+      if (!nc4_find_grp_att(h5->root_grp, ab_file->varid, att_name[a], 0, &att))
+      {
+         att->len = t_len;
+         att->data = SION_REC_ATT(ab_file, a);
+      }
+   }
+
+   /* The time reductions get windows for the new records. */
+   if (ab_file->reduce)
+   {
+      if ((ret = ab_reduce_refresh(ab_file->reduce, t_len)))
+         return ret;
+      if ((ret = nc4_find_dim(h5->root_grp, ab_file->reduce_dimid, &dim, NULL)))
+         return ret;
+      dim->len = ab_reduce_nwin(ab_file->reduce);
+   }
+
+   if (t_lenp)
+      *t_lenp = t_len;
+   return NC_NOERR;
+}
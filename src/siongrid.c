@@ -0,0 +1,305 @@
+/**
+ * @file
+ * @internal HYCOM regional grid support for the AB dispatch layer.
+ *
+ * HYCOM keeps the geographic coordinates of a grid in an AB pair
+ * named regional.grid.a/.b. The B file gives idm and jdm and then
+ * one line per field (plon, plat, qlon, ...), in the order the
+ * fields are stored in the A file, one padded record each.
+ *
+ * With ::SION_OPEN_GRID, open looks for regional.grid.b next to the
+ * file, and if it matches the grid of the file, the fields appear as
+ * (j, i) coordinate variables. A grid is opened once per process and
+ * shared by all files that use it, and each field is read and
+ * decoded the first time any of them reads it.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <ctype.h>
+#include <limits.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal Name of the regional grid B file. */
+#define SION_GRID_B_NAME "regional.grid.b"
+
+/* Grids in use, and the lock that protects the list. */
+static SION_GRID_T *grid_list = NULL;
+static pthread_mutex_t grid_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @internal Parse a regional grid B file.
+ *
+ * @param grid Pointer to the grid, which gets i_len, j_len and the
+ * field names.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Could not read the file.
+ * @return ::NC_EINVAL Not a regional grid B file.
+ */
+static int
+parse_grid_b(SION_GRID_T *grid)
+{
+   char line[MAX_B_LINE_LEN + 1];
+   FILE *b_file;
+
+   if (!(b_file = fopen(grid->b_path, "r")))
+      return NC_EIO;
+
+   while (fgets(line, sizeof(line), b_file))
+   {
+      char *colon;
+
+      if (strstr(line, "'idm"))
+         sscanf(line, "%d", &grid->i_len);
+      else if (strstr(line, "'jdm"))
+         sscanf(line, "%d", &grid->j_len);
+      else if ((colon = index(line, ':')) && grid->nfields < SION_GRID_MAX_FIELDS)
+      {
+         float *range = grid->range[grid->nfields];
+         char *name = line;
+         char *equals;
+         size_t len;
+
+         while (isspace(*name))
+            name++;
+         len = colon - name;
+         while (len && isspace(name[len - 1]))
+            len--;
+         if (!len || len > NC_MAX_NAME)
+            continue;
+         strncpy(grid->name[grid->nfields], name, len);
+         grid->name[grid->nfields][len] = 0;
+
+         /* The min and max, if given, tell the byte order. */
+         range[0] = range[1] = NC_FILL_FLOAT;
+         if ((equals = index(colon, '=')))
+            sscanf(equals + 1, "%f %f", &range[0], &range[1]);
+         grid->nfields++;
+      }
+   }
+   fclose(b_file);
+   LOG((3, "%s: %s i_len %d j_len %d nfields %d", __func__, grid->b_path,
+        grid->i_len, grid->j_len, grid->nfields));
+
+   if (grid->i_len <= 0 || grid->j_len <= 0 || !grid->nfields)
+      return NC_EINVAL;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Find the regional grid of an AB file, opening it if no
+ * other file uses it yet. A missing or mismatched grid is not an
+ * error; the file simply has no grid.
+ *
+ * @param ab_file Pointer to AB file info, with i_len and j_len set.
+ * @param path Path of the B file of the AB file.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_grid_open(SION_FILE_INFO_T *ab_file, const char *path)
+{
+   char b_path[PATH_MAX];
+   char real_path[PATH_MAX];
+   const char *slash;
+   SION_GRID_T *grid;
+   int ret;
+
+   assert(ab_file && path);
+
+   /* The grid lives in the same directory. */
+   if ((slash = rindex(path, '/')))
+      snprintf(b_path, sizeof(b_path), "%.*s/%s", (int)(slash - path), path,
+               SION_GRID_B_NAME);
+   else
+      snprintf(b_path, sizeof(b_path), "%s", SION_GRID_B_NAME);
+   if (!realpath(b_path, real_path))
+      return NC_NOERR;
+
+   pthread_mutex_lock(&grid_lock);
+   for (grid = grid_list; grid; grid = grid->next)
+      if (!strcmp(grid->b_path, real_path))
+         break;
+   if (grid)
+      grid->refs++;
+   else
+   {
+      if (!(grid = calloc(1, sizeof(SION_GRID_T))))
+      {
+         pthread_mutex_unlock(&grid_lock);
+         return NC_ENOMEM;
+      }
+      strcpy(grid->b_path, real_path);
+      if ((ret = parse_grid_b(grid)))
+      {
+         LOG((2, "%s: no usable grid in %s (%d)", __func__, real_path, ret));
+         pthread_mutex_unlock(&grid_lock);
+         free(grid);
+         return NC_NOERR;
+      }
+      pthread_mutex_init(&grid->lock, NULL);
+      grid->refs = 1;
+      grid->next = grid_list;
+      grid_list = grid;
+   }
+   pthread_mutex_unlock(&grid_lock);
+
+   /* Only a grid of the same shape is any use. */
+   if (grid->i_len != ab_file->i_len || grid->j_len != ab_file->j_len)
+   {
+      ab_grid_close(grid);
+      return NC_NOERR;
+   }
+   ab_file->grid = grid;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Let go of a regional grid. It is freed when no file uses
+ * it.
+ *
+ * @param grid Pointer to the grid. Ignored if NULL.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_grid_close(SION_GRID_T *grid)
+{
+   SION_GRID_T **prev;
+
+   if (!grid)
+      return;
+
+   pthread_mutex_lock(&grid_lock);
+   if (!--grid->refs)
+   {
+      for (prev = &grid_list; *prev != grid; prev = &(*prev)->next)
+         ;
+      *prev = grid->next;
+      for (int f = 0; f < grid->nfields; f++)
+         free(grid->field[f]);
+      pthread_mutex_destroy(&grid->lock);
+      free(grid);
+   }
+   pthread_mutex_unlock(&grid_lock);
+}
+
+/**
+ * @internal Read and decode one field of a regional grid, if not
+ * already done.
+ *
+ * @param grid Pointer to the grid.
+ * @param f Field number.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the grid A file.
+ */
+static int
+load_field(SION_GRID_T *grid, int f)
+{
+   size_t n = (size_t)grid->j_len * grid->i_len;
+   char a_path[PATH_MAX];
+   FILE *a_file;
+   float *field;
+   int ret = NC_NOERR;
+
+   pthread_mutex_lock(&grid->lock);
+   if (grid->field[f])
+   {
+      pthread_mutex_unlock(&grid->lock);
+      return NC_NOERR;
+   }
+   LOG((2, "%s: %s field %d", __func__, grid->name[f], f));
+
+   strcpy(a_path, grid->b_path);
+   a_path[strlen(a_path) - 1] = 'a';
+   if (!(field = malloc(n * sizeof(float))))
+      ret = NC_ENOMEM;
+   else if (!(a_file = fopen(a_path, "r")))
+      ret = NC_EIO;
+   else
+   {
+      if (fseeko(a_file, (off_t)f * ab_rec_len(grid->j_len, grid->i_len),
+                 SEEK_SET) ||
+          fread(field, sizeof(float), n, a_file) != n)
+         ret = NC_EIO;
+      fclose(a_file);
+   }
+   if (!ret)
+   {
+      float *range = grid->range[f];
+      int have_range = range[0] != NC_FILL_FLOAT && range[1] != NC_FILL_FLOAT;
+
+      if (ab_float_order(field, n < SION_ORDER_SAMPLE ? n : SION_ORDER_SAMPLE,
+                         have_range ? range : NULL))
+         ab_reverse_floats(field, field, n);
+      grid->field[f] = field;
+   }
+   else
+      free(field);
+   pthread_mutex_unlock(&grid->lock);
+
+   return ret;
+}
+
+/**
+ * @internal Read a hyperslab of a grid coordinate variable.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param f Field number in the grid.
+ * @param startp Array of start indicies, j and i.
+ * @param countp Array of counts, j and i.
+ * @param data Pointer that gets the data.
+ * @param memtype The type of these data after it is read into memory.
+ * @param type_size Size of memtype in bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVALCOORDS Start out of range.
+ * @return ::NC_EEDGE Start plus count out of range.
+ * @return ::NC_ERANGE Range error when converting data.
+ * @return ::NC_EIO Could not read the grid A file.
+ * @author Ed Hartnett
+ */
+int
+ab_grid_get_vara(SION_FILE_INFO_T *ab_file, int f, const size_t *startp,
+                 const size_t *countp, void *data, nc_type memtype,
+                 size_t type_size)
+{
+   SION_GRID_T *grid = ab_file->grid;
+   int range_error = 0;
+   int ret;
+
+   assert(grid && f >= 0 && f < grid->nfields && startp && countp && data);
+
+   if (startp[0] > grid->j_len || startp[1] > grid->i_len)
+      return NC_EINVALCOORDS;
+   if (startp[0] + countp[0] > grid->j_len || startp[1] + countp[1] > grid->i_len)
+      return NC_EEDGE;
+   if ((ret = load_field(grid, f)))
+      return ret;
+
+   /* Copy or convert one row at a time. */
+   for (size_t j = 0; j < countp[0]; j++)
+   {
+      const float *row = grid->field[f] + (startp[0] + j) * grid->i_len +
+         startp[1];
+      char *dst = (char *)data + j * countp[1] * type_size;
+
+      if (memtype == NC_FLOAT)
+         memcpy(dst, row, countp[1] * sizeof(float));
+      else if ((ret = nc4_convert_type(row, dst, NC_FLOAT, memtype, countp[1],
+                                       &range_error, NULL, 0, 0, 0)))
+         return ret;
+   }
+
+   if (range_error)
+      return NC_ERANGE;
+   return NC_NOERR;
+}
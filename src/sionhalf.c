@@ -0,0 +1,286 @@
+/**
+ * @file
+ * @internal Reads of AB data as 16-bit floats.
+ *
+ * Many consumers of HYCOM fields, such as training pipelines, want
+ * them in half precision. SION_get_vara_half() reads a record at a
+ * time into a staging buffer of floats and converts it in one pass,
+ * putting in the void value as it goes, so a float array of the
+ * whole read is never made.
+ *
+ * On x86-64, IEEE half conversion uses AVX-512 or F16C when the CPU
+ * running the library has them, whatever the build flags. Elsewhere,
+ * and for bfloat16, it is plain C.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include <math.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HALF_X86 1
+#endif
+
+/**
+ * @internal Convert a float to IEEE 754 binary16, rounding to
+ * nearest even.
+ *
+ * @param f The float.
+ *
+ * @return The half.
+ */
+static uint16_t
+float_to_half(float f)
+{
+   uint32_t x, abs, sign, h, rem;
+
+   memcpy(&x, &f, sizeof(x));
+   sign = (x >> 16) & 0x8000;
+   abs = x & 0x7fffffff;
+
+   /* Inf and NaN, keeping NaNs quiet. */
+   if (abs >= 0x7f800000)
+      return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+
+   /* Too big: 65520 and up round to Inf. */
+   if (abs >= 0x477ff000)
+      return sign | 0x7c00;
+
+   /* Too small for a normal half; below 2^-25 is zero. */
+   if (abs < 0x38800000)
+   {
+      uint32_t mant = (abs & 0x7fffff) | 0x800000;
+      int shift = 126 - (int)(abs >> 23);
+      uint32_t tie;
+
+      if (abs < 0x33000000)
+         return sign;
+      h = mant >> shift;
+      rem = mant & ((1u << shift) - 1);
+      tie = 1u << (shift - 1);
+      if (rem > tie || (rem == tie && (h & 1)))
+         h++;
+      return sign | h;
+   }
+
+   /* Rebias the exponent and round the mantissa; a carry into the
+    * exponent is still right. */
+   h = (abs >> 13) - ((127 - 15) << 10);
+   rem = abs & 0x1fff;
+   if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+      h++;
+   return sign | h;
+}
+
+/**
+ * @internal Convert a float to bfloat16, rounding to nearest even.
+ *
+ * @param f The float.
+ *
+ * @return The bfloat16.
+ */
+static uint16_t
+float_to_bfloat16(float f)
+{
+   uint32_t x;
+
+   memcpy(&x, &f, sizeof(x));
+   if ((x & 0x7fffffff) > 0x7f800000)
+      return (x >> 16) | 0x40;
+   x += 0x7fff + ((x >> 16) & 1);
+   return x >> 16;
+}
+
+#ifdef HALF_X86
+/**
+ * @internal Convert floats to IEEE halves 16 at a time with AVX-512,
+ * putting void_value in place of data voids.
+ *
+ * @param bufr Floats to convert.
+ * @param num Number of floats.
+ * @param void_value Value for data voids.
+ * @param data Pointer that gets the halves.
+ *
+ * @return Number of floats converted, a multiple of 16.
+ */
+__attribute__((target("avx512f"))) static size_t
+convert_avx512(const float *bufr, size_t num, float void_value,
+               uint16_t *data)
+{
+   const __m512 big = _mm512_set1_ps(SION_VOID);
+   const __m512 fill = _mm512_set1_ps(void_value);
+   size_t n = 0;
+
+   for (; n + 16 <= num; n += 16)
+   {
+      __m512 v = _mm512_loadu_ps(bufr + n);
+      __mmask16 is_void = _mm512_cmp_ps_mask(_mm512_abs_ps(v), big,
+                                             _CMP_GE_OQ);
+
+      v = _mm512_mask_mov_ps(v, is_void, fill);
+      _mm256_storeu_si256((__m256i *)(data + n),
+                          _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+   }
+   return n;
+}
+
+/**
+ * @internal Convert floats to IEEE halves 8 at a time with F16C,
+ * putting void_value in place of data voids.
+ *
+ * @param bufr Floats to convert.
+ * @param num Number of floats.
+ * @param void_value Value for data voids.
+ * @param data Pointer that gets the halves.
+ *
+ * @return Number of floats converted, a multiple of 8.
+ */
+__attribute__((target("avx,f16c"))) static size_t
+convert_f16c(const float *bufr, size_t num, float void_value,
+             uint16_t *data)
+{
+   const __m256 sign = _mm256_set1_ps(-0.0f);
+   const __m256 big = _mm256_set1_ps(SION_VOID);
+   const __m256 fill = _mm256_set1_ps(void_value);
+   size_t n = 0;
+
+   for (; n + 8 <= num; n += 8)
+   {
+      __m256 v = _mm256_loadu_ps(bufr + n);
+      __m256 is_void = _mm256_cmp_ps(_mm256_andnot_ps(sign, v), big,
+                                     _CMP_GE_OQ);
+
+      v = _mm256_blendv_ps(v, fill, is_void);
+      _mm_storeu_si128((__m128i *)(data + n),
+                       _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+   }
+   return n;
+}
+#endif /* HALF_X86 */
+
+/**
+ * @internal Convert floats to 16-bit floats, putting void_value in
+ * place of data voids.
+ *
+ * @param bufr Floats to convert.
+ * @param num Number of floats.
+ * @param format ::SION_HALF_IEEE or ::SION_HALF_BFLOAT16.
+ * @param void_value Value for data voids.
+ * @param data Pointer that gets the 16-bit floats.
+ */
+static void
+convert_half(const float *bufr, size_t num, int format, float void_value,
+             uint16_t *data)
+{
+   size_t n = 0;
+
+   if (format == SION_HALF_BFLOAT16)
+   {
+      for (; n < num; n++)
+         data[n] = float_to_bfloat16(fabsf(bufr[n]) >= SION_VOID ?
+                                     void_value : bufr[n]);
+      return;
+   }
+
+#ifdef HALF_X86
+   if (__builtin_cpu_supports("avx512f"))
+      n = convert_avx512(bufr, num, void_value, data);
+   else if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+      n = convert_f16c(bufr, num, void_value, data);
+#endif
+   for (; n < num; n++)
+      data[n] = float_to_half(fabsf(bufr[n]) >= SION_VOID ?
+                              void_value : bufr[n]);
+}
+
+/**
+ * Read an array of values as 16-bit floats. This works like
+ * nc_get_vara() on any var of an AB file, but converts to IEEE half
+ * precision or bfloat16, rounding to nearest even. Values too big
+ * for a half become Inf.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID.
+ * @param startp Array of start indicies.
+ * @param countp Array of counts.
+ * @param format ::SION_HALF_IEEE or ::SION_HALF_BFLOAT16.
+ * @param void_value Value to use for data voids (2^100 in HYCOM
+ * files), before conversion.
+ * @param data Pointer that gets the data.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTVAR Var not found.
+ * @return ::NC_EINVAL Invalid input.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EINVALCOORDS Start out of range.
+ * @return ::NC_EEDGE Start plus count out of range.
+ * @return ::NC_EIO Could not read the A file.
+ * @author Ed Hartnett
+ */
+int
+SION_get_vara_half(int ncid, int varid, const size_t *startp,
+                   const size_t *countp, int format, float void_value,
+                   uint16_t *data)
+{
+   NC *nc;
+   NC_GRP_INFO_T *grp;
+   NC_HDF5_FILE_INFO_T *h5;
+   NC_VAR_INFO_T *var;
+   size_t start[SION_NDIMS3], count[SION_NDIMS3];
+   size_t nrec = 1, num = 1;
+   float *bufr;
+   int ret = NC_NOERR;
+
+   LOG((2, "%s: ncid 0x%x varid %d format %d", __func__, ncid, varid,
+        format));
+
+   if (format != SION_HALF_IEEE && format != SION_HALF_BFLOAT16)
+      return NC_EINVAL;
+   if (!startp || !countp || !data)
+      return NC_EINVAL;
+   if (!(nc = nc4_find_nc_file(ncid, &h5)))
+      return NC_EBADID;
+   if ((ret = nc4_find_g_var_nc(nc, ncid, varid, &grp, &var)))
+      return ret;
+   assert(var->ndims <= SION_NDIMS3);
+
+   /* The data var is done a record at a time, the others all at
+    * once. */
+   for (int d = 0; d < var->ndims; d++)
+   {
+      start[d] = startp[d];
+      count[d] = countp[d];
+   }
+   if (var->ndims == SION_NDIMS3)
+   {
+      nrec = count[0];
+      count[0] = 1;
+   }
+   for (int d = 0; d < var->ndims; d++)
+      num *= count[d];
+   if (!num || !nrec)
+   {
+      float none;
+
+      /* Nothing to read, but the start still gets checked. */
+      return SION_get_vara(ncid, varid, startp, countp, &none, NC_FLOAT);
+   }
+
+   if (!(bufr = malloc(num * sizeof(float))))
+      return NC_ENOMEM;
+   for (size_t r = 0; !ret && r < nrec; r++)
+   {
+      if (var->ndims == SION_NDIMS3)
+         start[0] = startp[0] + r;
+      if (!(ret = SION_get_vara(ncid, varid, start, count, bufr, NC_FLOAT)))
+         convert_half(bufr, num, format, void_value, data + r * num);
+   }
+   free(bufr);
+
+   return ret;
+}
@@ -0,0 +1,237 @@
+/**
+ * @file
+ * @internal Access pattern hints for the AB dispatch layer.
+ *
+ * The same file is read whole field by whole field, as point time
+ * series, or as small boxes, and no one way of reading suits all of
+ * them. SION_set_access_hint() tells the library how the data var of
+ * a file will be read, and sets the shared cache use, coalescing
+ * gap, read-ahead and page cache advice to match:
+ *
+ * - ::SION_HINT_SEQUENTIAL: records in time order. Rows are merged
+ *   into spans, and the next record is read ahead.
+ * - ::SION_HINT_RANDOM: whole records in no order. Adjacent rows are
+ *   merged into spans, but no read-ahead, and no bytes read that were
+ *   not asked for.
+ * - ::SION_HINT_TIME_SERIES: a few points from many records. Rows are
+ *   read one by one, skipping the shared cache, which would decode
+ *   whole records.
+ * - ::SION_HINT_BOX: boxes within records. Rows of a box are merged
+ *   into one read.
+ * - ::SION_HINT_SCAN: every record once. Records are read whole and
+ *   ahead, kept out of the shared cache, and dropped from the page
+ *   cache once read.
+ *
+ * SION_inq_read_stats() reports how the reads of SION_get_vara()
+ * were served.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <fcntl.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/**
+ * @internal Find the AB file info and check the varid.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID of the data var.
+ * @param ab_filep Pointer that gets the AB file info.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTVAR Var not found.
+ * @return ::NC_EINVAL Not the data var.
+ */
+static int
+find_data_var(int ncid, int varid, SION_FILE_INFO_T **ab_filep)
+{
+   NC *nc;
+   NC_GRP_INFO_T *grp;
+   NC_HDF5_FILE_INFO_T *h5;
+   NC_VAR_INFO_T *var;
+   int ret;
+
+   if (!(nc = nc4_find_nc_file(ncid, &h5)))
+      return NC_EBADID;
+   if ((ret = nc4_find_g_var_nc(nc, ncid, varid, &grp, &var)))
+      return ret;
+   assert(h5 && h5->format_file_info);
+   *ab_filep = h5->format_file_info;
+   if (varid != (*ab_filep)->varid)
+      return NC_EINVAL;
+
+   return NC_NOERR;
+}
+
+#ifdef POSIX_FADV_NORMAL
+/**
+ * @internal Give the kernel advice about a range of the A file, if
+ * it is read through the stdio stream.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param pos Offset.
+ * @param len Length in bytes, 0 for the whole file.
+ * @param advice POSIX_FADV_* advice.
+ */
+static void
+advise(SION_FILE_INFO_T *ab_file, off_t pos, off_t len, int advice)
+{
+   if (ab_file->a_file && !ab_file->stream)
+      posix_fadvise(fileno(ab_file->a_file), pos, len, advice);
+}
+#endif
+
+/**
+ * Tell the library how the data var of a file is going to be
+ * read. This sets the coalescing gap, so call
+ * SION_set_coalesce_gap() after it to use some other gap.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID of the data var.
+ * @param hint One of the SION_HINT_* values; ::SION_HINT_NONE goes
+ * back to the defaults.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTVAR Var not found.
+ * @return ::NC_EINVAL Not the data var, or unknown hint.
+ * @author Ed Hartnett
+ */
+int
+SION_set_access_hint(int ncid, int varid, int hint)
+{
+   SION_FILE_INFO_T *ab_file;
+   int ret;
+
+   LOG((2, "%s: ncid 0x%x varid %d hint %d", __func__, ncid, varid, hint));
+
+   if (hint < SION_HINT_NONE || hint > SION_HINT_SCAN)
+      return NC_EINVAL;
+   if ((ret = find_data_var(ncid, varid, &ab_file)))
+      return ret;
+
+   ab_file->hint = hint;
+   switch (hint)
+   {
+   case SION_HINT_RANDOM:
+   case SION_HINT_TIME_SERIES:
+      ab_file->gap = 0;
+      break;
+   case SION_HINT_SCAN:
+      ab_file->gap = ab_file->rec_len;
+      break;
+   default:
+      ab_file->gap = SION_DEFAULT_GAP;
+   }
+
+#ifdef POSIX_FADV_NORMAL
+   if (hint == SION_HINT_SEQUENTIAL || hint == SION_HINT_SCAN)
+      advise(ab_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+   else if (hint == SION_HINT_NONE)
+      advise(ab_file, 0, 0, POSIX_FADV_NORMAL);
+   else
+      advise(ab_file, 0, 0, POSIX_FADV_RANDOM);
+#endif
+
+   return NC_NOERR;
+}
+
+/**
+ * Find out the access hint of the data var of a file, and how many
+ * reads of it through SION_get_vara() were served each way.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID of the data var.
+ * @param hintp Pointer that gets the hint. Ignored if NULL.
+ * @param servedp Array of ::SION_NSERVED that gets the number of
+ * reads served by the shared cache (::SION_SERVED_SHM), by merged
+ * spans (::SION_SERVED_SPANS), and row by row
+ * (::SION_SERVED_ROWS). Ignored if NULL.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTVAR Var not found.
+ * @return ::NC_EINVAL Not the data var.
+ * @author Ed Hartnett
+ */
+int
+SION_inq_read_stats(int ncid, int varid, int *hintp, size_t *servedp)
+{
+   SION_FILE_INFO_T *ab_file;
+   int ret;
+
+   if ((ret = find_data_var(ncid, varid, &ab_file)))
+      return ret;
+
+   if (hintp)
+      *hintp = ab_file->hint;
+   if (servedp)
+      for (int s = 0; s < SION_NSERVED; s++)
+         servedp[s] = __atomic_load_n(&ab_file->served[s], __ATOMIC_RELAXED);
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Choose how to serve a read of the data var.
+ *
+ * @param ab_file Pointer to AB file info.
+ *
+ * @return ::SION_SERVED_SHM, ::SION_SERVED_SPANS or
+ * ::SION_SERVED_ROWS.
+ * @author Ed Hartnett
+ */
+int
+ab_hint_strategy(SION_FILE_INFO_T *ab_file)
+{
+   int hint = ab_file->hint;
+
+   if (ab_file->shm && hint != SION_HINT_TIME_SERIES && hint != SION_HINT_SCAN)
+      return SION_SERVED_SHM;
+
+   /* Compressed files are always read through the scheduler. */
+   if (ab_file->zstd || hint == SION_HINT_SEQUENTIAL ||
+       hint == SION_HINT_RANDOM || hint == SION_HINT_BOX ||
+       hint == SION_HINT_SCAN)
+      return SION_SERVED_SPANS;
+   return SION_SERVED_ROWS;
+}
+
+/**
+ * @internal Count a read of the data var, and give the page cache
+ * advice that follows from the hint: read the next record ahead, and
+ * for a scan, drop the records just read.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param startp Array of start indicies of the read.
+ * @param countp Array of counts of the read.
+ * @param served How the read was served.
+ * @author Ed Hartnett
+ */
+void
+ab_hint_done(SION_FILE_INFO_T *ab_file, const size_t *startp,
+             const size_t *countp, int served)
+{
+   int hint = ab_file->hint;
+   size_t next = startp[0] + countp[0];
+
+   __atomic_add_fetch(&ab_file->served[served], 1, __ATOMIC_RELAXED);
+
+   /* Record offsets mean nothing in a compressed file, and the shared
+    * cache does its own reads. */
+   if (ab_file->zstd || served == SION_SERVED_SHM)
+      return;
+
+#ifdef POSIX_FADV_NORMAL
+   if ((hint == SION_HINT_SEQUENTIAL || hint == SION_HINT_SCAN) &&
+       next < ab_file->t_len)
+      advise(ab_file, (off_t)next * ab_file->rec_len, ab_file->rec_len,
+             POSIX_FADV_WILLNEED);
+   if (hint == SION_HINT_SCAN)
+      advise(ab_file, (off_t)startp[0] * ab_file->rec_len,
+             (off_t)countp[0] * ab_file->rec_len, POSIX_FADV_DONTNEED);
+#endif
+}
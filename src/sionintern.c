@@ -0,0 +1,170 @@
+/**
+ * @file
+ * @internal Interning of read-only file metadata for the AB dispatch
+ * layer.
+ *
+ * Many AB files, or the same file opened many times, often carry the
+ * same read-only metadata: the same header and grid, and the same
+ * per-record days or data ranges. Such blocks are interned here:
+ * identical contents are kept once, with a reference count, and
+ * shared by all files that have them. Interned data must never be
+ * changed.
+ *
+ * Each block is in two hash tables, one by contents for ab_intern(),
+ * and one by address, so ab_unintern() finds it at once.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal Number of hash buckets. */
+#define SION_INTERN_BUCKETS 256
+
+/** @internal One interned array. */
+typedef struct SION_INTERN
+{
+   struct SION_INTERN *next; /* Next with the same contents bucket. */
+   struct SION_INTERN *next_addr; /* Next with the same address bucket. */
+   uint64_t hash;
+   size_t len; /* Length in bytes. */
+   int refs;
+   void *data;
+} SION_INTERN_T;
+
+static SION_INTERN_T *intern_bucket[SION_INTERN_BUCKETS];
+static SION_INTERN_T *addr_bucket[SION_INTERN_BUCKETS];
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @internal FNV-1a hash of some bytes.
+ *
+ * @param data Pointer to the bytes.
+ * @param len Number of bytes.
+ *
+ * @return The hash.
+ */
+static uint64_t
+intern_hash(const void *data, size_t len)
+{
+   const unsigned char *p = data;
+   uint64_t h = 14695981039346656037ULL;
+
+   for (size_t b = 0; b < len; b++)
+   {
+      h ^= p[b];
+      h *= 1099511628211ULL;
+   }
+   return h;
+}
+
+/**
+ * @internal Find the address bucket of an interned array.
+ *
+ * @param data Pointer to the interned array.
+ *
+ * @return The bucket number.
+ */
+static size_t
+addr_hash(const void *data)
+{
+   uintptr_t a = (uintptr_t)data;
+
+   /* Arrays from malloc() are aligned, so the low bits tell little. */
+   return (size_t)((a >> 4) ^ (a >> 12)) % SION_INTERN_BUCKETS;
+}
+
+/**
+ * @internal Intern an array. If the same bytes are already interned,
+ * the array given is freed and the interned one is used instead;
+ * otherwise the array given becomes the interned one.
+ *
+ * @param datap Pointer to a pointer to an array from malloc(). Gets
+ * the interned array, which must be released with ab_unintern().
+ * @param len Length of the array in bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_intern(void **datap, size_t len)
+{
+   SION_INTERN_T *in;
+   uint64_t hash;
+
+   assert(datap && *datap);
+
+   hash = intern_hash(*datap, len);
+   pthread_mutex_lock(&intern_lock);
+   for (in = intern_bucket[hash % SION_INTERN_BUCKETS]; in; in = in->next)
+      if (in->hash == hash && in->len == len && !memcmp(in->data, *datap, len))
+         break;
+   if (in)
+   {
+      in->refs++;
+      free(*datap);
+      *datap = in->data;
+   }
+   else
+   {
+      if (!(in = malloc(sizeof(SION_INTERN_T))))
+      {
+         pthread_mutex_unlock(&intern_lock);
+         return NC_ENOMEM;
+      }
+      in->hash = hash;
+      in->len = len;
+      in->refs = 1;
+      in->data = *datap;
+      in->next = intern_bucket[hash % SION_INTERN_BUCKETS];
+      intern_bucket[hash % SION_INTERN_BUCKETS] = in;
+      in->next_addr = addr_bucket[addr_hash(in->data)];
+      addr_bucket[addr_hash(in->data)] = in;
+   }
+   LOG((3, "%s: len %d refs %d", __func__, len, in->refs));
+   pthread_mutex_unlock(&intern_lock);
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Release an interned array. It is freed when the last
+ * file using it lets go.
+ *
+ * @param data Pointer to the interned array. Ignored if NULL.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_unintern(void *data)
+{
+   SION_INTERN_T **prev;
+   SION_INTERN_T *in;
+
+   if (!data)
+      return;
+
+   pthread_mutex_lock(&intern_lock);
+   for (prev = &addr_bucket[addr_hash(data)]; *prev; prev = &(*prev)->next_addr)
+      if ((*prev)->data == data)
+         break;
+   assert(*prev);
+   if ((in = *prev) && !--in->refs)
+   {
+      SION_INTERN_T **p;
+
+      /* Take it out of both tables. */
+      *prev = in->next_addr;
+      for (p = &intern_bucket[in->hash % SION_INTERN_BUCKETS]; *p != in;
+           p = &(*p)->next)
+         ;
+      *p = in->next;
+      free(in->data);
+      free(in);
+   }
+   pthread_mutex_unlock(&intern_lock);
+}
@@ -0,0 +1,292 @@
+/**
+ * @file
+ * @internal Reads of the data variable at any time between records.
+ *
+ * SION_get_vara_time() finds the two records either side of a time,
+ * by a binary search of the record times, and blends them linearly,
+ * in one pass that writes the result straight into the caller's
+ * array. A point that is a data void in either record is a void in
+ * the result.
+ *
+ * The two decoded records are kept with the file, so a model stepping
+ * through time between two forcing records reads each record only
+ * once, not once a step.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include <math.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal Number of decoded records kept. */
+#define SION_INTERP_NREC 2
+
+/** @internal Decoded records kept for SION_get_vara_time(). */
+struct SION_INTERP
+{
+   int t[SION_INTERP_NREC]; /* Record in each slot, or -1. */
+   float *rec[SION_INTERP_NREC]; /* j_len * i_len values, or NULL. */
+   pthread_mutex_t lock; /* Protects t and rec. */
+};
+
+/**
+ * @internal Free the records kept for a file.
+ *
+ * @param interp Pointer to the records. Ignored if NULL.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_interp_close(SION_INTERP_T *interp)
+{
+   if (!interp)
+      return;
+   for (int s = 0; s < SION_INTERP_NREC; s++)
+      free(interp->rec[s]);
+   pthread_mutex_destroy(&interp->lock);
+   free(interp);
+}
+
+/**
+ * @internal Get the records kept for a file, making them the first
+ * time.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param interpp Pointer that gets the records.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ */
+static int
+interp_get(SION_FILE_INFO_T *ab_file, SION_INTERP_T **interpp)
+{
+   SION_INTERP_T *interp, *none = NULL;
+
+   if ((interp = __atomic_load_n(&ab_file->interp, __ATOMIC_ACQUIRE)))
+   {
+      *interpp = interp;
+      return NC_NOERR;
+   }
+
+   if (!(interp = calloc(1, sizeof(SION_INTERP_T))))
+      return NC_ENOMEM;
+   for (int s = 0; s < SION_INTERP_NREC; s++)
+      interp->t[s] = -1;
+   pthread_mutex_init(&interp->lock, NULL);
+
+   /* Another thread may get there first; then use its records. */
+   if (!__atomic_compare_exchange_n(&ab_file->interp, &none, interp, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+   {
+      ab_interp_close(interp);
+      interp = none;
+   }
+   *interpp = interp;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Get a decoded record, reading it into a slot not holding
+ * the other record needed, if it is not already kept. Call with the
+ * lock held.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param interp Pointer to the records kept.
+ * @param t Record.
+ * @param keep Record that must stay, or -1.
+ * @param recp Pointer that gets the record.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the A file.
+ */
+static int
+interp_rec(SION_FILE_INFO_T *ab_file, SION_INTERP_T *interp, int t, int keep,
+           const float **recp)
+{
+   size_t start[SION_NDIMS3] = {t, 0, 0};
+   size_t count[SION_NDIMS3] = {1, ab_file->j_len, ab_file->i_len};
+   int s;
+   int ret;
+
+   for (s = 0; s < SION_INTERP_NREC; s++)
+      if (interp->t[s] == t)
+      {
+         *recp = interp->rec[s];
+         return NC_NOERR;
+      }
+
+   s = interp->t[0] == keep && keep >= 0;
+   if (!interp->rec[s] &&
+       !(interp->rec[s] = malloc((size_t)ab_file->j_len * ab_file->i_len *
+                                 sizeof(float))))
+      return NC_ENOMEM;
+   LOG((3, "%s: record %d into slot %d", __func__, t, s));
+
+   /* Forget what was in the slot until the new record is in. */
+   interp->t[s] = -1;
+   if ((ret = ab_read_vara(ab_file, start, count, interp->rec[s])))
+      return ret;
+   interp->t[s] = t;
+   *recp = interp->rec[s];
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Find the records either side of a time.
+ *
+ * @param day Time of each record, in increasing order, with the fill
+ * value for records with no time.
+ * @param t_len Number of records.
+ * @param time The time.
+ * @param t0p Pointer that gets the record at or before the time.
+ * @param wp Pointer that gets the weight of the record after it, 0
+ * if the time is that of record t0.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVALCOORDS Time before the first record, or after
+ * the last.
+ */
+static int
+interp_find(const float *day, int t_len, double time, int *t0p, float *wp)
+{
+   int lo = 0, hi;
+
+   /* Records at the end may have no time yet. */
+   while (t_len && day[t_len - 1] == NC_FILL_FLOAT)
+      t_len--;
+   if (!t_len || time < day[0] || time > day[t_len - 1])
+      return NC_EINVALCOORDS;
+   hi = t_len - 1;
+
+   /* Find the last record at or before the time. */
+   while (lo < hi)
+   {
+      int mid = lo + (hi - lo + 1) / 2;
+
+      if (day[mid] <= time)
+         lo = mid;
+      else
+         hi = mid - 1;
+   }
+   *t0p = lo;
+   *wp = time > day[lo] ? (time - day[lo]) / (day[lo + 1] - day[lo]) : 0;
+
+   return NC_NOERR;
+}
+
+/**
+ * Read an array of values of the data variable at a time between the
+ * times of two records, blended linearly from them. Points that are
+ * data voids in either record are voids. A time equal to that of a
+ * record reads that record.
+ *
+ * The two records are kept with the file, so reads at times between
+ * the same records, or stepping on to the next, read fewer records
+ * from the A file.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID of the data variable.
+ * @param time The time, in the units of the time variable.
+ * @param startp Array of start indicies, j and i.
+ * @param countp Array of counts, j and i.
+ * @param data Pointer that gets the data.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_EINVAL Not the data variable, or time is not a number.
+ * @return ::NC_EINVALCOORDS Start out of range, or time before the
+ * first record or after the last.
+ * @return ::NC_EEDGE Start plus count out of range.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the AB file.
+ * @author Ed Hartnett
+ */
+int
+SION_get_vara_time(int ncid, int varid, double time, const size_t *startp,
+                   const size_t *countp, float *data)
+{
+   NC_HDF5_FILE_INFO_T *h5;
+   SION_FILE_INFO_T *ab_file;
+   SION_INTERP_T *interp;
+   size_t dim_len[SION_NDIMS2];
+   const float *rec0, *rec1 = NULL;
+   const float void_value = SION_VOID_VALUE;
+   uint32_t void_bits;
+   float w;
+   int t0;
+   int ret;
+
+   LOG((2, "%s: ncid 0x%x varid %d time %f", __func__, ncid, varid, time));
+
+   if (!nc4_find_nc_file(ncid, &h5))
+      return NC_EBADID;
+   assert(h5 && h5->format_file_info);
+   ab_file = h5->format_file_info;
+   if (varid != ab_file->varid || isnan(time))
+      return NC_EINVAL;
+   if (!startp || !countp || !data)
+      return NC_EINVAL;
+
+   dim_len[0] = ab_file->j_len;
+   dim_len[1] = ab_file->i_len;
+   for (int d = 0; d < SION_NDIMS2; d++)
+   {
+      if (startp[d] > dim_len[d])
+         return NC_EINVALCOORDS;
+      if (startp[d] + countp[d] > dim_len[d])
+         return NC_EEDGE;
+   }
+
+   /* With SION_OPEN_INSTANT the times are not read until now. */
+   if ((ret = ab_load_b_records(ab_file)))
+      return ret;
+   if ((ret = interp_find(SION_REC_ATT(ab_file, 0), ab_file->t_len, time,
+                          &t0, &w)))
+      return ret;
+   if ((ret = interp_get(ab_file, &interp)))
+      return ret;
+
+   pthread_mutex_lock(&interp->lock);
+   ret = interp_rec(ab_file, interp, t0, w ? t0 + 1 : -1, &rec0);
+   if (!ret && w)
+      ret = interp_rec(ab_file, interp, t0 + 1, t0, &rec1);
+
+   /* Blend the rows of the box. The inner loop has no branches, so
+    * it can be vectorized; voids are put in with a bit mask, since
+    * the compiler will not turn a choice between float results into
+    * a select. */
+   memcpy(&void_bits, &void_value, sizeof(void_bits));
+   for (size_t j = 0; !ret && j < countp[0]; j++)
+   {
+      size_t off = (startp[0] + j) * ab_file->i_len + startp[1];
+      size_t n = countp[1];
+      const float *a = rec0 + off;
+      float *out = data + j * n;
+
+      if (!rec1)
+      {
+         memcpy(out, a, n * sizeof(float));
+         continue;
+      }
+      for (size_t i = 0; i < n; i++)
+      {
+         float x = a[i], y = rec1[off + i];
+         float v = (1 - w) * x + w * y;
+         uint32_t bits, mask;
+
+         mask = -(uint32_t)((fabsf(x) < SION_VOID) & (fabsf(y) < SION_VOID));
+         memcpy(&bits, &v, sizeof(bits));
+         bits = (bits & mask) | (void_bits & ~mask);
+         memcpy(&out[i], &bits, sizeof(bits));
+      }
+   }
+   pthread_mutex_unlock(&interp->lock);
+
+   return ret;
+}
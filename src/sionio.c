@@ -0,0 +1,353 @@
+/**
+ * @file
+ * @internal Low level reads of the A file for the AB dispatch layer.
+ *
+ * All reads of A file bytes go through ab_read_raw(). Normally that
+ * is a locked seek and read on the stdio stream. Compressed A files
+ * are read through the frame cache in sionzstd.c. Files opened with
+ * ::SION_OPEN_DIRECT are read instead through a record stream: whole
+ * padded records are read with O_DIRECT into one of two aligned
+ * buffers, and a helper thread reads the next record into the other
+ * buffer while the caller decodes the current one. Records are
+ * padded to 4096 words, so they are always aligned for direct I/O.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal States of a stream buffer. */
+#define SION_BUF_EMPTY 0
+#define SION_BUF_FILLING 1
+#define SION_BUF_FULL 2
+
+/** @internal Alignment of direct I/O buffers. */
+#define SION_DIRECT_ALIGN 4096
+
+/**
+ * @internal Read one whole record into a buffer, with the file
+ * descriptor of the stream.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param rec Record number.
+ * @param bufr Buffer of at least rec_len bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Read failed.
+ */
+static int
+stream_read_rec(SION_FILE_INFO_T *ab_file, size_t rec, void *bufr)
+{
+   SION_STREAM_T *st = ab_file->stream;
+   size_t done = 0;
+   off_t pos = (off_t)rec * ab_file->rec_len;
+
+   while (done < ab_file->rec_len)
+   {
+      ssize_t n = pread(st->fd, (char *)bufr + done, ab_file->rec_len - done,
+                        pos + done);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return NC_EIO;
+      done += n;
+   }
+
+#ifdef POSIX_FADV_DONTNEED
+   /* Without O_DIRECT, at least drop the pages we just used. */
+   if (!st->direct)
+      posix_fadvise(st->fd, pos, ab_file->rec_len, POSIX_FADV_DONTNEED);
+#endif
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal The read-ahead thread of a stream. Waits for a record
+ * to be asked for, and reads it into the buffer that the reader is
+ * not using.
+ *
+ * @param arg Pointer to the AB file info.
+ *
+ * @return NULL when the stream is shut down.
+ */
+static void *
+stream_main(void *arg)
+{
+   SION_FILE_INFO_T *ab_file = arg;
+   SION_STREAM_T *st = ab_file->stream;
+
+   pthread_mutex_lock(&st->lock);
+   for (;;)
+   {
+      long rec;
+      int b;
+
+      while (!st->quit && st->want < 0)
+         pthread_cond_wait(&st->cond, &st->lock);
+      if (st->quit)
+         break;
+      rec = st->want;
+      st->want = -1;
+
+      /* Already there, or on the way? */
+      if (st->rec[0] == rec || st->rec[1] == rec)
+         continue;
+
+      /* Use the buffer that does not hold the record being read. */
+      b = (st->rec[0] == rec - 1) ? 1 : 0;
+      if (st->state[b] == SION_BUF_FILLING)
+         continue;
+      st->state[b] = SION_BUF_FILLING;
+      st->rec[b] = rec;
+      pthread_mutex_unlock(&st->lock);
+
+      st->status[b] = stream_read_rec(ab_file, rec, st->bufr[b]);
+
+      pthread_mutex_lock(&st->lock);
+      st->state[b] = SION_BUF_FULL;
+      pthread_cond_broadcast(&st->cond);
+   }
+   pthread_mutex_unlock(&st->lock);
+
+   return NULL;
+}
+
+/**
+ * @internal Copy bytes of one record out of the stream buffers,
+ * reading the record if it is not there, and ask for the next record
+ * to be read ahead.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param rec Record number.
+ * @param off Offset of the first byte within the record.
+ * @param len Number of bytes.
+ * @param dst Buffer that gets the bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Read failed.
+ */
+static int
+stream_copy(SION_FILE_INFO_T *ab_file, long rec, size_t off, size_t len,
+            char *dst)
+{
+   SION_STREAM_T *st = ab_file->stream;
+   int ret = NC_NOERR;
+
+   pthread_mutex_lock(&st->lock);
+   for (;;)
+   {
+      int b;
+
+      for (b = 0; b < 2; b++)
+         if (st->rec[b] == rec)
+            break;
+
+      /* Wait for a read in progress. */
+      if (b < 2 && st->state[b] == SION_BUF_FILLING)
+      {
+         pthread_cond_wait(&st->cond, &st->lock);
+         continue;
+      }
+
+      if (b < 2)
+      {
+         /* Copy while holding the lock, so the read-ahead thread
+          * does not reuse the buffer under us. */
+         if (!(ret = st->status[b]))
+            memcpy(dst, (char *)st->bufr[b] + off, len);
+         else
+            st->rec[b] = -1;
+         break;
+      }
+
+      /* Not there, read it ourselves into a buffer that is not
+       * being filled. */
+      b = (st->state[0] == SION_BUF_FILLING) ? 1 : 0;
+      if (st->state[b] == SION_BUF_FILLING)
+      {
+         pthread_cond_wait(&st->cond, &st->lock);
+         continue;
+      }
+      st->state[b] = SION_BUF_FILLING;
+      st->rec[b] = rec;
+      pthread_mutex_unlock(&st->lock);
+
+      st->status[b] = stream_read_rec(ab_file, rec, st->bufr[b]);
+
+      pthread_mutex_lock(&st->lock);
+      st->state[b] = SION_BUF_FULL;
+      pthread_cond_broadcast(&st->cond);
+   }
+
+   /* Read ahead. */
+   if (!ret && rec + 1 < ab_file->t_len)
+   {
+      st->want = rec + 1;
+      pthread_cond_broadcast(&st->cond);
+   }
+   pthread_mutex_unlock(&st->lock);
+
+   return ret;
+}
+
+/**
+ * @internal Set up direct streaming reads of the A file. If the file
+ * system does not allow O_DIRECT, the stream still reads whole
+ * records ahead, and drops them from the page cache after use.
+ *
+ * @param ab_file Pointer to AB file info, with rec_len set.
+ * @param a_path Path of the A file.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not open A file or start thread.
+ * @author Ed Hartnett
+ */
+int
+ab_stream_open(SION_FILE_INFO_T *ab_file, const char *a_path)
+{
+   SION_STREAM_T *st;
+
+   assert(ab_file && a_path && !ab_file->stream && ab_file->rec_len);
+
+   if (!(st = calloc(1, sizeof(SION_STREAM_T))))
+      return NC_ENOMEM;
+   st->rec[0] = st->rec[1] = -1;
+   st->want = -1;
+
+#ifdef O_DIRECT
+   if ((st->fd = open(a_path, O_RDONLY | O_DIRECT)) >= 0)
+      st->direct++;
+   else
+#endif
+      st->fd = open(a_path, O_RDONLY);
+   if (st->fd < 0)
+   {
+      free(st);
+      return NC_EIO;
+   }
+   LOG((3, "%s: direct %d", __func__, st->direct));
+
+   for (int b = 0; b < 2; b++)
+      if (posix_memalign(&st->bufr[b], SION_DIRECT_ALIGN, ab_file->rec_len))
+      {
+         free(st->bufr[0]);
+         close(st->fd);
+         free(st);
+         return NC_ENOMEM;
+      }
+
+   pthread_mutex_init(&st->lock, NULL);
+   pthread_cond_init(&st->cond, NULL);
+   ab_file->stream = st;
+   if (pthread_create(&st->thread, NULL, stream_main, ab_file))
+   {
+      ab_file->stream = NULL;
+      ab_stream_close(st);
+      return NC_EIO;
+   }
+   st->started++;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Shut down a record stream and free it.
+ *
+ * @param st Pointer to the stream. Ignored if NULL.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_stream_close(SION_STREAM_T *st)
+{
+   if (!st)
+      return;
+
+   if (st->started)
+   {
+      pthread_mutex_lock(&st->lock);
+      st->quit++;
+      pthread_cond_broadcast(&st->cond);
+      pthread_mutex_unlock(&st->lock);
+      pthread_join(st->thread, NULL);
+   }
+   pthread_cond_destroy(&st->cond);
+   pthread_mutex_destroy(&st->lock);
+   close(st->fd);
+   free(st->bufr[0]);
+   free(st->bufr[1]);
+   free(st);
+}
+
+/**
+ * @internal Read bytes of the A file. This is the only place A file
+ * bytes are read.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param pos Offset of the first byte in the A file.
+ * @param len Number of bytes.
+ * @param bufr Buffer that gets the bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Read failed.
+ * @author Ed Hartnett
+ */
+int
+ab_read_raw(SION_FILE_INFO_T *ab_file, off_t pos, size_t len, void *bufr)
+{
+   int ret = NC_NOERR;
+
+   assert(ab_file && bufr);
+
+   /* Files opened in parallel are read through MPI-IO. */
+   if (ab_file->mpi)
+      return ab_mpi_read_raw(ab_file, pos, len, bufr);
+
+   /* Files opened from memory are read straight from it. */
+   if (ab_file->a_mem)
+   {
+      if (pos < 0 || pos > ab_file->a_mem_len || (off_t)len > ab_file->a_mem_len - pos)
+         return NC_EIO;
+      memcpy(bufr, ab_file->a_mem + pos, len);
+      return NC_NOERR;
+   }
+
+   /* Compressed files are read through the frame cache. */
+   if (ab_file->zstd)
+      return ab_zstd_read(ab_file->zstd, pos, len, bufr);
+
+   /* Streamed files are read a whole record at a time. */
+   if (ab_file->stream)
+   {
+      char *dst = bufr;
+
+      while (!ret && len)
+      {
+         long rec = pos / ab_file->rec_len;
+         size_t off = pos % ab_file->rec_len;
+         size_t n = ab_file->rec_len - off < len ? ab_file->rec_len - off : len;
+
+         ret = stream_copy(ab_file, rec, off, n, dst);
+         pos += n;
+         dst += n;
+         len -= n;
+      }
+      return ret;
+   }
+
+   /* The A file may also be read by the async I/O thread. */
+   pthread_mutex_lock(&ab_file->a_lock);
+   if (fseeko(ab_file->a_file, pos, SEEK_SET) ||
+       fread(bufr, 1, len, ab_file->a_file) != len)
+      ret = NC_EIO;
+   pthread_mutex_unlock(&ab_file->a_lock);
+
+   return ret;
+}
@@ -0,0 +1,359 @@
+/**
+ * @file
+ * @internal Record iterators for the AB dispatch layer.
+ *
+ * A streaming reader that looks at each record once does not need
+ * its own copy. SION_iter_next() lends out a read-only pointer to
+ * the next record, and SION_iter_release() gives it back. An
+ * iterator has two buffers: while the caller works on one record,
+ * the next is read into the other on the background I/O thread, so
+ * no more than two records are ever held.
+ *
+ * Uncompressed files in host byte order, not opened with
+ * ::SION_OPEN_DIRECT, ::SION_OPEN_VERIFY or in parallel, need no
+ * decoding or checking, so each record
+ * is mapped straight from the A file instead of read, and the next
+ * one is prefetched with madvise(). Such files opened from memory are lent
+ * out straight from the caller's buffer.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal Number of record buffers of an iterator. */
+#define SION_ITER_NBUF 2
+
+/** @internal States of an iterator buffer. */
+#define SION_BUF_FREE 0
+#define SION_BUF_LOADING 1
+#define SION_BUF_BORROWED 2
+
+/** @internal One record buffer of an iterator. */
+typedef struct SION_ITER_BUF
+{
+   int state;
+   size_t rec; /* Record held or being read. */
+   int req; /* Async request ID, if read. */
+   float *data; /* The record. */
+   void *map; /* Start of the mapping, if mapped. */
+   size_t map_len;
+} SION_ITER_BUF_T;
+
+/** @internal An iterator over the records of the data var. */
+struct SION_ITER
+{
+   int ncid;
+   int varid;
+   SION_FILE_INFO_T *ab_file;
+   int mapped; /* Non-zero if records are mapped, not read. */
+   size_t next_rec; /* Next record to hand out. */
+   size_t queued_rec; /* Next record to start loading. */
+   size_t end_rec; /* One past the last record. */
+   SION_ITER_BUF_T buf[SION_ITER_NBUF];
+};
+
+/**
+ * @internal Start loading the next record into a free buffer.
+ *
+ * @param iter Pointer to the iterator.
+ * @param b Pointer to the buffer.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Could not map the A file.
+ * @return Any error from SION_iget_vara().
+ */
+static int
+start_load(SION_ITER_T *iter, SION_ITER_BUF_T *b)
+{
+   SION_FILE_INFO_T *ab_file = iter->ab_file;
+   size_t len = (size_t)ab_file->j_len * ab_file->i_len * sizeof(float);
+   int ret;
+
+   b->rec = iter->queued_rec;
+   if (iter->mapped && ab_file->a_mem)
+   {
+      off_t pos = (off_t)b->rec * ab_file->rec_len;
+
+      if (pos + (off_t)len > ab_file->a_mem_len)
+         return NC_EIO;
+      b->map = NULL;
+      b->data = (float *)(ab_file->a_mem + pos);
+   }
+   else if (iter->mapped)
+   {
+      size_t page = (size_t)sysconf(_SC_PAGESIZE);
+      off_t pos = (off_t)b->rec * ab_file->rec_len;
+      off_t map_pos = pos / (off_t)page * (off_t)page;
+
+      b->map_len = len + (pos - map_pos);
+      b->map = mmap(NULL, b->map_len, PROT_READ, MAP_SHARED,
+                    fileno(ab_file->a_file), map_pos);
+      if (b->map == MAP_FAILED)
+         return NC_EIO;
+      madvise(b->map, b->map_len, MADV_WILLNEED);
+      b->data = (float *)((char *)b->map + (pos - map_pos));
+   }
+   else
+   {
+      size_t start[SION_NDIMS3] = {b->rec, 0, 0};
+      size_t count[SION_NDIMS3] = {1, ab_file->j_len, ab_file->i_len};
+
+      if ((ret = SION_iget_vara(iter->ncid, iter->varid, start, count,
+                                b->data, &b->req)))
+         return ret;
+   }
+   b->state = SION_BUF_LOADING;
+   iter->queued_rec++;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Start loading records into all free buffers, in order.
+ *
+ * @param iter Pointer to the iterator.
+ *
+ * @return ::NC_NOERR No error.
+ * @return Any error from start_load().
+ */
+static int
+fill_bufs(SION_ITER_T *iter)
+{
+   int ret;
+
+   for (int b = 0; b < SION_ITER_NBUF && iter->queued_rec < iter->end_rec; b++)
+      if (iter->buf[b].state == SION_BUF_FREE &&
+          (ret = start_load(iter, &iter->buf[b])))
+         return ret;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Finish with a buffer that is loading or lent out.
+ *
+ * @param iter Pointer to the iterator.
+ * @param b Pointer to the buffer.
+ *
+ * @return ::NC_NOERR No error.
+ * @return Any error from the read.
+ */
+static int
+drop_buf(SION_ITER_T *iter, SION_ITER_BUF_T *b)
+{
+   int ret = NC_NOERR;
+
+   if (iter->mapped && b->state != SION_BUF_FREE)
+   {
+      if (b->map)
+         munmap(b->map, b->map_len);
+   }
+   else if (b->state == SION_BUF_LOADING)
+      ret = SION_wait(b->req);
+   b->state = SION_BUF_FREE;
+   return ret;
+}
+
+/**
+ * Start iterating over records of the data variable of an AB
+ * file. The first two records start loading at once.
+ *
+ * The iterator must be closed with SION_iter_close() before the
+ * file is closed.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID of the data var.
+ * @param start First record.
+ * @param count Number of records.
+ * @param iterp Pointer that gets the iterator.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTVAR Var not found.
+ * @return ::NC_EINVAL Not the data var, or NULL iterp.
+ * @return ::NC_EINVALCOORDS Start out of range.
+ * @return ::NC_EEDGE Start plus count out of range.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not map the A file.
+ * @author Ed Hartnett
+ */
+int
+SION_iter_open(int ncid, int varid, size_t start, size_t count,
+               SION_ITER_T **iterp)
+{
+   NC *nc;
+   NC_GRP_INFO_T *grp;
+   NC_HDF5_FILE_INFO_T *h5;
+   NC_VAR_INFO_T *var;
+   SION_FILE_INFO_T *ab_file;
+   SION_ITER_T *iter;
+   size_t n;
+   int ret;
+
+   LOG((2, "%s: ncid 0x%x varid %d start %d count %d", __func__, ncid, varid,
+        start, count));
+
+   if (!iterp)
+      return NC_EINVAL;
+   if (!(nc = nc4_find_nc_file(ncid, &h5)))
+      return NC_EBADID;
+   if ((ret = nc4_find_g_var_nc(nc, ncid, varid, &grp, &var)))
+      return ret;
+   assert(h5 && h5->format_file_info);
+   ab_file = h5->format_file_info;
+   if (varid != ab_file->varid)
+      return NC_EINVAL;
+   if (start > ab_file->t_len)
+      return NC_EINVALCOORDS;
+   if (start + count > ab_file->t_len)
+      return NC_EEDGE;
+
+   if (!(iter = calloc(1, sizeof(SION_ITER_T))))
+      return NC_ENOMEM;
+   iter->ncid = ncid;
+   iter->varid = varid;
+   iter->ab_file = ab_file;
+   iter->next_rec = iter->queued_rec = start;
+   iter->end_rec = start + count;
+   iter->mapped = !ab_file->swap && !ab_file->zstd && !ab_file->stream &&
+      !ab_file->mpi && !ab_file->crc &&
+      (uintptr_t)ab_file->a_mem % sizeof(float) == 0;
+
+   /* Records that are read need somewhere to go. */
+   n = (size_t)ab_file->j_len * ab_file->i_len;
+   for (int b = 0; !iter->mapped && b < SION_ITER_NBUF; b++)
+      if (!(iter->buf[b].data = malloc(n * sizeof(float))))
+      {
+         SION_iter_close(iter);
+         return NC_ENOMEM;
+      }
+
+   if ((ret = fill_bufs(iter)))
+   {
+      SION_iter_close(iter);
+      return ret;
+   }
+   *iterp = iter;
+
+   return NC_NOERR;
+}
+
+/**
+ * Get the next record of an iterator, waiting for it if it is still
+ * loading. The record belongs to the iterator, and must not be
+ * changed; it stays valid until given back with SION_iter_release()
+ * or the iterator is closed. At most two records can be held at
+ * once.
+ *
+ * @param iter Pointer to the iterator.
+ * @param recp Pointer that gets the record number. Ignored if NULL.
+ * @param datap Pointer that gets the record, j_len * i_len native
+ * floats, or NULL after the last record.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL NULL input, or two records already held.
+ * @return ::NC_EIO Could not map the A file.
+ * @return Any error from reading the record.
+ * @author Ed Hartnett
+ */
+int
+SION_iter_next(SION_ITER_T *iter, size_t *recp, const float **datap)
+{
+   SION_ITER_BUF_T *b = NULL;
+   int ret;
+
+   if (!iter || !datap)
+      return NC_EINVAL;
+
+   *datap = NULL;
+   if (iter->next_rec == iter->end_rec)
+      return NC_NOERR;
+
+   /* The record was started when a buffer came free, unless that
+    * failed, or its read failed last time; if so, start it now. */
+   if ((ret = fill_bufs(iter)))
+      return ret;
+   for (int i = 0; i < SION_ITER_NBUF; i++)
+      if (iter->buf[i].state == SION_BUF_LOADING &&
+          iter->buf[i].rec == iter->next_rec)
+         b = &iter->buf[i];
+   if (!b)
+      return NC_EINVAL;
+
+   /* If the read failed, drop the records loading after it, so the
+    * next call starts again from this one. */
+   if (!iter->mapped && (ret = SION_wait(b->req)))
+   {
+      b->state = SION_BUF_FREE;
+      for (int i = 0; i < SION_ITER_NBUF; i++)
+         if (iter->buf[i].state == SION_BUF_LOADING)
+            drop_buf(iter, &iter->buf[i]);
+      iter->queued_rec = iter->next_rec;
+      return ret;
+   }
+   b->state = SION_BUF_BORROWED;
+   if (recp)
+      *recp = b->rec;
+   *datap = b->data;
+   iter->next_rec++;
+
+   return fill_bufs(iter);
+}
+
+/**
+ * Give back a record got from SION_iter_next(), so its buffer can
+ * take the next record.
+ *
+ * @param iter Pointer to the iterator.
+ * @param data The record.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Not a record held from this iterator.
+ * @return ::NC_EIO Could not map the A file.
+ * @return Any error from SION_iget_vara().
+ * @author Ed Hartnett
+ */
+int
+SION_iter_release(SION_ITER_T *iter, const float *data)
+{
+   if (!iter || !data)
+      return NC_EINVAL;
+
+   for (int b = 0; b < SION_ITER_NBUF; b++)
+      if (iter->buf[b].state == SION_BUF_BORROWED && iter->buf[b].data == data)
+      {
+         drop_buf(iter, &iter->buf[b]);
+         return fill_bufs(iter);
+      }
+   return NC_EINVAL;
+}
+
+/**
+ * Close an iterator. Records still held are no longer valid.
+ *
+ * @param iter Pointer to the iterator. Ignored if NULL.
+ *
+ * @return ::NC_NOERR No error.
+ * @author Ed Hartnett
+ */
+int
+SION_iter_close(SION_ITER_T *iter)
+{
+   if (!iter)
+      return NC_NOERR;
+
+   for (int b = 0; b < SION_ITER_NBUF; b++)
+   {
+      drop_buf(iter, &iter->buf[b]);
+      if (!iter->mapped)
+         free(iter->buf[b].data);
+   }
+   free(iter);
+
+   return NC_NOERR;
+}
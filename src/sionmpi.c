@@ -0,0 +1,522 @@
+/**
+ * @file
+ * @internal MPI parallel reads for the AB dispatch layer.
+ *
+ * An AB file opened with nc_open_par() is opened on every rank of the
+ * communicator, but only rank 0 reads the B file. It broadcasts the
+ * record layout, header info, byte order and per-record values, and
+ * every rank then reads the A file through MPI-IO.
+ *
+ * Reads are independent by default, with MPI_File_read_at(). After
+ * nc_var_par_access() with NC_COLLECTIVE, each rank's hyperslab of
+ * the data var becomes an MPI file view, a subarray of each padded
+ * record, and all ranks read together with MPI_File_read_all(), so
+ * that the MPI library can gather the reads of all ranks into a few
+ * large ones (two-phase I/O). Collective buffering is asked for
+ * unless the caller's info says otherwise.
+ *
+ * Files opened in parallel must not be compressed, and have no
+ * regional grid, overview levels, time reductions or checksums.
+ *
+ * Async reads of the data var are done by a background thread, which
+ * may only call MPI if MPI was started with MPI_THREAD_MULTIPLE. At
+ * lower thread levels SION_iget_vara() reads on the calling thread
+ * instead.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <limits.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+#ifdef HAVE_MPI
+#include "ncdispatch.h"
+
+/** @internal MPI-IO state of an AB file opened in parallel. */
+struct SION_MPI
+{
+   MPI_Comm comm;
+   MPI_Info info; /* Hints for file views. */
+   MPI_File fh; /* The A file. */
+   int threads; /* MPI thread level, from MPI_Query_thread(). */
+};
+
+/** @internal What rank 0 tells the other ranks about a file. */
+typedef struct SION_MPI_META
+{
+   int status; /* Result of preparing the file on rank 0. */
+   int t_len;
+   int j_len;
+   int i_len;
+   int swap;
+   SION_B_INFO_T b_info;
+} SION_MPI_META_T;
+
+/**
+ * @internal Open the A file of an AB file on all ranks.
+ *
+ * @param path The B file name.
+ * @param mpi_info Communicator and info from nc_open_par().
+ * @param mpip Pointer that gets the MPI-IO state.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not open the A file on this rank.
+ */
+static int
+mpi_open(const char *path, NC_MPI_INFO *mpi_info, SION_MPI_T **mpip)
+{
+   SION_MPI_T *mpi;
+   char *a_path;
+   char value[MPI_MAX_INFO_VAL + 1];
+   int flag = 0;
+
+   if (!(a_path = strdup(path)))
+      return NC_ENOMEM;
+   a_path[strlen(a_path) - 1] = 'a';
+   if (!(mpi = calloc(1, sizeof(SION_MPI_T))))
+   {
+      free(a_path);
+      return NC_ENOMEM;
+   }
+   MPI_Comm_dup(mpi_info->comm, &mpi->comm);
+   MPI_Query_thread(&mpi->threads);
+
+   /* Ask for collective buffering, unless the caller chose. */
+   if (mpi_info->info == MPI_INFO_NULL)
+      MPI_Info_create(&mpi->info);
+   else
+   {
+      MPI_Info_dup(mpi_info->info, &mpi->info);
+      MPI_Info_get(mpi->info, "romio_cb_read", MPI_MAX_INFO_VAL, value, &flag);
+   }
+   if (!flag)
+      MPI_Info_set(mpi->info, "romio_cb_read", "enable");
+
+   if (MPI_File_open(mpi->comm, a_path, MPI_MODE_RDONLY, mpi->info,
+                     &mpi->fh) != MPI_SUCCESS)
+      mpi->fh = MPI_FILE_NULL;
+   free(a_path);
+   *mpip = mpi;
+
+   return mpi->fh == MPI_FILE_NULL ? NC_EIO : NC_NOERR;
+}
+
+/**
+ * @internal Close the MPI-IO state of a file. This is collective.
+ *
+ * @param mpi Pointer to the MPI-IO state. Ignored if NULL.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_mpi_close(SION_MPI_T *mpi)
+{
+   if (!mpi)
+      return;
+   if (mpi->fh != MPI_FILE_NULL)
+      MPI_File_close(&mpi->fh);
+   MPI_Info_free(&mpi->info);
+   MPI_Comm_free(&mpi->comm);
+   free(mpi);
+}
+
+/**
+ * @internal Can threads other than the one that opened a file read it
+ * with MPI?
+ *
+ * @param mpi Pointer to the MPI-IO state.
+ *
+ * @return 1 if MPI was started with MPI_THREAD_MULTIPLE, 0 if not.
+ * @author Ed Hartnett
+ */
+int
+ab_mpi_threaded(SION_MPI_T *mpi)
+{
+   assert(mpi);
+   return mpi->threads == MPI_THREAD_MULTIPLE;
+}
+
+/**
+ * @internal Set up an AB file on all ranks of a communicator. Rank 0
+ * parses the B file and broadcasts what it learns; all ranks open the
+ * A file with MPI-IO. This is collective, and all ranks return the
+ * same result.
+ *
+ * @param path The B file name.
+ * @param parameters The NC_MPI_INFO from nc_open_par().
+ * @param ab_filep Pointer that gets the AB file info. Free with
+ * ab_free_file().
+ * @param b_info Pointer that gets the header atts and variable name.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL No communicator, or compressed A file.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not open or read A or B file.
+ * @author Ed Hartnett
+ */
+int
+ab_mpi_prepare(const char *path, void *parameters, SION_FILE_INFO_T **ab_filep,
+               SION_B_INFO_T *b_info)
+{
+   NC_MPI_INFO *mpi_info = parameters;
+   SION_FILE_INFO_T *ab_file = NULL;
+   SION_MPI_META_T meta;
+   float *rec_time = NULL, *rec_range = NULL;
+   size_t time_len, range_len;
+   int rank, status, ret;
+
+   assert(path && ab_filep && b_info);
+   if (!mpi_info)
+      return NC_EINVAL;
+   MPI_Comm_rank(mpi_info->comm, &rank);
+   LOG((2, "%s: path %s rank %d", __func__, path, rank));
+
+   /* Rank 0 does all the work of an ordinary open. */
+   memset(&meta, 0, sizeof(SION_MPI_META_T));
+   if (!rank)
+   {
+      meta.status = ab_prepare_file(path, &ab_file, &meta.b_info);
+      if (!meta.status && ab_file->zstd)
+         meta.status = NC_EINVAL;
+      if (!meta.status)
+         meta.status = ab_load_b_records(ab_file);
+      if (meta.status && ab_file)
+      {
+         ab_free_file(ab_file);
+         ab_file = NULL;
+      }
+      if (!meta.status)
+      {
+         meta.t_len = ab_file->t_len;
+         meta.j_len = ab_file->j_len;
+         meta.i_len = ab_file->i_len;
+         meta.swap = ab_file->swap;
+
+         /* These differ between ranks, or read outside MPI-IO. */
+         ab_grid_close(ab_file->grid);
+         ab_ovr_close(ab_file->ovr);
+         ab_reduce_close(ab_file->reduce);
+         ab_crc_close(ab_file->crc);
+         ab_file->grid = NULL;
+         ab_file->ovr = NULL;
+         ab_file->reduce = NULL;
+         ab_file->crc = NULL;
+         ab_file->shm = NULL;
+      }
+   }
+   MPI_Bcast(&meta, sizeof(SION_MPI_META_T), MPI_BYTE, 0, mpi_info->comm);
+   if (meta.status)
+      return meta.status;
+
+   /* The other ranks build the same file info. */
+   time_len = SION_REC_TIME_ATTS * (size_t)meta.t_len + 1;
+   range_len = (NUM_SION_VAR_ATTS - SION_REC_TIME_ATTS) * (size_t)meta.t_len + 1;
+   ret = NC_NOERR;
+   if (rank && !(ret = ab_prepare_bare(meta.t_len, meta.j_len, meta.i_len,
+                                       &ab_file)))
+   {
+      ab_file->swap = meta.swap;
+      ab_file->b_recs = meta.t_len;
+      rec_time = malloc(time_len * sizeof(float));
+      rec_range = malloc(range_len * sizeof(float));
+      if (!rec_time || !rec_range)
+         ret = NC_ENOMEM;
+   }
+   else if (!rank)
+   {
+      rec_time = ab_file->rec_time;
+      rec_range = ab_file->rec_range;
+   }
+   MPI_Allreduce(&ret, &status, 1, MPI_INT, MPI_MIN, mpi_info->comm);
+   if (status)
+   {
+      if (rank)
+      {
+         free(rec_range);
+         free(rec_time);
+      }
+      if (ab_file)
+         ab_free_file(ab_file);
+      return status;
+   }
+
+   /* Send the per-record values, and share them as usual. */
+   MPI_Bcast(rec_time, (int)(time_len * sizeof(float)), MPI_BYTE, 0,
+             mpi_info->comm);
+   MPI_Bcast(rec_range, (int)(range_len * sizeof(float)), MPI_BYTE, 0,
+             mpi_info->comm);
+   if (rank)
+      ret = ab_intern_rec_data(ab_file, rec_time, rec_range, meta.t_len);
+
+   /* All ranks open the A file together, and fail together if
+    * anything failed anywhere. */
+   status = mpi_open(path, mpi_info, &ab_file->mpi);
+   if (!ret)
+      ret = status;
+   MPI_Allreduce(&ret, &status, 1, MPI_INT, MPI_MIN, mpi_info->comm);
+   if (status)
+   {
+      ab_free_file(ab_file);
+      return status;
+   }
+
+   memcpy(b_info, &meta.b_info, sizeof(SION_B_INFO_T));
+   *ab_filep = ab_file;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Read bytes of the A file on this rank alone.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param pos Offset.
+ * @param len Number of bytes.
+ * @param bufr Buffer that gets the bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Read failed.
+ * @author Ed Hartnett
+ */
+int
+ab_mpi_read_raw(SION_FILE_INFO_T *ab_file, off_t pos, size_t len, void *bufr)
+{
+   MPI_Status status;
+   int nread = 0;
+   int ret = NC_NOERR;
+
+   assert(ab_file && ab_file->mpi && bufr);
+   if (len > INT_MAX)
+      return NC_EIO;
+
+   /* The async I/O thread may read too. */
+   pthread_mutex_lock(&ab_file->a_lock);
+   if (MPI_File_read_at(ab_file->mpi->fh, pos, bufr, (int)len, MPI_BYTE,
+                        &status) != MPI_SUCCESS ||
+       MPI_Get_count(&status, MPI_BYTE, &nread) != MPI_SUCCESS ||
+       nread != (int)len)
+      ret = NC_EIO;
+   pthread_mutex_unlock(&ab_file->a_lock);
+
+   return ret;
+}
+
+/**
+ * @internal Read a hyperslab of the data var with all ranks at
+ * once. Every rank must call this, each with its own hyperslab,
+ * which may be empty. A rank with a bad hyperslab reads nothing, so
+ * the others are not held up, and gets the error.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param startp Array of start indicies.
+ * @param countp Array of counts.
+ * @param data Pointer that gets the data, as native floats.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVALCOORDS Start out of range.
+ * @return ::NC_EEDGE Start plus count out of range.
+ * @return ::NC_EINVAL Too many values for one MPI read.
+ * @return ::NC_EIO Read failed.
+ * @author Ed Hartnett
+ */
+int
+ab_mpi_read_vara(SION_FILE_INFO_T *ab_file, const size_t *startp,
+                 const size_t *countp, float *data)
+{
+   SION_MPI_T *mpi = ab_file->mpi;
+   MPI_Datatype file_type = MPI_FLOAT;
+   MPI_Offset disp = 0;
+   MPI_Status status;
+   size_t num = countp[0] * countp[1] * countp[2];
+   int nread = 0;
+   int ret;
+
+   assert(mpi && startp && countp && data);
+
+   ret = ab_check_vara(ab_file, startp, countp);
+   if (!ret && num > INT_MAX)
+      ret = NC_EINVAL;
+   if (ret)
+      num = 0;
+
+   /* Each record gives a (j, i) subarray; records are rec_len
+    * apart. */
+   if (num)
+   {
+      int sizes[SION_NDIMS2] = {ab_file->j_len, ab_file->i_len};
+      int subsizes[SION_NDIMS2] = {(int)countp[1], (int)countp[2]};
+      int starts[SION_NDIMS2] = {(int)startp[1], (int)startp[2]};
+      MPI_Datatype sub_type, rec_type;
+
+      MPI_Type_create_subarray(SION_NDIMS2, sizes, subsizes, starts,
+                               MPI_ORDER_C, MPI_FLOAT, &sub_type);
+      MPI_Type_create_resized(sub_type, 0, ab_file->rec_len, &rec_type);
+      MPI_Type_contiguous((int)countp[0], rec_type, &file_type);
+      MPI_Type_commit(&file_type);
+      MPI_Type_free(&rec_type);
+      MPI_Type_free(&sub_type);
+      disp = (MPI_Offset)startp[0] * ab_file->rec_len;
+   }
+   LOG((3, "%s: %d values at record %d", __func__, num, startp[0]));
+
+   pthread_mutex_lock(&ab_file->a_lock);
+   if (MPI_File_set_view(mpi->fh, disp, MPI_FLOAT, file_type, "native",
+                         mpi->info) != MPI_SUCCESS ||
+       MPI_File_read_all(mpi->fh, data, (int)num, MPI_FLOAT,
+                         &status) != MPI_SUCCESS ||
+       MPI_Get_count(&status, MPI_FLOAT, &nread) != MPI_SUCCESS)
+   {
+      if (!ret)
+         ret = NC_EIO;
+   }
+   else if (!ret && nread != (int)num)
+      ret = NC_EIO;
+
+   /* Independent reads use byte offsets. */
+   MPI_File_set_view(mpi->fh, 0, MPI_BYTE, MPI_BYTE, "native", mpi->info);
+   pthread_mutex_unlock(&ab_file->a_lock);
+   if (num)
+      MPI_Type_free(&file_type);
+
+   if (!ret)
+      ret = ab_decode_floats(ab_file, data, data, num);
+   return ret;
+}
+
+/**
+ * @internal Choose independent or collective reads of a var of a
+ * file opened in parallel. Called by nc_var_par_access().
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID, or NC_GLOBAL for all vars.
+ * @param par_access NC_INDEPENDENT or NC_COLLECTIVE.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_ENOTVAR Var not found.
+ * @return ::NC_EINVAL Bad par_access.
+ * @return ::NC_ENOPAR File not opened in parallel.
+ * @author Ed Hartnett
+ */
+int
+SION_var_par_access(int ncid, int varid, int par_access)
+{
+   NC *nc;
+   NC_GRP_INFO_T *grp;
+   NC_HDF5_FILE_INFO_T *h5;
+   NC_VAR_INFO_T *var;
+   SION_FILE_INFO_T *ab_file;
+   int ret;
+
+   if (par_access != NC_INDEPENDENT && par_access != NC_COLLECTIVE)
+      return NC_EINVAL;
+   if (!(nc = nc4_find_nc_file(ncid, &h5)))
+      return NC_EBADID;
+   if (varid != NC_GLOBAL && (ret = nc4_find_g_var_nc(nc, ncid, varid, &grp,
+                                                      &var)))
+      return ret;
+   assert(h5 && h5->format_file_info);
+   ab_file = h5->format_file_info;
+   if (!ab_file->mpi)
+      return NC_ENOPAR;
+
+   /* Only the data var is read from the A file. */
+   if (varid == NC_GLOBAL || varid == ab_file->varid)
+      ab_file->collective = (par_access == NC_COLLECTIVE);
+
+   return NC_NOERR;
+}
+
+#else /* HAVE_MPI */
+
+/**
+ * @internal Parallel opens need MPI.
+ *
+ * @param path Ignored.
+ * @param parameters Ignored.
+ * @param ab_filep Ignored.
+ * @param b_info Ignored.
+ *
+ * @return ::NC_ENOPAR Always.
+ */
+int
+ab_mpi_prepare(const char *path, void *parameters, SION_FILE_INFO_T **ab_filep,
+               SION_B_INFO_T *b_info)
+{
+   return NC_ENOPAR;
+}
+
+/**
+ * @internal Never called without MPI.
+ *
+ * @param ab_file Ignored.
+ * @param pos Ignored.
+ * @param len Ignored.
+ * @param bufr Ignored.
+ *
+ * @return ::NC_ENOPAR Always.
+ */
+int
+ab_mpi_read_raw(SION_FILE_INFO_T *ab_file, off_t pos, size_t len, void *bufr)
+{
+   return NC_ENOPAR;
+}
+
+/**
+ * @internal Never called without MPI.
+ *
+ * @param ab_file Ignored.
+ * @param startp Ignored.
+ * @param countp Ignored.
+ * @param data Ignored.
+ *
+ * @return ::NC_ENOPAR Always.
+ */
+int
+ab_mpi_read_vara(SION_FILE_INFO_T *ab_file, const size_t *startp,
+                 const size_t *countp, float *data)
+{
+   return NC_ENOPAR;
+}
+
+/**
+ * @internal Never called without MPI.
+ *
+ * @param mpi Ignored.
+ *
+ * @return 0 Always.
+ */
+int
+ab_mpi_threaded(SION_MPI_T *mpi)
+{
+   return 0;
+}
+
+/**
+ * @internal Nothing to close without MPI.
+ *
+ * @param mpi Ignored.
+ */
+void
+ab_mpi_close(SION_MPI_T *mpi)
+{
+}
+
+/**
+ * @internal Without MPI, no file is opened in parallel.
+ *
+ * @param ncid Ignored.
+ * @param varid Ignored.
+ * @param par_access Ignored.
+ *
+ * @return ::NC_ENOPAR Always.
+ */
+int
+SION_var_par_access(int ncid, int varid, int par_access)
+{
+   return NC_ENOPAR;
+}
+
+#endif /* HAVE_MPI */
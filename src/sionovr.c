@@ -0,0 +1,473 @@
+/**
+ * @file
+ * @internal Overview levels of AB files, for quick-look reads.
+ *
+ * SION_build_overviews() makes a sidecar file next to an AB file,
+ * named like the B file but ending in .ovr, holding reduced copies of
+ * every record. Level L is the mean over blocks of 2^L by 2^L points,
+ * leaving out data voids; a block with no data is a void. All levels
+ * are built in one pass over the A file, each from the sums and
+ * counts of the level below.
+ *
+ * The sidecar is a header, then each level in turn, each level all
+ * records of that level, in host byte order. It is only used by
+ * files opened later, and only if it still matches the A file.
+ * SION_get_vara_level() reads from it.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal Starts every overview sidecar. */
+#define SION_OVR_MAGIC "SIONOVR1"
+
+/** @internal Reads back as this only in the byte order it was
+ * written in. */
+#define SION_OVR_ORDER 0x01020304
+
+/** @internal Ending of overview sidecar names. */
+#define SION_OVR_SUFFIX ".ovr"
+
+/** @internal Header of an overview sidecar. */
+typedef struct SION_OVR_HDR
+{
+   char magic[8];
+   uint32_t order;
+   int32_t nlevels;
+   int32_t t_len;
+   int32_t j_len;
+   int32_t i_len;
+   int64_t a_size; /* Size and mtime of the A file it was built from. */
+   int64_t a_mtime;
+} SION_OVR_HDR_T;
+
+/** @internal An open overview sidecar. */
+struct SION_OVR
+{
+   int fd;
+   int nlevels;
+   int t_len;
+   size_t j_len[SION_OVR_MAX_LEVELS + 1]; /* Shape of each level. */
+   size_t i_len[SION_OVR_MAX_LEVELS + 1];
+   off_t off[SION_OVR_MAX_LEVELS + 1]; /* Start of each level. */
+};
+
+/**
+ * @internal Get the name of the overview sidecar of an AB file.
+ *
+ * @param path Path of the B file.
+ * @param ovr_path Buffer of PATH_MAX that gets the sidecar path.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Name does not end in .b, or is too long.
+ */
+static int
+ovr_name(const char *path, char *ovr_path)
+{
+   size_t len = strlen(path);
+
+   if (len < 2 || strcmp(path + len - 2, ".b") ||
+       len - 2 + sizeof(SION_OVR_SUFFIX) > PATH_MAX)
+      return NC_EINVAL;
+   memcpy(ovr_path, path, len - 2);
+   strcpy(ovr_path + len - 2, SION_OVR_SUFFIX);
+   return NC_NOERR;
+}
+
+/**
+ * @internal Work out the shape and place of each level.
+ *
+ * @param ovr Pointer to the overview info, with nlevels, t_len and
+ * the full resolution shape in level 0 set.
+ */
+static void
+ovr_layout(SION_OVR_T *ovr)
+{
+   ovr->off[1] = sizeof(SION_OVR_HDR_T);
+   for (int l = 1; l <= ovr->nlevels; l++)
+   {
+      ovr->j_len[l] = (ovr->j_len[l - 1] + 1) / 2;
+      ovr->i_len[l] = (ovr->i_len[l - 1] + 1) / 2;
+      if (l < ovr->nlevels)
+         ovr->off[l + 1] = ovr->off[l] + (off_t)ovr->t_len * ovr->j_len[l] *
+            ovr->i_len[l] * sizeof(float);
+   }
+}
+
+/**
+ * @internal Get the size and mtime of the A file.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param hdr Pointer to a header that gets them.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Could not stat the A file.
+ */
+static int
+ovr_stamp(SION_FILE_INFO_T *ab_file, SION_OVR_HDR_T *hdr)
+{
+   struct stat st;
+
+   if (fstat(fileno(ab_file->a_file), &st))
+      return NC_EIO;
+   hdr->a_size = st.st_size;
+   hdr->a_mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Open the overview sidecar of an AB file, if there is one
+ * that matches the A file. A missing or stale sidecar is not an
+ * error; the file simply has no overviews.
+ *
+ * @param ab_file Pointer to AB file info, with the shape set.
+ * @param path Path of the B file.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_ovr_open(SION_FILE_INFO_T *ab_file, const char *path)
+{
+   char ovr_path[PATH_MAX];
+   SION_OVR_HDR_T hdr, now;
+   SION_OVR_T *ovr;
+   int fd;
+
+   assert(ab_file && path);
+
+   if (ovr_name(path, ovr_path) || (fd = open(ovr_path, O_RDONLY)) < 0)
+      return NC_NOERR;
+   if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+       memcmp(hdr.magic, SION_OVR_MAGIC, sizeof(hdr.magic)) ||
+       hdr.order != SION_OVR_ORDER || hdr.nlevels < 1 ||
+       hdr.nlevels > SION_OVR_MAX_LEVELS || hdr.j_len != ab_file->j_len ||
+       hdr.i_len != ab_file->i_len || ovr_stamp(ab_file, &now) ||
+       hdr.a_size != now.a_size || hdr.a_mtime != now.a_mtime)
+   {
+      LOG((2, "%s: %s does not match, not used", __func__, ovr_path));
+      close(fd);
+      return NC_NOERR;
+   }
+
+   if (!(ovr = calloc(1, sizeof(SION_OVR_T))))
+   {
+      close(fd);
+      return NC_ENOMEM;
+   }
+   ovr->fd = fd;
+   ovr->nlevels = hdr.nlevels;
+   ovr->t_len = hdr.t_len;
+   ovr->j_len[0] = hdr.j_len;
+   ovr->i_len[0] = hdr.i_len;
+   ovr_layout(ovr);
+   ab_file->ovr = ovr;
+   LOG((3, "%s: %s nlevels %d t_len %d", __func__, ovr_path, ovr->nlevels,
+        ovr->t_len));
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Close an overview sidecar.
+ *
+ * @param ovr Pointer to the overview info. Ignored if NULL.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_ovr_close(SION_OVR_T *ovr)
+{
+   if (!ovr)
+      return;
+   close(ovr->fd);
+   free(ovr);
+}
+
+/**
+ * @internal Reduce the sums and counts of one level to the next, in
+ * 2 by 2 blocks, in place.
+ *
+ * @param sum Sums of the values in each cell.
+ * @param cnt Number of values in each cell.
+ * @param j_len Number of rows of cells.
+ * @param i_len Number of columns of cells.
+ */
+static void
+reduce_level(double *sum, uint32_t *cnt, size_t j_len, size_t i_len)
+{
+   size_t jl = (j_len + 1) / 2, il = (i_len + 1) / 2;
+
+   /* Cell (j, i) only uses cells at or after (2j, 2i), so going
+    * forward never overwrites what is still needed. */
+   for (size_t j = 0; j < jl; j++)
+      for (size_t i = 0; i < il; i++)
+      {
+         double s = 0;
+         uint32_t c = 0;
+
+         for (size_t jj = 2 * j; jj < 2 * j + 2 && jj < j_len; jj++)
+            for (size_t ii = 2 * i; ii < 2 * i + 2 && ii < i_len; ii++)
+            {
+               s += sum[jj * i_len + ii];
+               c += cnt[jj * i_len + ii];
+            }
+         sum[j * il + i] = s;
+         cnt[j * il + i] = c;
+      }
+}
+
+/**
+ * Build the overview levels of an AB file, in a sidecar named like
+ * the B file but ending in .ovr. Level L holds the mean of each block
+ * of 2^L by 2^L points, leaving out data voids, for every record.
+ * Levels stop early once a level is a single point.
+ *
+ * Files already open do not see the new sidecar. A sidecar is not
+ * used once the A file changes; build it again then.
+ *
+ * @param path Path of the B file.
+ * @param nlevels Number of levels, from 1 to ::SION_OVR_MAX_LEVELS.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Invalid input.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the AB file or write the sidecar.
+ * @author Ed Hartnett
+ */
+int
+SION_build_overviews(const char *path, int nlevels)
+{
+   char ovr_path[PATH_MAX], tmp_path[PATH_MAX + 4];
+   SION_FILE_INFO_T *ab_file;
+   SION_B_INFO_T b_info;
+   SION_OVR_HDR_T hdr;
+   SION_OVR_T ovr;
+   size_t n;
+   float *rec = NULL, *out = NULL;
+   double *sum = NULL;
+   uint32_t *cnt = NULL;
+   FILE *f;
+   int ret;
+
+   LOG((1, "%s: path %s nlevels %d", __func__, path, nlevels));
+
+   if (!path || nlevels < 1 || nlevels > SION_OVR_MAX_LEVELS)
+      return NC_EINVAL;
+   if ((ret = ovr_name(path, ovr_path)))
+      return ret;
+   if ((ret = ab_prepare_file(path, &ab_file, &b_info)))
+      return ret;
+
+   /* No more levels than it takes to get to one point. */
+   memset(&ovr, 0, sizeof(ovr));
+   ovr.t_len = ab_file->t_len;
+   ovr.j_len[0] = ab_file->j_len;
+   ovr.i_len[0] = ab_file->i_len;
+   for (ovr.nlevels = 1; ovr.nlevels < nlevels; ovr.nlevels++)
+      if (!((ovr.j_len[0] - 1) >> ovr.nlevels) &&
+          !((ovr.i_len[0] - 1) >> ovr.nlevels))
+         break;
+   ovr_layout(&ovr);
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, SION_OVR_MAGIC, sizeof(hdr.magic));
+   hdr.order = SION_OVR_ORDER;
+   hdr.nlevels = ovr.nlevels;
+   hdr.t_len = ovr.t_len;
+   hdr.j_len = ovr.j_len[0];
+   hdr.i_len = ovr.i_len[0];
+   if ((ret = ovr_stamp(ab_file, &hdr)))
+   {
+      ab_free_file(ab_file);
+      return ret;
+   }
+
+   /* Write to a temporary file, and rename it when done, so readers
+    * never see half a sidecar. */
+   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ovr_path);
+   if (!(f = fopen(tmp_path, "w")))
+   {
+      ab_free_file(ab_file);
+      return NC_EIO;
+   }
+   if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+      ret = NC_EIO;
+
+   n = ovr.j_len[0] * ovr.i_len[0];
+   if (!ret && (!(rec = malloc(n * sizeof(float))) ||
+                !(out = malloc(ovr.j_len[1] * ovr.i_len[1] * sizeof(float))) ||
+                !(sum = malloc(n * sizeof(double))) ||
+                !(cnt = malloc(n * sizeof(uint32_t)))))
+      ret = NC_ENOMEM;
+
+   /* One pass over the records, making every level of each. */
+   for (int t = 0; !ret && t < ovr.t_len; t++)
+   {
+      size_t start[SION_NDIMS3] = {t, 0, 0};
+      size_t count[SION_NDIMS3] = {1, ovr.j_len[0], ovr.i_len[0]};
+
+      if ((ret = ab_read_vara(ab_file, start, count, rec)))
+         break;
+      for (size_t v = 0; v < n; v++)
+      {
+         int ok = isfinite(rec[v]) && fabsf(rec[v]) < SION_VOID;
+
+         sum[v] = ok ? rec[v] : 0;
+         cnt[v] = ok;
+      }
+
+      for (int l = 1; !ret && l <= ovr.nlevels; l++)
+      {
+         size_t cells = ovr.j_len[l] * ovr.i_len[l];
+
+         reduce_level(sum, cnt, ovr.j_len[l - 1], ovr.i_len[l - 1]);
+         for (size_t c = 0; c < cells; c++)
+            out[c] = cnt[c] ? sum[c] / cnt[c] : SION_VOID_VALUE;
+         if (fseeko(f, ovr.off[l] + (off_t)t * cells * sizeof(float), SEEK_SET) ||
+             fwrite(out, sizeof(float), cells, f) != cells)
+            ret = NC_EIO;
+      }
+   }
+
+   free(cnt);
+   free(sum);
+   free(out);
+   free(rec);
+   ab_free_file(ab_file);
+   if (fclose(f) && !ret)
+      ret = NC_EIO;
+   if (!ret && rename(tmp_path, ovr_path))
+      ret = NC_EIO;
+   if (ret)
+      remove(tmp_path);
+
+   return ret;
+}
+
+/**
+ * Find the shape of an overview level of an AB file.
+ *
+ * @param ncid File ID.
+ * @param level Level, 0 for full resolution.
+ * @param nlevelsp Pointer that gets the number of overview levels
+ * the file has, 0 if it has no sidecar. Ignored if NULL.
+ * @param t_lenp Pointer that gets the number of records at the
+ * level. Ignored if NULL.
+ * @param j_lenp Pointer that gets the j length of the level. Ignored
+ * if NULL.
+ * @param i_lenp Pointer that gets the i length of the level. Ignored
+ * if NULL.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_EINVAL No such level.
+ * @author Ed Hartnett
+ */
+int
+SION_inq_level(int ncid, int level, int *nlevelsp, size_t *t_lenp,
+               size_t *j_lenp, size_t *i_lenp)
+{
+   NC_HDF5_FILE_INFO_T *h5;
+   SION_FILE_INFO_T *ab_file;
+   SION_OVR_T *ovr;
+
+   if (!nc4_find_nc_file(ncid, &h5))
+      return NC_EBADID;
+   assert(h5 && h5->format_file_info);
+   ab_file = h5->format_file_info;
+   ovr = ab_file->ovr;
+
+   if (nlevelsp)
+      *nlevelsp = ovr ? ovr->nlevels : 0;
+   if (level < 0 || level > (ovr ? ovr->nlevels : 0))
+      return NC_EINVAL;
+   if (t_lenp)
+      *t_lenp = level ? ovr->t_len : ab_file->t_len;
+   if (j_lenp)
+      *j_lenp = level ? ovr->j_len[level] : ab_file->j_len;
+   if (i_lenp)
+      *i_lenp = level ? ovr->i_len[level] : ab_file->i_len;
+
+   return NC_NOERR;
+}
+
+/**
+ * Read an array of values of the data variable at an overview level.
+ * Start and count are in the points of the level, see
+ * SION_inq_level(). Level 0 is the full resolution data.
+ *
+ * @param ncid File ID.
+ * @param varid Variable ID of the data variable.
+ * @param level Level, 0 for full resolution.
+ * @param startp Array of start indicies.
+ * @param countp Array of counts.
+ * @param data Pointer that gets the data.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @return ::NC_EINVAL Not the data variable, or no such level.
+ * @return ::NC_EINVALCOORDS Start out of range.
+ * @return ::NC_EEDGE Start plus count out of range.
+ * @return ::NC_EIO Could not read the sidecar.
+ * @author Ed Hartnett
+ */
+int
+SION_get_vara_level(int ncid, int varid, int level, const size_t *startp,
+                    const size_t *countp, float *data)
+{
+   NC_HDF5_FILE_INFO_T *h5;
+   SION_FILE_INFO_T *ab_file;
+   SION_OVR_T *ovr;
+   size_t dim_len[SION_NDIMS3];
+
+   LOG((2, "%s: ncid 0x%x varid %d level %d", __func__, ncid, varid, level));
+
+   if (!level)
+      return SION_get_vara(ncid, varid, startp, countp, data, NC_FLOAT);
+
+   if (!nc4_find_nc_file(ncid, &h5))
+      return NC_EBADID;
+   assert(h5 && h5->format_file_info);
+   ab_file = h5->format_file_info;
+   ovr = ab_file->ovr;
+   if (varid != ab_file->varid || !ovr || level < 0 || level > ovr->nlevels)
+      return NC_EINVAL;
+   if (!startp || !countp || !data)
+      return NC_EINVAL;
+
+   dim_len[0] = ovr->t_len;
+   dim_len[1] = ovr->j_len[level];
+   dim_len[2] = ovr->i_len[level];
+   for (int d = 0; d < SION_NDIMS3; d++)
+   {
+      if (startp[d] > dim_len[d])
+         return NC_EINVALCOORDS;
+      if (startp[d] + countp[d] > dim_len[d])
+         return NC_EEDGE;
+   }
+
+   for (size_t t = 0; t < countp[0]; t++)
+      for (size_t j = 0; j < countp[1]; j++)
+      {
+         off_t pos = ovr->off[level] + (((off_t)(startp[0] + t) * dim_len[1] +
+                                         startp[1] + j) * dim_len[2] + startp[2]) *
+            sizeof(float);
+         size_t len = countp[2] * sizeof(float);
+
+         if (pread(ovr->fd, data, len, pos) != len)
+            return NC_EIO;
+         data += countp[2];
+      }
+
+   return NC_NOERR;
+}
@@ -0,0 +1,138 @@
+/**
+ * @file
+ * @internal Staging buffer pool for the AB dispatch layer.
+ *
+ * Each open file has a small pool of page-aligned buffers, each big
+ * enough for one padded record. Reads borrow a buffer from the pool
+ * and give it back when done, so the read path does not call the
+ * allocator, and the memory held by a file is bounded by
+ * ::SION_POOL_MAX buffers no matter how many threads read it.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <unistd.h>
+#include <sys/mman.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal Size of a transparent huge page. */
+#define SION_HUGE_PAGE (2 * 1024 * 1024)
+
+/**
+ * @internal Set up a buffer pool. No buffers are allocated until
+ * they are first needed.
+ *
+ * @param pool Pointer to the pool.
+ * @param len Minimum size of each buffer in bytes.
+ * @param huge If non-zero, round buffers to huge pages and ask the
+ * kernel to back them with transparent huge pages.
+ *
+ * @return ::NC_NOERR No error.
+ * @author Ed Hartnett
+ */
+int
+ab_pool_init(SION_POOL_T *pool, size_t len, int huge)
+{
+   size_t align = huge ? SION_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+
+   assert(pool);
+   memset(pool, 0, sizeof(SION_POOL_T));
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->freed, NULL);
+   pool->align = align;
+   pool->buf_len = (len + align - 1) / align * align;
+   pool->huge = huge;
+   LOG((3, "%s: buf_len %d huge %d", __func__, pool->buf_len, huge));
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Borrow a buffer from the pool. If all ::SION_POOL_MAX
+ * buffers are lent out, wait for one to come back. A thread must not
+ * hold more than one buffer from the same pool.
+ *
+ * @param pool Pointer to the pool.
+ * @param bufrp Pointer that gets the buffer.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_pool_get(SION_POOL_T *pool, void **bufrp)
+{
+   void *bufr = NULL;
+
+   assert(pool && bufrp);
+
+   pthread_mutex_lock(&pool->lock);
+   while (!pool->nfree && pool->nbufr == SION_POOL_MAX)
+      pthread_cond_wait(&pool->freed, &pool->lock);
+   if (pool->nfree)
+      bufr = pool->free_bufr[--pool->nfree];
+   else
+      pool->nbufr++;
+   pthread_mutex_unlock(&pool->lock);
+
+   /* Allocate a new buffer outside the lock. */
+   if (!bufr)
+   {
+      if (posix_memalign(&bufr, pool->align, pool->buf_len))
+      {
+         pthread_mutex_lock(&pool->lock);
+         pool->nbufr--;
+         pthread_cond_signal(&pool->freed);
+         pthread_mutex_unlock(&pool->lock);
+         return NC_ENOMEM;
+      }
+#ifdef MADV_HUGEPAGE
+      if (pool->huge)
+         madvise(bufr, pool->buf_len, MADV_HUGEPAGE);
+#endif
+   }
+
+   *bufrp = bufr;
+   return NC_NOERR;
+}
+
+/**
+ * @internal Give a buffer back to the pool.
+ *
+ * @param pool Pointer to the pool.
+ * @param bufr The buffer, from ab_pool_get().
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_pool_put(SION_POOL_T *pool, void *bufr)
+{
+   assert(pool && bufr);
+
+   pthread_mutex_lock(&pool->lock);
+   assert(pool->nfree < SION_POOL_MAX);
+   pool->free_bufr[pool->nfree++] = bufr;
+   pthread_cond_signal(&pool->freed);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @internal Free all buffers of a pool. None may be lent out.
+ *
+ * @param pool Pointer to the pool.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_pool_free(SION_POOL_T *pool)
+{
+   assert(pool && pool->nfree == pool->nbufr);
+
+   for (int b = 0; b < pool->nfree; b++)
+      free(pool->free_bufr[b]);
+   pool->nfree = pool->nbufr = 0;
+   pthread_cond_destroy(&pool->freed);
+   pthread_mutex_destroy(&pool->lock);
+}
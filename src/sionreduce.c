@@ -0,0 +1,306 @@
+/**
+ * @file
+ * @internal Time reductions of the data variable of AB files.
+ *
+ * With ::SION_OPEN_REDUCE, an AB file also has the variables
+ * <var>_mean, <var>_min and <var>_max, on a window dimension. Each
+ * window is a run of records, set with SION_set_reduce_window(), and
+ * holds the mean, min and max of every point over those records,
+ * leaving out data voids. A window is worked out, all three at once
+ * in one pass over its records, the first time any of them is read,
+ * and kept until the file is closed.
+ *
+ * SION_refresh() adds windows for new records. The last window is
+ * worked out again if it gets more records; if the window was all
+ * records, every window is.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include <math.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal Time reductions of a file. */
+struct SION_REDUCE
+{
+   int want; /* Window asked for when opened. */
+   int window; /* Records in each window. */
+   int t_len; /* Records covered. */
+   int nwin; /* Number of windows. */
+   float **win; /* For each window, mean, min and max, or NULL. */
+   pthread_mutex_t lock; /* Protects win. */
+};
+
+/**
+ * @internal Set up the time reductions of a file.
+ *
+ * @param ab_file Pointer to AB file info, with t_len set.
+ * @param window Records in each window. 0 or less for one window of
+ * all records.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_reduce_open(SION_FILE_INFO_T *ab_file, int window)
+{
+   SION_REDUCE_T *r;
+
+   assert(ab_file);
+
+   if (!(r = calloc(1, sizeof(SION_REDUCE_T))))
+      return NC_ENOMEM;
+   r->want = window;
+   r->t_len = ab_file->t_len;
+   r->window = (window <= 0 || window > r->t_len) ? r->t_len : window;
+   r->nwin = r->window ? (r->t_len + r->window - 1) / r->window : 0;
+   if (r->nwin && !(r->win = calloc(r->nwin, sizeof(float *))))
+   {
+      free(r);
+      return NC_ENOMEM;
+   }
+   pthread_mutex_init(&r->lock, NULL);
+   ab_file->reduce = r;
+   LOG((3, "%s: window %d nwin %d", __func__, r->window, r->nwin));
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Free the time reductions of a file.
+ *
+ * @param r Pointer to the time reductions. Ignored if NULL.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_reduce_close(SION_REDUCE_T *r)
+{
+   if (!r)
+      return;
+   for (int w = 0; w < r->nwin; w++)
+      free(r->win[w]);
+   free(r->win);
+   pthread_mutex_destroy(&r->lock);
+   free(r);
+}
+
+/**
+ * @internal Cover the records added to a file by SION_refresh(). Any
+ * window that gets new records is forgotten, so that it is worked
+ * out again when next read.
+ *
+ * @param r Pointer to the time reductions.
+ * @param t_len The new number of records.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+ab_reduce_refresh(SION_REDUCE_T *r, int t_len)
+{
+   float **win = r->win;
+   int window, nwin, keep;
+
+   assert(r && t_len >= r->t_len);
+
+   window = (r->want <= 0 || r->want > t_len) ? t_len : r->want;
+   nwin = window ? (t_len + window - 1) / window : 0;
+
+   /* Whole windows of the old records are still good, unless the
+    * windows themselves changed. */
+   keep = window && window == r->window ? r->t_len / window : 0;
+   pthread_mutex_lock(&r->lock);
+   if (nwin > r->nwin && !(win = realloc(r->win, nwin * sizeof(float *))))
+   {
+      pthread_mutex_unlock(&r->lock);
+      return NC_ENOMEM;
+   }
+   for (int w = keep; w < r->nwin; w++)
+      free(win[w]);
+   for (int w = keep; w < nwin; w++)
+      win[w] = NULL;
+   r->win = win;
+   r->window = window;
+   r->nwin = nwin;
+   r->t_len = t_len;
+   pthread_mutex_unlock(&r->lock);
+   LOG((3, "%s: window %d nwin %d", __func__, r->window, r->nwin));
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Find the number of windows of a file.
+ *
+ * @param r Pointer to the time reductions.
+ *
+ * @return The number of windows.
+ */
+int
+ab_reduce_nwin(SION_REDUCE_T *r)
+{
+   assert(r);
+   return r->nwin;
+}
+
+/**
+ * @internal Work out the mean, min and max of one window, if not
+ * already done. Call with the lock held.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param w Window number.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the A file.
+ */
+static int
+reduce_window(SION_FILE_INFO_T *ab_file, int w)
+{
+   SION_REDUCE_T *r = ab_file->reduce;
+   size_t n = (size_t)ab_file->j_len * ab_file->i_len;
+   float *out, *min, *max, *rec;
+   double *sum;
+   uint32_t *cnt;
+   int ret = NC_NOERR;
+
+   if (r->win[w])
+      return NC_NOERR;
+   LOG((2, "%s: window %d", __func__, w));
+
+   out = malloc(SION_NSTATS * n * sizeof(float));
+   rec = malloc(n * sizeof(float));
+   sum = calloc(n, sizeof(double));
+   cnt = calloc(n, sizeof(uint32_t));
+   if (!out || !rec || !sum || !cnt)
+   {
+      free(cnt);
+      free(sum);
+      free(rec);
+      free(out);
+      return NC_ENOMEM;
+   }
+   min = out + n;
+   max = out + 2 * n;
+   for (size_t v = 0; v < n; v++)
+   {
+      min[v] = INFINITY;
+      max[v] = -INFINITY;
+   }
+
+   /* Read each record once, adding it to all three. The loop has no
+    * branches, so it can be vectorized. */
+   for (int t = w * r->window; !ret && t < (w + 1) * r->window && t < r->t_len;
+        t++)
+   {
+      size_t start[SION_NDIMS3] = {t, 0, 0};
+      size_t count[SION_NDIMS3] = {1, ab_file->j_len, ab_file->i_len};
+
+      if ((ret = ab_read_vara(ab_file, start, count, rec)))
+         break;
+      for (size_t v = 0; v < n; v++)
+      {
+         float x = rec[v];
+         int ok = fabsf(x) < SION_VOID;
+
+         sum[v] += ok ? x : 0;
+         cnt[v] += ok;
+         min[v] = ok && x < min[v] ? x : min[v];
+         max[v] = ok && x > max[v] ? x : max[v];
+      }
+   }
+
+   if (!ret)
+   {
+      for (size_t v = 0; v < n; v++)
+      {
+         out[v] = cnt[v] ? sum[v] / cnt[v] : SION_VOID_VALUE;
+         if (!cnt[v])
+            min[v] = max[v] = SION_VOID_VALUE;
+      }
+      r->win[w] = out;
+   }
+   else
+      free(out);
+   free(cnt);
+   free(sum);
+   free(rec);
+
+   return ret;
+}
+
+/**
+ * @internal Read a hyperslab of a time reduction variable.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param stat Which one: ::SION_STAT_MEAN, ::SION_STAT_MIN or
+ * ::SION_STAT_MAX.
+ * @param startp Array of start indicies, window, j and i.
+ * @param countp Array of counts, window, j and i.
+ * @param data Pointer that gets the data.
+ * @param memtype The type of these data after it is read into memory.
+ * @param type_size Size of memtype in bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVALCOORDS Start out of range.
+ * @return ::NC_EEDGE Start plus count out of range.
+ * @return ::NC_ERANGE Range error when converting data.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Could not read the A file.
+ * @author Ed Hartnett
+ */
+int
+ab_reduce_get_vara(SION_FILE_INFO_T *ab_file, int stat, const size_t *startp,
+                   const size_t *countp, void *data, nc_type memtype,
+                   size_t type_size)
+{
+   SION_REDUCE_T *r = ab_file->reduce;
+   size_t dim_len[SION_NDIMS3] = {r->nwin, ab_file->j_len, ab_file->i_len};
+   size_t n = (size_t)ab_file->j_len * ab_file->i_len;
+   char *dst = data;
+   int range_error = 0;
+   int ret = NC_NOERR;
+
+   assert(r && stat >= 0 && stat < SION_NSTATS && startp && countp && data);
+
+   for (int d = 0; d < SION_NDIMS3; d++)
+   {
+      if (startp[d] > dim_len[d])
+         return NC_EINVALCOORDS;
+      if (startp[d] + countp[d] > dim_len[d])
+         return NC_EEDGE;
+   }
+
+   for (size_t w = 0; !ret && w < countp[0]; w++)
+   {
+      const float *field;
+
+      pthread_mutex_lock(&r->lock);
+      ret = reduce_window(ab_file, startp[0] + w);
+      field = ret ? NULL : r->win[startp[0] + w] + stat * n;
+      pthread_mutex_unlock(&r->lock);
+
+      for (size_t j = 0; !ret && j < countp[1]; j++)
+      {
+         const float *row = field + (startp[1] + j) * ab_file->i_len +
+            startp[2];
+
+         if (memtype == NC_FLOAT)
+            memcpy(dst, row, countp[2] * sizeof(float));
+         else
+            ret = nc4_convert_type(row, dst, NC_FLOAT, memtype, countp[2],
+                                   &range_error, NULL, 0, 0, 0);
+         dst += countp[2] * type_size;
+      }
+   }
+
+   if (!ret && range_error)
+      return NC_ERANGE;
+   return ret;
+}
@@ -0,0 +1,349 @@
+/**
+ * @file
+ * @internal Offset-ordered scheduling of batched reads for the AB
+ * dispatch layer.
+ *
+ * A batch of hyperslab reads, possibly on several files, is broken
+ * into the rows it needs from each A file. The rows are sorted by
+ * file and offset, and rows no further apart than the coalescing gap
+ * of their file are merged into spans. Each span is read with one
+ * seek and one read, and the rows are then decoded out of it into
+ * the callers' buffers.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal One row of one read in a batch. */
+typedef struct SION_SEG
+{
+   SION_READ_T *read; /* The read this row belongs to. */
+   off_t off; /* Offset of the row in the A file. */
+   size_t len; /* Length of the row in bytes. */
+   float *dst; /* Where the decoded row goes. */
+} SION_SEG_T;
+
+/**
+ * @internal Compare two rows by file, then offset, for qsort().
+ *
+ * @param a Pointer to first row.
+ * @param b Pointer to second row.
+ *
+ * @return <0, 0, or >0, as for strcmp().
+ */
+static int
+seg_cmp(const void *a, const void *b)
+{
+   const SION_SEG_T *sa = a;
+   const SION_SEG_T *sb = b;
+
+   if (sa->read->ab_file != sb->read->ab_file)
+      return sa->read->ab_file < sb->read->ab_file ? -1 : 1;
+   if (sa->off == sb->off)
+      return 0;
+   return sa->off < sb->off ? -1 : 1;
+}
+
+/**
+ * @internal Take as many rows as possible, starting at row s, whose
+ * frames all fit in the frame cache of a compressed file, and
+ * decompress those frames in parallel. A failure here is not an
+ * error; the rows are read one frame at a time instead, and any
+ * error is reported then.
+ *
+ * @param seg Array of sorted rows.
+ * @param s First row to take.
+ * @param nseg Number of rows.
+ *
+ * @return Index of the first row not taken.
+ */
+static size_t
+zstd_window(SION_SEG_T *seg, size_t s, size_t nseg)
+{
+   SION_FILE_INFO_T *ab_file = seg[s].read->ab_file;
+   long frames[SION_ZCACHE_SLOTS];
+   int nframes = 0;
+   size_t w;
+
+   for (w = s; w < nseg && seg[w].read->ab_file == ab_file; w++)
+   {
+      long first = ab_zstd_frame(ab_file->zstd, seg[w].off);
+      long last = ab_zstd_frame(ab_file->zstd, seg[w].off + seg[w].len - 1);
+      int nnew = 0;
+
+      /* Rows are in offset order, so new frames come at the end. */
+      for (long f = first; f <= last; f++)
+         if (!nframes || f > frames[nframes - 1])
+            nnew++;
+      if (nframes + nnew > SION_ZCACHE_SLOTS)
+         break;
+      for (long f = first; f <= last; f++)
+         if (!nframes || f > frames[nframes - 1])
+            frames[nframes++] = f;
+   }
+
+   if (nframes > 1)
+      ab_zstd_prefetch(ab_file->zstd, frames, nframes);
+
+   return w > s ? w : s + 1;
+}
+
+/**
+ * @internal Read a batch of hyperslabs, in offset order, with nearby
+ * rows merged into larger reads. The status of each read is set
+ * in its status field.
+ *
+ * @param nread Number of reads.
+ * @param reads Array of pointers to the reads. The reads must
+ * already be checked with ab_check_vara().
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory. Every read gets this status.
+ * @return The first error of any of the reads.
+ * @author Ed Hartnett
+ */
+int
+ab_read_batch(int nread, SION_READ_T **reads)
+{
+   SION_SEG_T *seg;
+   size_t nseg = 0;
+   size_t s = 0;
+   int ret = NC_NOERR;
+
+   assert(reads);
+
+   /* How many rows? */
+   for (int r = 0; r < nread; r++)
+   {
+      reads[r]->status = NC_NOERR;
+      nseg += reads[r]->count[0] * reads[r]->count[1];
+   }
+   if (!nseg)
+      return NC_NOERR;
+
+   /* If the rows can't be listed, none of the reads are done. */
+   if (!(seg = malloc(nseg * sizeof(SION_SEG_T))))
+   {
+      for (int r = 0; r < nread; r++)
+         reads[r]->status = NC_ENOMEM;
+      return NC_ENOMEM;
+   }
+
+   /* Break the reads into rows. */
+   nseg = 0;
+   for (int r = 0; r < nread; r++)
+   {
+      SION_READ_T *rd = reads[r];
+      float *dst = rd->value;
+
+      for (size_t rec = 0; rec < rd->count[0]; rec++)
+         for (size_t j = 0; j < rd->count[1]; j++)
+         {
+            if (!rd->count[2])
+               continue;
+            seg[nseg].read = rd;
+            seg[nseg].off = (off_t)(rd->start[0] + rec) * rd->ab_file->rec_len +
+               (off_t)(rd->ab_file->i_len * (rd->start[1] + j) +
+                       rd->start[2]) * sizeof(float);
+            seg[nseg].len = rd->count[2] * sizeof(float);
+            seg[nseg].dst = dst;
+            dst += rd->count[2];
+            nseg++;
+         }
+   }
+
+   qsort(seg, nseg, sizeof(SION_SEG_T), seg_cmp);
+
+   /* Merge neighbouring rows into spans, and read each span. */
+   while (s < nseg)
+   {
+      size_t w = nseg;
+
+      /* For compressed files, go a cache full of frames at a time. */
+      if (seg[s].read->ab_file->zstd)
+         w = zstd_window(seg, s, nseg);
+
+      while (s < w)
+      {
+         SION_FILE_INFO_T *ab_file = seg[s].read->ab_file;
+         off_t span_start = seg[s].off;
+         off_t span_end = seg[s].off + seg[s].len;
+         size_t e = s + 1;
+         char *bufr = NULL;
+         int status;
+
+         while (e < w && seg[e].read->ab_file == ab_file &&
+                seg[e].off <= span_end + ab_file->gap &&
+                seg[e].off / (off_t)ab_file->rec_len ==
+                span_start / (off_t)ab_file->rec_len &&
+                seg[e].off + seg[e].len - span_start <= ab_file->rec_len)
+         {
+            if (seg[e].off + seg[e].len > span_end)
+               span_end = seg[e].off + seg[e].len;
+            e++;
+         }
+         LOG((3, "%s: rows %d to %d in one read of %d bytes at %d", __func__,
+              s, e - 1, span_end - span_start, span_start));
+
+         /* Spans are within one record, so they fit a pool buffer,
+          * and a verified file checks them against that record. A
+          * span of a whole record is checked against its checksum. */
+         if (!(status = ab_pool_get(&ab_file->pool, (void **)&bufr)) &&
+             !(status = ab_read_raw(ab_file, span_start,
+                                    span_end - span_start, bufr)))
+            status = ab_crc_span(ab_file, span_start, span_end - span_start,
+                                 bufr);
+
+         /* Scatter the decoded rows to their readers. */
+         for (; s < e; s++)
+         {
+            if (status)
+               seg[s].read->status = status;
+            else
+               ab_decode_floats(ab_file,
+                                (float *)(bufr + seg[s].off - span_start),
+                                seg[s].dst, seg[s].len / sizeof(float));
+         }
+         if (bufr)
+            ab_pool_put(&ab_file->pool, bufr);
+      }
+   }
+
+   free(seg);
+
+   for (int r = 0; r < nread; r++)
+      if (reads[r]->status && !ret)
+         ret = reads[r]->status;
+
+   return ret;
+}
+
+/**
+ * Read a list of hyperslabs, which may be on different files, as one
+ * batch. The byte ranges of all requests are sorted by file and
+ * offset, and ranges closer together than the coalescing gap of the
+ * file are merged, so the batch runs as a few large sequential
+ * reads no matter what order the requests are in.
+ *
+ * The status field of each request gets the result of that request.
+ *
+ * @param nreq Number of requests.
+ * @param reqs Array of requests.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Invalid input.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return The first error of any of the requests.
+ * @author Ed Hartnett
+ */
+int
+SION_get_vara_batch(int nreq, SION_VARA_REQ_T *reqs)
+{
+   SION_READ_T *read;
+   SION_READ_T **readp;
+   int *which; /* Which request each scheduled read came from. */
+   int nread = 0;
+   int batch_ret;
+   int ret = NC_NOERR;
+
+   LOG((2, "%s: nreq %d", __func__, nreq));
+
+   if (nreq < 0 || (nreq && !reqs))
+      return NC_EINVAL;
+   if (!nreq)
+      return NC_NOERR;
+
+   if (!(read = malloc(nreq * sizeof(SION_READ_T))))
+      return NC_ENOMEM;
+   readp = malloc(nreq * sizeof(SION_READ_T *));
+   which = malloc(nreq * sizeof(int));
+   if (!readp || !which)
+   {
+      free(which);
+      free(readp);
+      free(read);
+      return NC_ENOMEM;
+   }
+
+   /* Find the file and var of each request. */
+   for (int r = 0; r < nreq; r++)
+   {
+      NC *nc;
+      NC_GRP_INFO_T *grp;
+      NC_HDF5_FILE_INFO_T *h5;
+      NC_VAR_INFO_T *var;
+
+      reqs[r].status = NC_NOERR;
+      if (!reqs[r].value)
+         reqs[r].status = NC_EINVAL;
+      else if (!(nc = nc4_find_nc_file(reqs[r].ncid, &h5)))
+         reqs[r].status = NC_EBADID;
+      else if (!(reqs[r].status = nc4_find_g_var_nc(nc, reqs[r].ncid,
+                                                     reqs[r].varid, &grp, &var)))
+      {
+         /* Coordinate vars are in memory, no need to schedule them. */
+         SION_FILE_INFO_T *ab_file = h5->format_file_info;
+
+         if (reqs[r].varid != ab_file->varid)
+            reqs[r].status = SION_get_vara(reqs[r].ncid, reqs[r].varid,
+                                           reqs[r].start, reqs[r].count,
+                                           reqs[r].value, NC_FLOAT);
+         else if (!(reqs[r].status = ab_check_vara(ab_file, reqs[r].start,
+                                                   reqs[r].count)))
+         {
+            read[nread].ab_file = ab_file;
+            memcpy(read[nread].start, reqs[r].start, sizeof(reqs[r].start));
+            memcpy(read[nread].count, reqs[r].count, sizeof(reqs[r].count));
+            read[nread].value = reqs[r].value;
+            readp[nread] = &read[nread];
+            which[nread++] = r;
+         }
+      }
+   }
+
+   batch_ret = ab_read_batch(nread, readp);
+
+   /* Hand back the status of each scheduled read. */
+   for (int k = 0; k < nread; k++)
+      reqs[which[k]].status = read[k].status;
+   for (int r = 0; r < nreq; r++)
+      if (reqs[r].status && !ret)
+         ret = reqs[r].status;
+   if (!ret)
+      ret = batch_ret;
+
+   free(which);
+   free(readp);
+   free(read);
+   return ret;
+}
+
+/**
+ * Set the coalescing gap of a file. Batched reads of this file that
+ * are no more than this many bytes apart are done as one read. A
+ * larger gap reads some unneeded bytes to save seeks.
+ *
+ * @param ncid File ID.
+ * @param gap The gap in bytes. Defaults to ::SION_DEFAULT_GAP.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EBADID Bad ncid.
+ * @author Ed Hartnett
+ */
+int
+SION_set_coalesce_gap(int ncid, size_t gap)
+{
+   NC_HDF5_FILE_INFO_T *h5;
+   SION_FILE_INFO_T *ab_file;
+
+   if (!nc4_find_nc_file(ncid, &h5))
+      return NC_EBADID;
+   assert(h5 && h5->format_file_info);
+   ab_file = h5->format_file_info;
+   ab_file->gap = gap;
+
+   return NC_NOERR;
+}
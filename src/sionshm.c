@@ -0,0 +1,480 @@
+/**
+ * @file
+ * @internal Node-wide record cache in POSIX shared memory, for the
+ * AB dispatch layer.
+ *
+ * Processes on a node that read the same A files can share decoded
+ * records through a shared memory segment, set up with
+ * SION_set_shm_cache(). The segment is a table of slots, each holding
+ * one decoded record, keyed by the device, inode and modification
+ * time of the A file and the record number. The number of slots
+ * comes from the byte budget of the segment.
+ *
+ * Slots are found by hashing the key into a set of
+ * ::SION_SHM_WAYS slots. Each slot is guarded by a sequence count:
+ * a writer makes it odd while it fills the slot, and even again when
+ * done. Readers take no lock; they copy the record out and check
+ * that the count did not change, or else read the A file. The least
+ * recently used slot of a set is replaced.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+/** @internal Marks an initialized cache segment. */
+#define SION_SHM_MAGIC 0x53494f4e
+
+/** @internal Layout version of the cache segment. */
+#define SION_SHM_VERSION 1
+
+/** @internal Slots in each hash set. */
+#define SION_SHM_WAYS 4
+
+/** @internal Alignment of the slot data. */
+#define SION_SHM_ALIGN 64
+
+/** @internal How long to wait for another process to set up the
+ * segment, in milliseconds. */
+#define SION_SHM_WAIT_MS 2000
+
+/** @internal Start of the cache segment. */
+typedef struct SION_SHM_HDR
+{
+   uint32_t magic; /* SION_SHM_MAGIC once set up. */
+   uint32_t version;
+   uint64_t nslots;
+   uint64_t slot_bytes; /* Largest decoded record a slot holds. */
+   uint64_t size; /* Size of the whole segment. */
+   uint32_t clock; /* Ticks on each publish, for LRU. */
+} SION_SHM_HDR_T;
+
+/** @internal One slot of the cache. */
+typedef struct SION_SHM_SLOT
+{
+   uint32_t seq; /* Odd while being written. */
+   uint32_t used; /* Clock when last used. */
+   uint64_t dev;
+   uint64_t ino;
+   int64_t mtime; /* Nanoseconds. */
+   int64_t rec; /* -1 if empty. */
+   uint64_t len; /* Bytes of data. */
+} SION_SHM_SLOT_T;
+
+/** @internal A mapped cache segment. */
+struct SION_SHM
+{
+   SION_SHM_HDR_T *hdr;
+   SION_SHM_SLOT_T *slot;
+   char *data;
+};
+
+/* The cache used by files opened from now on, if any. Once mapped, a
+ * segment stays mapped, since open files may use it. */
+static SION_SHM_T *shm_cache = NULL;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @internal Offset of the slot data in a segment.
+ *
+ * @param nslots Number of slots.
+ *
+ * @return Offset in bytes.
+ */
+static size_t
+data_offset(size_t nslots)
+{
+   size_t off = sizeof(SION_SHM_HDR_T) + nslots * sizeof(SION_SHM_SLOT_T);
+
+   return (off + SION_SHM_ALIGN - 1) / SION_SHM_ALIGN * SION_SHM_ALIGN;
+}
+
+/**
+ * @internal Map an existing segment, once its creator has set it
+ * up.
+ *
+ * @param fd File descriptor of the segment.
+ * @param hdrp Pointer that gets the mapped segment.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Segment was never set up, or can't be mapped.
+ */
+static int
+map_existing(int fd, SION_SHM_HDR_T **hdrp)
+{
+   SION_SHM_HDR_T *hdr;
+   struct timespec nap = {0, 1000000};
+   uint64_t size;
+
+   for (int ms = 0; ; ms++)
+   {
+      struct stat st;
+
+      if (fstat(fd, &st))
+         return NC_EIO;
+      if (st.st_size >= sizeof(SION_SHM_HDR_T))
+      {
+         hdr = mmap(NULL, sizeof(SION_SHM_HDR_T), PROT_READ, MAP_SHARED, fd, 0);
+         if (hdr == MAP_FAILED)
+            return NC_EIO;
+         if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == SION_SHM_MAGIC)
+            break;
+         munmap(hdr, sizeof(SION_SHM_HDR_T));
+      }
+      if (ms == SION_SHM_WAIT_MS)
+         return NC_EIO;
+      nanosleep(&nap, NULL);
+   }
+   if (hdr->version != SION_SHM_VERSION)
+   {
+      munmap(hdr, sizeof(SION_SHM_HDR_T));
+      return NC_EIO;
+   }
+   size = hdr->size;
+   munmap(hdr, sizeof(SION_SHM_HDR_T));
+
+   hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (hdr == MAP_FAILED)
+      return NC_EIO;
+   *hdrp = hdr;
+   return NC_NOERR;
+}
+
+/**
+ * Use a node-wide record cache in POSIX shared memory for AB files
+ * opened after this call. The first process to name a cache creates
+ * it with the given budget and slot size; later processes use it as
+ * it is. Only SION_get_vara() reads use the cache, and only for files
+ * whose decoded records fit a slot.
+ *
+ * @param name Name of the shared memory object, for shm_open(),
+ * such as "/sion_cache". NULL to stop using a cache for files opened
+ * from now on.
+ * @param budget Most bytes of shared memory to use.
+ * @param slot_bytes Largest decoded record to cache, in bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVAL Budget too small for one set of slots.
+ * @return ::NC_EIO Could not create or map the segment.
+ * @return ::NC_ENOMEM Out of memory.
+ * @author Ed Hartnett
+ */
+int
+SION_set_shm_cache(const char *name, size_t budget, size_t slot_bytes)
+{
+   SION_SHM_HDR_T *hdr;
+   SION_SHM_T *shm;
+   size_t nslots, size;
+   int fd;
+   int ret = NC_NOERR;
+
+   LOG((1, "%s: name %s budget %ld slot_bytes %ld", __func__,
+        name ? name : "(none)", budget, slot_bytes));
+
+   if (!name)
+   {
+      pthread_mutex_lock(&shm_lock);
+      shm_cache = NULL;
+      pthread_mutex_unlock(&shm_lock);
+      return NC_NOERR;
+   }
+
+   /* How many slots fit the budget? Whole sets only. */
+   slot_bytes = (slot_bytes + SION_SHM_ALIGN - 1) / SION_SHM_ALIGN *
+      SION_SHM_ALIGN;
+   if (!slot_bytes)
+      return NC_EINVAL;
+   nslots = budget / (slot_bytes + sizeof(SION_SHM_SLOT_T));
+   nslots -= nslots % SION_SHM_WAYS;
+   while (nslots && data_offset(nslots) + nslots * slot_bytes > budget)
+      nslots -= SION_SHM_WAYS;
+   if (!nslots)
+      return NC_EINVAL;
+   size = data_offset(nslots) + nslots * slot_bytes;
+
+   if (!(shm = calloc(1, sizeof(SION_SHM_T))))
+      return NC_ENOMEM;
+
+   if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0)
+   {
+      /* We made it; set it up. The magic goes in last. */
+      if (ftruncate(fd, size) ||
+          (hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                      0)) == MAP_FAILED)
+         ret = NC_EIO;
+      else
+      {
+         SION_SHM_SLOT_T *slot = (SION_SHM_SLOT_T *)(hdr + 1);
+
+         hdr->version = SION_SHM_VERSION;
+         hdr->nslots = nslots;
+         hdr->slot_bytes = slot_bytes;
+         hdr->size = size;
+         for (size_t s = 0; s < nslots; s++)
+            slot[s].rec = -1;
+         __atomic_store_n(&hdr->magic, SION_SHM_MAGIC, __ATOMIC_RELEASE);
+      }
+   }
+   else if ((fd = shm_open(name, O_RDWR, 0600)) >= 0)
+      ret = map_existing(fd, &hdr);
+   else
+      ret = NC_EIO;
+   if (fd >= 0)
+      close(fd);
+   if (ret)
+   {
+      free(shm);
+      return ret;
+   }
+
+   shm->hdr = hdr;
+   shm->slot = (SION_SHM_SLOT_T *)(hdr + 1);
+   shm->data = (char *)hdr + data_offset(hdr->nslots);
+   LOG((2, "%s: nslots %ld slot_bytes %ld", __func__, hdr->nslots,
+        hdr->slot_bytes));
+
+   pthread_mutex_lock(&shm_lock);
+   shm_cache = shm;
+   pthread_mutex_unlock(&shm_lock);
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Set up a newly opened file to use the shared record
+ * cache, if there is one and the records of the file fit its slots.
+ *
+ * @param ab_file Pointer to AB file info, with the A file open and
+ * the record layout set.
+ *
+ * @return ::NC_NOERR No error.
+ * @author Ed Hartnett
+ */
+int
+ab_shm_attach(SION_FILE_INFO_T *ab_file)
+{
+   struct stat st;
+   SION_SHM_T *shm;
+
+   assert(ab_file);
+
+   /* Records are keyed by the A file, so files in memory can't be
+    * cached. */
+   if (!ab_file->a_file)
+      return NC_NOERR;
+
+   pthread_mutex_lock(&shm_lock);
+   shm = shm_cache;
+   pthread_mutex_unlock(&shm_lock);
+
+   if (!shm || (size_t)ab_file->j_len * ab_file->i_len * sizeof(float) >
+       shm->hdr->slot_bytes)
+      return NC_NOERR;
+   if (fstat(fileno(ab_file->a_file), &st))
+      return NC_NOERR;
+
+   ab_file->shm_dev = st.st_dev;
+   ab_file->shm_ino = st.st_ino;
+   ab_file->shm_mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+      st.st_mtim.tv_nsec;
+   ab_file->shm = shm;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Find the first slot of the set a record hashes to.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param rec Record number.
+ *
+ * @return Index of the first slot of the set.
+ */
+static size_t
+set_of(SION_FILE_INFO_T *ab_file, int64_t rec)
+{
+   uint64_t h = 14695981039346656037ULL;
+   uint64_t key[4] = {ab_file->shm_dev, ab_file->shm_ino, ab_file->shm_mtime,
+                      rec};
+
+   for (int k = 0; k < 4; k++)
+   {
+      h ^= key[k];
+      h *= 1099511628211ULL;
+   }
+   return h % (ab_file->shm->hdr->nslots / SION_SHM_WAYS) * SION_SHM_WAYS;
+}
+
+/**
+ * @internal Is this slot holding this record?
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param slot Pointer to the slot.
+ * @param rec Record number.
+ *
+ * @return 1 if so, 0 if not.
+ */
+static int
+slot_matches(SION_FILE_INFO_T *ab_file, SION_SHM_SLOT_T *slot, int64_t rec)
+{
+   return slot->rec == rec && slot->ino == ab_file->shm_ino &&
+      slot->dev == ab_file->shm_dev && slot->mtime == ab_file->shm_mtime;
+}
+
+/**
+ * @internal Copy part of a record out of the cache.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param rec Record number.
+ * @param startp Array of start indicies; only j and i are used.
+ * @param countp Array of counts; only j and i are used.
+ * @param data Pointer that gets the data.
+ *
+ * @return 1 if the record was in the cache, 0 if not. On 0, data may
+ * have been written.
+ */
+static int
+shm_get(SION_FILE_INFO_T *ab_file, int64_t rec, const size_t *startp,
+        const size_t *countp, float *data)
+{
+   SION_SHM_T *shm = ab_file->shm;
+   size_t set = set_of(ab_file, rec);
+
+   for (int w = 0; w < SION_SHM_WAYS; w++)
+   {
+      SION_SHM_SLOT_T *slot = &shm->slot[set + w];
+      const float *rec_data = (float *)(shm->data + (set + w) *
+                                        shm->hdr->slot_bytes);
+      uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+      if ((seq & 1) || !slot_matches(ab_file, slot, rec))
+         continue;
+      for (size_t j = 0; j < countp[1]; j++)
+         memcpy(data + j * countp[2], rec_data + ab_file->i_len *
+                (startp[1] + j) + startp[2], countp[2] * sizeof(float));
+
+      /* Did a writer take the slot while we copied? */
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+         return 0;
+      __atomic_store_n(&slot->used, __atomic_load_n(&shm->hdr->clock,
+                                                    __ATOMIC_RELAXED),
+                       __ATOMIC_RELAXED);
+      return 1;
+   }
+
+   return 0;
+}
+
+/**
+ * @internal Publish a decoded record to the cache. If another
+ * process is writing the slot we would use, the record is not
+ * published.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param rec Record number.
+ * @param rec_data The whole decoded record, j_len * i_len floats.
+ */
+static void
+shm_put(SION_FILE_INFO_T *ab_file, int64_t rec, const float *rec_data)
+{
+   SION_SHM_T *shm = ab_file->shm;
+   size_t set = set_of(ab_file, rec);
+   size_t len = (size_t)ab_file->j_len * ab_file->i_len * sizeof(float);
+   SION_SHM_SLOT_T *slot = NULL;
+   uint32_t seq;
+   int victim = 0;
+
+   /* Take an empty slot, or the least recently used one. */
+   for (int w = 0; w < SION_SHM_WAYS; w++)
+   {
+      SION_SHM_SLOT_T *s = &shm->slot[set + w];
+
+      if (s->rec < 0)
+      {
+         victim = w;
+         break;
+      }
+      if ((int32_t)(s->used - shm->slot[set + victim].used) < 0)
+         victim = w;
+   }
+   slot = &shm->slot[set + victim];
+
+   seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+   if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                                 __ATOMIC_ACQUIRE,
+                                                 __ATOMIC_RELAXED))
+      return;
+
+   slot->dev = ab_file->shm_dev;
+   slot->ino = ab_file->shm_ino;
+   slot->mtime = ab_file->shm_mtime;
+   slot->rec = rec;
+   slot->len = len;
+   memcpy(shm->data + (set + victim) * shm->hdr->slot_bytes, rec_data, len);
+   slot->used = __atomic_add_fetch(&shm->hdr->clock, 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @internal Read a hyperslab of the data variable through the shared
+ * record cache. Records not in the cache are read whole, decoded,
+ * and published.
+ *
+ * @param ab_file Pointer to AB file info, with a cache attached.
+ * @param startp Array of start indicies.
+ * @param countp Array of counts.
+ * @param data Pointer that gets the data.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Error reading A file.
+ * @author Ed Hartnett
+ */
+int
+ab_shm_read(SION_FILE_INFO_T *ab_file, const size_t *startp,
+            const size_t *countp, float *data)
+{
+   size_t rec_words = (size_t)ab_file->j_len * ab_file->i_len;
+   float *bufr = NULL;
+   int ret = NC_NOERR;
+
+   assert(ab_file && ab_file->shm && startp && countp && data);
+
+   for (size_t r = 0; !ret && r < countp[0]; r++)
+   {
+      int64_t rec = startp[0] + r;
+      float *out = data + r * countp[1] * countp[2];
+
+      if (shm_get(ab_file, rec, startp, countp, out))
+         continue;
+      LOG((3, "%s: miss rec %ld", __func__, rec));
+
+      /* Read the whole record, check it, decode it, and share it. */
+      if (!bufr && (ret = ab_pool_get(&ab_file->pool, (void **)&bufr)))
+         break;
+      if ((ret = ab_read_raw(ab_file, (off_t)rec * ab_file->rec_len,
+                             rec_words * sizeof(float), bufr)))
+         break;
+      if ((ret = ab_crc_span(ab_file, (off_t)rec * ab_file->rec_len,
+                             rec_words * sizeof(float), bufr)))
+         break;
+      ab_decode_floats(ab_file, bufr, bufr, rec_words);
+      shm_put(ab_file, rec, bufr);
+      for (size_t j = 0; j < countp[1]; j++)
+         memcpy(out + j * countp[2], bufr + ab_file->i_len * (startp[1] + j) +
+                startp[2], countp[2] * sizeof(float));
+   }
+
+   if (bufr)
+      ab_pool_put(&ab_file->pool, bufr);
+   return ret;
+}
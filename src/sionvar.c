@@ -4,20 +4,22 @@
  * @author Ed Hartnett
  */
 
+#include <math.h>
 #include <nc4internal.h>
 #include "nc4dispatch.h"
 #include "siondispatch.h"
 
 /**
  * @internal Get coordinate variable data. AB Format coordinate
- * variables are always NC_FLOAT32.
+ * variables are always NC_FLOAT32. The values are read straight from
+ * the per-record times, which are read from the B file if not yet
+ * read.
  *
+ * @param nc Pointer to the file info.
  * @param ncid File ID.
  * @param varid Variable ID.
  * @param startp Array of start indicies.
  * @param countp Array of counts.
- * @param mem_nc_type The type of these data after it is read into memory.
- * @param is_long Ignored for HDF4.
  * @param data pointer that gets the data.
  * @param memtype The type of these data after it is read into memory.
  *
@@ -32,9 +34,9 @@ get_ab_coord_vara(NC *nc, int ncid, int varid, const size_t *startp,
    NC_GRP_INFO_T *grp;
    NC_HDF5_FILE_INFO_T *h5;
    NC_VAR_INFO_T *var;
-   NC_ATT_INFO_T *att = NULL;
+   SION_FILE_INFO_T *ab_file;
+   const float *time;
    int range_error = 0;
-   /* int i = 0; */
    int ret;
 
    /* Check inputs. */
@@ -45,25 +47,29 @@ get_ab_coord_vara(NC *nc, int ncid, int varid, const size_t *startp,
       return ret;
    h5 = (NC_HDF5_FILE_INFO_T *)(nc)->dispatchdata;
    assert(grp && h5 && var && var->name && var->ndims == 1);
+   ab_file = h5->format_file_info;
+   assert(ab_file);
 
-   /* Coordinate data is stored in variable attribute. */
-   if ((ret = nc4_find_grp_att(grp, 1, TIME_NAME, 0, &att))) 
+   /* With SION_OPEN_INSTANT the times are not read until now. */
+   if ((ret = ab_load_b_records(ab_file)))
       return ret;
-   assert(att);
-   float fdata[att->len];
-   memcpy(fdata, att->data, att->len * sizeof(float));
+
+   if (startp[0] > ab_file->t_len)
+      return NC_EINVALCOORDS;
+   if (startp[0] + countp[0] > ab_file->t_len)
+      return NC_EEDGE;
+   time = SION_REC_ATT(ab_file, 0) + startp[0];
 
    /* If NC_FLOAT is requested, just copy the data. Otherwise, do type
     * conversion - note that NC_ERANGE may result.*/
    if (memtype == NC_FLOAT)
    {
-      memcpy(data, &((float *)att->data)[startp[0]], countp[0] * sizeof(float));
+      memcpy(data, time, countp[0] * sizeof(float));
    }
    else
    {
-      if ((ret = nc4_convert_type(att->data + startp[0] * sizeof(float), data, NC_FLOAT,
-                                  memtype, countp[0] - startp[0], &range_error,
-                                  NULL, 0, 0, 0)))
+      if ((ret = nc4_convert_type(time, data, NC_FLOAT, memtype, countp[0],
+                                  &range_error, NULL, 0, 0, 0)))
          return ret;
    }
 
@@ -88,19 +94,68 @@ get_ab_coord_vara(NC *nc, int ncid, int varid, const size_t *startp,
  *
  * @return the rounded number.
  */
-static int
-round_up(int num, int multiple)
+static size_t
+round_up(size_t num, size_t multiple)
 {
    if (multiple == 0)
       return num;
    
-   int remainder = num % multiple;
+   size_t remainder = num % multiple;
    if (remainder == 0)
       return num;
    
    return num + multiple - remainder;
 }
 
+/**
+ * @internal Find the size in bytes of one record in the A file,
+ * including the padding.
+ *
+ * @param j_len Length of the j dimension.
+ * @param i_len Length of the i dimension.
+ *
+ * @return the padded record length in bytes, or 0 if the grid is
+ * too big, see ab_check_layout().
+ */
+size_t
+ab_rec_len(int j_len, int i_len)
+{
+   if (ab_check_layout(0, j_len, i_len))
+      return 0;
+   return round_up((size_t)j_len * i_len, SION_REC_PAD) * sizeof(float);
+}
+
+/**
+ * @internal Check that every byte offset and size of an AB file
+ * layout can be worked out without overflow: a padded record must
+ * fit a size_t, and the whole A file an off_t.
+ *
+ * @param t_len Number of records.
+ * @param j_len Length of the j dimension.
+ * @param i_len Length of the i dimension.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EDIMSIZE Negative length, or the file is too big.
+ * @author Ed Hartnett
+ */
+int
+ab_check_layout(int t_len, int j_len, int i_len)
+{
+   size_t max_words = SIZE_MAX / sizeof(float) - SION_REC_PAD;
+   off_t off_max = (off_t)(((uint64_t)1 << (sizeof(off_t) * CHAR_BIT - 1)) - 1);
+   size_t rec_len;
+
+   if (t_len < 0 || j_len < 0 || i_len < 0)
+      return NC_EDIMSIZE;
+   if (i_len && (size_t)j_len > max_words / i_len)
+      return NC_EDIMSIZE;
+   rec_len = round_up((size_t)j_len * i_len, SION_REC_PAD) * sizeof(float);
+   if (rec_len && (uint64_t)t_len > (uint64_t)off_max / rec_len)
+      return NC_EDIMSIZE;
+
+   return NC_NOERR;
+}
+
 /**
  * @internal Reverse endianness of a float.
  *
@@ -131,18 +186,248 @@ reverse_float(const float fin)
  * @return ::NC_NOERR No error.
  * @author Ed Hartnett
  */
-static int
-reverse_floats(float *bufr_in, float *bufr_out, size_t num)
+int
+ab_reverse_floats(float *bufr_in, float *bufr_out, size_t num)
 {
 
    float *in = bufr_in;
    float *out = bufr_out;
-   for (int n = 0; n < num; n++)
+   for (size_t n = 0; n < num; n++)
       *out++ = reverse_float(*in++);
 
    return NC_NOERR;
 }
 
+/**
+ * @internal Decode floats read from an A file into host order. Files
+ * already in host order are just copied.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param bufr_in Pointer to the floats as read.
+ * @param bufr_out Pointer that gets the decoded floats. May be the
+ * same as bufr_in.
+ * @param num Number of floats.
+ *
+ * @return ::NC_NOERR No error.
+ * @author Ed Hartnett
+ */
+int
+ab_decode_floats(SION_FILE_INFO_T *ab_file, float *bufr_in, float *bufr_out,
+                 size_t num)
+{
+   if (ab_file->swap)
+      return ab_reverse_floats(bufr_in, bufr_out, num);
+   if (bufr_in != bufr_out)
+      memcpy(bufr_out, bufr_in, num * sizeof(float));
+   return NC_NOERR;
+}
+
+/**
+ * @internal Count the floats that make sense as data, read as they
+ * are or byte swapped.
+ *
+ * @param raw Pointer to floats as read from an A file.
+ * @param num Number of floats.
+ * @param swap Non-zero to byte swap them first.
+ * @param range Pointer to the min and max from the B file, or NULL
+ * if not known.
+ *
+ * @return The number of floats that make sense.
+ */
+static size_t
+count_sane(const float *raw, size_t num, int swap, const float *range)
+{
+   size_t sane = 0;
+   float slack = 0;
+
+   /* The B file gives min and max to only a few digits. */
+   if (range)
+      slack = SION_ORDER_SLACK * (fabsf(range[0]) + fabsf(range[1]));
+
+   for (size_t n = 0; n < num; n++)
+   {
+      float v = swap ? reverse_float(raw[n]) : raw[n];
+      float a = fabsf(v);
+
+      if (!isfinite(v) || (v && a <= SION_ORDER_TINY))
+         continue;
+      if (a >= SION_VOID)
+         sane++;
+      else if (range)
+         sane += v >= range[0] - slack && v <= range[1] + slack;
+      else
+         sane += a < SION_ORDER_HUGE;
+   }
+
+   return sane;
+}
+
+/**
+ * @internal Work out the byte order of an A file from some floats of
+ * its first record, by decoding them both ways. Where the B file min
+ * and max are known, the right order is the one that puts the values
+ * in range; otherwise it is the one with the fewest absurd values.
+ * If it can't be told, the file is taken to be big-endian, as HYCOM
+ * writes them.
+ *
+ * @param raw Pointer to floats as read from the A file.
+ * @param num Number of floats.
+ * @param range Pointer to the min and max of the record, or NULL if
+ * not known.
+ *
+ * @return 1 if the floats must be byte swapped, 0 if not.
+ * @author Ed Hartnett
+ */
+int
+ab_float_order(const float *raw, size_t num, const float *range)
+{
+   const uint32_t one = 1;
+   int little = *(const char *)&one;
+   size_t as_is = count_sane(raw, num, 0, range);
+   size_t swapped = count_sane(raw, num, 1, range);
+
+   LOG((3, "%s: num %d as_is %d swapped %d", __func__, num, as_is, swapped));
+   if (as_is == swapped)
+      return little;
+   return swapped > as_is;
+}
+
+/**
+ * @internal Check a hyperslab of the data variable against the
+ * dimension lengths of an AB file.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param startp Array of start indicies.
+ * @param countp Array of counts.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EINVALCOORDS Start out of range.
+ * @return ::NC_EEDGE Start plus count out of range.
+ * @author Ed Hartnett
+ */
+int
+ab_check_vara(SION_FILE_INFO_T *ab_file, const size_t *startp,
+              const size_t *countp)
+{
+   size_t dim_len[SION_NDIMS3] = {ab_file->t_len, ab_file->j_len,
+                                  ab_file->i_len};
+
+   assert(ab_file && startp && countp);
+
+   for (int d = 0; d < SION_NDIMS3; d++)
+   {
+      if (startp[d] > dim_len[d])
+         return NC_EINVALCOORDS;
+      if (startp[d] + countp[d] > dim_len[d])
+         return NC_EEDGE;
+   }
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Read a hyperslab of the data variable from the A file
+ * and convert it to native floats. This only touches the AB file
+ * info, never the netCDF metadata lists. Batches of reads go through
+ * ab_read_batch() instead.
+ *
+ * @param ab_file Pointer to AB file info.
+ * @param startp Array of start indicies.
+ * @param countp Array of counts.
+ * @param data Pointer that gets the data.
+ *
+ * @returns ::NC_NOERR for success
+ * @returns ::NC_ENOMEM Out of memory.
+ * @returns ::NC_EIO Error reading A file.
+ * @author Ed Hartnett
+ */
+int
+ab_read_vara(SION_FILE_INFO_T *ab_file, const size_t *startp,
+             const size_t *countp, float *data)
+{
+   float *ip = data;
+   float *bufr;
+   int served;
+   int ret;
+
+   assert(ab_file && (ab_file->a_file || ab_file->a_mem || ab_file->mpi) &&
+          startp && countp && data);
+
+   /* The access hint decides how the read is done. */
+   served = ab_hint_strategy(ab_file);
+
+   /* Records may already be decoded by another process. */
+   if (served == SION_SERVED_SHM)
+   {
+      if (!(ret = ab_shm_read(ab_file, startp, countp, data)))
+         ab_hint_done(ab_file, startp, countp, served);
+      return ret;
+   }
+
+   /* The scheduler merges rows into spans, and decompresses the
+    * records of compressed files in parallel. */
+   if (served == SION_SERVED_SPANS)
+   {
+      SION_READ_T read = {ab_file, {startp[0], startp[1], startp[2]},
+                          {countp[0], countp[1], countp[2]}, data};
+      SION_READ_T *readp = &read;
+
+      if (!(ret = ab_read_batch(1, &readp)))
+         ab_hint_done(ab_file, startp, countp, served);
+      return ret;
+   }
+
+   /* Borrow a staging buffer; a row always fits. */
+   if ((ret = ab_pool_get(&ab_file->pool, (void **)&bufr)))
+      return ret;
+
+   /* Find each requested record. */
+   for (size_t rec = 0; !ret && rec < countp[0]; rec++)
+   {
+      off_t rec_pos = (off_t)(startp[0] + rec) * ab_file->rec_len;
+      uint32_t sum = 0;
+      int whole;
+
+      /* A verified record read whole is checked on its rows, as
+       * they are read. */
+      whole = !startp[1] && !startp[2] && countp[1] == ab_file->j_len &&
+         countp[2] == ab_file->i_len && ab_crc_wanted(ab_file, startp[0] + rec);
+
+      for (size_t j = 0; !ret && j < countp[1]; j++)
+      {
+         size_t len = countp[2] * sizeof(float);
+         off_t row_pos;
+         void *raw;
+
+         /* Rows are stored in f77 order, i varies fastest. */
+         row_pos = rec_pos + (off_t)(ab_file->i_len * (startp[1] + j) +
+                                     startp[2]) * sizeof(float);
+
+         LOG((3, "rec %d j %d row_pos %d rec_len %d", rec, j, row_pos,
+              ab_file->rec_len));
+
+         /* Rows in host order are read straight into place. */
+         raw = ab_file->swap ? (void *)bufr : (void *)ip;
+         if ((ret = ab_read_raw(ab_file, row_pos, len, raw)))
+            break;
+         if (whole)
+            sum = ab_crc32c(sum, raw, len);
+         else if ((ret = ab_crc_span(ab_file, row_pos, len, raw)))
+            break;
+         if (ab_file->swap)
+            ret = ab_reverse_floats(bufr, ip, countp[2]);
+         ip += countp[2];
+      }
+      if (!ret && whole)
+         ret = ab_crc_record(ab_file, startp[0] + rec, sum);
+   }
+
+   ab_pool_put(&ab_file->pool, bufr);
+   if (!ret)
+      ab_hint_done(ab_file, startp, countp, served);
+   return ret;
+}
+
 /**
  * Read an array of values. This is called by nc_get_vara() for
  * netCDF-4 files, as well as all the other nc_get_vara_*
@@ -156,6 +441,8 @@ reverse_floats(float *bufr_in, float *bufr_out, size_t num)
  * @param memtype The type of these data after it is read into memory.
 
  * @returns ::NC_NOERR for success
+ * @returns ::NC_EINVALCOORDS Start out of range.
+ * @returns ::NC_EEDGE Start plus count out of range.
  * @author Ed Hartnett, Dennis Heimbigner
  */
 int
@@ -167,7 +454,6 @@ SION_get_vara(int ncid, int varid, const size_t *startp,
    NC_HDF5_FILE_INFO_T *h5;
    NC_VAR_INFO_T *var;
    SION_FILE_INFO_T *ab_file;   
-   int i_len, j_len;
    int ret;
 
    LOG((2, "%s: ncid 0x%x varid %d memtype %d", __func__, ncid, varid,
@@ -190,40 +476,39 @@ SION_get_vara(int ncid, int varid, const size_t *startp,
    if (!strcmp(var->name, TIME_NAME))
       return get_ab_coord_vara(nc, ncid, varid, startp, countp, ip, memtype);
 
-   /* Find the dimension sizes. */
-   for (int d = 0; d < var->ndims; d++)
-      LOG((3, "d %d var->dim[d]->name %s", d, var->dim[d]->name));
-   j_len = var->dim[1]->len;
-   i_len = var->dim[2]->len;
-
-   /* Size of a record. */
-   size_t rec_len = round_up(j_len * i_len, 4096) * sizeof(float);
-   /* size_t num_elem = j_len * i_len; */
+   /* So are the vars of the regional grid and the time reductions. */
+   if (ab_file->grid && varid >= ab_file->grid_varid &&
+       varid < ab_file->grid_varid + ab_file->grid->nfields)
+   {
+      size_t type_size;
 
-   /* Find each requested record. */
-   for (int rec = 0; rec < countp[0]; rec++)
+      if ((ret = nc4_get_typelen_mem(h5, memtype, 0, &type_size)))
+         return ret;
+      return ab_grid_get_vara(ab_file, varid - ab_file->grid_varid, startp,
+                              countp, ip, memtype, type_size);
+   }
+   if (ab_file->reduce && varid >= ab_file->reduce_varid &&
+       varid < ab_file->reduce_varid + SION_NSTATS)
    {
-      long rec_pos = startp[0] * rec_len;
-      for (int j = 0; j < countp[1]; j++)
-      {
-         float *bufr;
-
-         rec_pos += i_len * (startp[1] + j) * sizeof(float);
-         if (!(bufr = malloc(countp[2] * sizeof(float))))
-            return NC_ENOMEM;
-         
-         LOG((3, "rec %d j %d rec_pos %d rec_len %d", rec, j, rec_pos, rec_len));
-         if (fseek(ab_file->a_file, rec_pos, SEEK_SET))
-            return NC_EIO;
-         LOG((3, "ftell %d", ftell(ab_file->a_file)));
-         if ((fread(bufr, sizeof(float), countp[2], ab_file->a_file) != countp[2]))
-            return NC_EIO;
-         if ((ret = reverse_floats(bufr, ip, countp[2])))
-            return ret;
-         ip = (float *)ip + countp[2];
-         free(bufr);
-      }
+      size_t type_size;
+
+      if ((ret = nc4_get_typelen_mem(h5, memtype, 0, &type_size)))
+         return ret;
+      return ab_reduce_get_vara(ab_file, varid - ab_file->reduce_varid, startp,
+                                countp, ip, memtype, type_size);
    }
 
-   return NC_NOERR;
+   /* Find the dimension sizes. */
+   for (int d = 0; d < var->ndims; d++)
+      LOG((3, "d %d var->dim[d]->name %s", d, var->dim[d]->name));
+
+   /* Read and decode the records, with all ranks together if the
+    * file was opened in parallel and collective access was chosen. A
+    * collective read checks the hyperslab itself, so that a rank with
+    * a bad one still takes part. */
+   if (ab_file->mpi && ab_file->collective)
+      return ab_mpi_read_vara(ab_file, startp, countp, ip);
+   if ((ret = ab_check_vara(ab_file, startp, countp)))
+      return ret;
+   return ab_read_vara(ab_file, startp, countp, ip);
 }
@@ -0,0 +1,634 @@
+/**
+ * @file
+ * @internal Reading of seekable-compressed A files for the AB
+ * dispatch layer.
+ *
+ * If there is no foo.a next to foo.b, but there is a foo.a.zst in
+ * the zstd seekable format, it is read instead. That format is a
+ * series of independently compressed zstd frames, followed by a
+ * skippable frame holding the compressed and decompressed size of
+ * each frame. Compressing with a frame size of one padded record
+ * lets any record be read by decompressing just that frame.
+ *
+ * Decompressed frames are kept in a small per-file cache. Batched
+ * reads that touch several frames decompress them in parallel, one
+ * zstd context per thread.
+ *
+ * @author Ed Hartnett
+ */
+
+#include "config.h"
+#include <unistd.h>
+#include "nc4internal.h"
+#include "siondispatch.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+
+/** @internal Magic numbers and sizes of the seek table. */
+#define SION_SKIPPABLE_MAGIC 0x184D2A5E
+#define SION_SEEKABLE_MAGIC 0x8F92EAB1
+#define SION_SEEK_FOOTER_LEN 9
+#define SION_SKIPPABLE_HEADER_LEN 8
+#define SION_SEEK_CHECKSUM_FLAG 0x80
+
+/** @internal Most threads used to decompress one batch. */
+#define SION_ZSTD_THREADS 8
+
+/** @internal Location of one frame. */
+typedef struct SION_ZFRAME
+{
+   off_t c_off; /* Offset of the compressed frame in the file. */
+   size_t c_len; /* Compressed length. */
+   off_t d_off; /* Offset of the data in the decompressed A file. */
+   size_t d_len; /* Decompressed length. */
+} SION_ZFRAME_T;
+
+/** @internal One cached decompressed frame. */
+typedef struct SION_ZSLOT
+{
+   long frame; /* Frame held, -1 for none. */
+   void *data;
+   unsigned long used; /* Clock value of last use, for LRU. */
+} SION_ZSLOT_T;
+
+/** @internal Seekable zstd state of a file. */
+struct SION_ZSTD
+{
+   int fd;
+   long nframes;
+   SION_ZFRAME_T *frame;
+   size_t max_d_len; /* Largest decompressed frame. */
+   off_t d_len; /* Decompressed length of the whole file. */
+   pthread_mutex_t lock; /* Protects the cache and dctx. */
+   SION_ZSLOT_T slot[SION_ZCACHE_SLOTS];
+   unsigned long clock;
+   ZSTD_DCtx *dctx; /* For single frames, used under lock. */
+};
+
+/** @internal Work shared by the decompression threads. */
+typedef struct SION_ZJOB
+{
+   SION_ZSTD_T *z;
+   long *frames; /* Frames to decompress. */
+   void **dst; /* Where each one goes. */
+   int nframes;
+   int nthreads;
+   int tid;
+   int status;
+} SION_ZJOB_T;
+
+/**
+ * @internal Get a little-endian 32-bit value.
+ *
+ * @param p Pointer to 4 bytes.
+ *
+ * @return The value.
+ */
+static unsigned int
+get_le32(const unsigned char *p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/**
+ * @internal Read bytes at an offset, retrying short reads.
+ *
+ * @param fd File descriptor.
+ * @param bufr Buffer that gets the bytes.
+ * @param len Number of bytes.
+ * @param pos Offset in the file.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_EIO Read failed.
+ */
+static int
+read_at(int fd, void *bufr, size_t len, off_t pos)
+{
+   size_t done = 0;
+
+   while (done < len)
+   {
+      ssize_t n = pread(fd, (char *)bufr + done, len - done, pos + done);
+      if (n <= 0)
+         return NC_EIO;
+      done += n;
+   }
+   return NC_NOERR;
+}
+
+/**
+ * @internal Decompress one frame.
+ *
+ * @param z Pointer to zstd state.
+ * @param dctx Decompression context to use.
+ * @param f Frame number.
+ * @param dst Buffer of at least max_d_len bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Read or decompression failed.
+ */
+static int
+decompress_frame(SION_ZSTD_T *z, ZSTD_DCtx *dctx, long f, void *dst)
+{
+   void *src;
+   size_t n;
+   int ret;
+
+   if (!(src = malloc(z->frame[f].c_len)))
+      return NC_ENOMEM;
+   if ((ret = read_at(z->fd, src, z->frame[f].c_len, z->frame[f].c_off)))
+   {
+      free(src);
+      return ret;
+   }
+   n = ZSTD_decompressDCtx(dctx, dst, z->frame[f].d_len, src, z->frame[f].c_len);
+   free(src);
+   if (ZSTD_isError(n) || n != z->frame[f].d_len)
+   {
+      LOG((1, "%s: frame %d: %s", __func__, f,
+           ZSTD_isError(n) ? ZSTD_getErrorName(n) : "short frame"));
+      return NC_EIO;
+   }
+   return NC_NOERR;
+}
+
+/**
+ * @internal Body of a decompression thread. Thread t of n does
+ * frames t, t + n, t + 2n...
+ *
+ * @param arg Pointer to the job of this thread.
+ *
+ * @return NULL.
+ */
+static void *
+zjob_main(void *arg)
+{
+   SION_ZJOB_T *job = arg;
+   ZSTD_DCtx *dctx;
+
+   if (!(dctx = ZSTD_createDCtx()))
+   {
+      job->status = NC_ENOMEM;
+      return NULL;
+   }
+   for (int f = job->tid; !job->status && f < job->nframes; f += job->nthreads)
+      job->status = decompress_frame(job->z, dctx, job->frames[f], job->dst[f]);
+   ZSTD_freeDCtx(dctx);
+
+   return NULL;
+}
+
+/**
+ * @internal Find the cache slot for a frame. Must be called with
+ * the lock held.
+ *
+ * @param z Pointer to zstd state.
+ * @param f Frame number.
+ *
+ * @return Slot number, or -1 if not cached.
+ */
+static int
+find_slot(SION_ZSTD_T *z, long f)
+{
+   for (int s = 0; s < SION_ZCACHE_SLOTS; s++)
+      if (z->slot[s].frame == f)
+         return s;
+   return -1;
+}
+
+/**
+ * @internal Pick a slot to reuse, the least recently used one not
+ * marked as busy. Must be called with the lock held.
+ *
+ * @param z Pointer to zstd state.
+ * @param busy Array of SION_ZCACHE_SLOTS flags.
+ *
+ * @return Slot number.
+ */
+static int
+victim_slot(SION_ZSTD_T *z, const int *busy)
+{
+   int v = -1;
+
+   for (int s = 0; s < SION_ZCACHE_SLOTS; s++)
+      if (!busy[s] && (v < 0 || z->slot[s].used < z->slot[v].used))
+         v = s;
+   assert(v >= 0);
+   return v;
+}
+
+/**
+ * @internal Open the seekable zstd A file, and read its seek table.
+ *
+ * @param ab_file Pointer to AB file info, with a_file open on the
+ * compressed file and t_len and rec_len set.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Bad or missing seek table.
+ * @author Ed Hartnett
+ */
+int
+ab_zstd_open(SION_FILE_INFO_T *ab_file)
+{
+   SION_ZSTD_T *z;
+   unsigned char footer[SION_SEEK_FOOTER_LEN];
+   unsigned char *table;
+   size_t entry_len, table_len;
+   off_t file_len, pos;
+   off_t c_off = 0, d_off = 0;
+   int ret;
+
+   assert(ab_file && ab_file->a_file && !ab_file->zstd);
+
+   if (!(z = calloc(1, sizeof(SION_ZSTD_T))))
+      return NC_ENOMEM;
+   z->fd = fileno(ab_file->a_file);
+   for (int s = 0; s < SION_ZCACHE_SLOTS; s++)
+      z->slot[s].frame = -1;
+   pthread_mutex_init(&z->lock, NULL);
+   ab_file->zstd = z;
+
+   /* Read the footer at the end of the file. */
+   if ((file_len = lseek(z->fd, 0, SEEK_END)) < SION_SEEK_FOOTER_LEN)
+      return NC_EIO;
+   if ((ret = read_at(z->fd, footer, SION_SEEK_FOOTER_LEN,
+                      file_len - SION_SEEK_FOOTER_LEN)))
+      return ret;
+   if (get_le32(footer + 5) != SION_SEEKABLE_MAGIC)
+      return NC_EIO;
+   z->nframes = get_le32(footer);
+   if (z->nframes < 1)
+      return NC_EIO;
+   entry_len = (footer[4] & SION_SEEK_CHECKSUM_FLAG) ? 12 : 8;
+   table_len = z->nframes * entry_len;
+   LOG((3, "%s: nframes %d entry_len %d", __func__, z->nframes, entry_len));
+
+   /* The table sits in a skippable frame just before the footer. */
+   pos = file_len - SION_SEEK_FOOTER_LEN - table_len - SION_SKIPPABLE_HEADER_LEN;
+   if (pos < 0)
+      return NC_EIO;
+   if (!(table = malloc(table_len + SION_SKIPPABLE_HEADER_LEN)))
+      return NC_ENOMEM;
+   if ((ret = read_at(z->fd, table, table_len + SION_SKIPPABLE_HEADER_LEN, pos)))
+   {
+      free(table);
+      return ret;
+   }
+   if (get_le32(table) != SION_SKIPPABLE_MAGIC ||
+       get_le32(table + 4) != table_len + SION_SEEK_FOOTER_LEN)
+   {
+      free(table);
+      return NC_EIO;
+   }
+
+   if (!(z->frame = malloc(z->nframes * sizeof(SION_ZFRAME_T))))
+   {
+      free(table);
+      return NC_ENOMEM;
+   }
+   for (long f = 0; f < z->nframes; f++)
+   {
+      const unsigned char *e = table + SION_SKIPPABLE_HEADER_LEN + f * entry_len;
+
+      z->frame[f].c_off = c_off;
+      z->frame[f].c_len = get_le32(e);
+      z->frame[f].d_off = d_off;
+      z->frame[f].d_len = get_le32(e + 4);
+      if (z->frame[f].d_len > z->max_d_len)
+         z->max_d_len = z->frame[f].d_len;
+      c_off += z->frame[f].c_len;
+      d_off += z->frame[f].d_len;
+   }
+   free(table);
+   z->d_len = d_off;
+
+   /* Frames must end where the seek table starts, and hold all the
+    * records. */
+   if (c_off != pos || d_off < (off_t)ab_file->t_len * ab_file->rec_len)
+      return NC_EIO;
+
+   if (!(z->dctx = ZSTD_createDCtx()))
+      return NC_ENOMEM;
+
+   return NC_NOERR;
+}
+
+/**
+ * @internal Get the decompressed length of a compressed A file.
+ *
+ * @param z Pointer to zstd state.
+ *
+ * @return Length in bytes.
+ * @author Ed Hartnett
+ */
+off_t
+ab_zstd_size(SION_ZSTD_T *z)
+{
+   assert(z);
+   return z->d_len;
+}
+
+/**
+ * @internal Free the seekable zstd state of a file. The A file
+ * itself is closed by the caller.
+ *
+ * @param z Pointer to zstd state. Ignored if NULL.
+ *
+ * @author Ed Hartnett
+ */
+void
+ab_zstd_close(SION_ZSTD_T *z)
+{
+   if (!z)
+      return;
+   for (int s = 0; s < SION_ZCACHE_SLOTS; s++)
+      free(z->slot[s].data);
+   if (z->dctx)
+      ZSTD_freeDCtx(z->dctx);
+   pthread_mutex_destroy(&z->lock);
+   free(z->frame);
+   free(z);
+}
+
+/**
+ * @internal Find the frame holding a byte of the decompressed A
+ * file.
+ *
+ * @param z Pointer to zstd state.
+ * @param pos Offset in the decompressed A file.
+ *
+ * @return Frame number.
+ * @author Ed Hartnett
+ */
+long
+ab_zstd_frame(SION_ZSTD_T *z, off_t pos)
+{
+   long lo = 0, hi = z->nframes - 1;
+
+   /* Binary search on the decompressed offsets. */
+   while (lo < hi)
+   {
+      long mid = (lo + hi + 1) / 2;
+      if (z->frame[mid].d_off <= pos)
+         lo = mid;
+      else
+         hi = mid - 1;
+   }
+   return lo;
+}
+
+/**
+ * @internal Make sure a set of frames is in the cache, decompressing
+ * the missing ones in parallel. At most ::SION_ZCACHE_SLOTS frames
+ * may be asked for at once.
+ *
+ * @param z Pointer to zstd state.
+ * @param frames Array of frame numbers, in increasing order.
+ * @param n Number of frames.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Read or decompression failed.
+ * @author Ed Hartnett
+ */
+int
+ab_zstd_prefetch(SION_ZSTD_T *z, const long *frames, int n)
+{
+   int busy[SION_ZCACHE_SLOTS] = {0};
+   long missing[SION_ZCACHE_SLOTS];
+   void *dst[SION_ZCACHE_SLOTS];
+   int mslot[SION_ZCACHE_SLOTS];
+   pthread_t thread[SION_ZSTD_THREADS];
+   int started[SION_ZSTD_THREADS] = {0};
+   SION_ZJOB_T job[SION_ZSTD_THREADS];
+   int nmissing = 0, nthreads;
+   long ncpu;
+   int ret = NC_NOERR;
+
+   assert(z && frames && n <= SION_ZCACHE_SLOTS);
+
+   pthread_mutex_lock(&z->lock);
+
+   /* Keep the frames already there. */
+   for (int f = 0; f < n; f++)
+   {
+      int s = find_slot(z, frames[f]);
+      if (s >= 0)
+      {
+         busy[s]++;
+         z->slot[s].used = ++z->clock;
+      }
+      else if (!nmissing || missing[nmissing - 1] != frames[f])
+         missing[nmissing++] = frames[f];
+   }
+
+   /* Find slots for the others. */
+   for (int m = 0; m < nmissing; m++)
+   {
+      int s = victim_slot(z, busy);
+
+      busy[s]++;
+      z->slot[s].frame = -1;
+      if (!z->slot[s].data && !(z->slot[s].data = malloc(z->max_d_len)))
+         ret = NC_ENOMEM;
+      mslot[m] = s;
+      dst[m] = z->slot[s].data;
+   }
+   if (ret || !nmissing)
+   {
+      pthread_mutex_unlock(&z->lock);
+      return ret;
+   }
+
+   /* Decompress them, one context per thread. */
+   ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   nthreads = nmissing < SION_ZSTD_THREADS ? nmissing : SION_ZSTD_THREADS;
+   if (ncpu > 0 && nthreads > ncpu)
+      nthreads = ncpu;
+   LOG((3, "%s: %d frames on %d threads", __func__, nmissing, nthreads));
+   for (int t = 0; t < nthreads; t++)
+   {
+      job[t].z = z;
+      job[t].frames = missing;
+      job[t].dst = dst;
+      job[t].nframes = nmissing;
+      job[t].nthreads = nthreads;
+      job[t].tid = t;
+      job[t].status = NC_NOERR;
+   }
+   for (int t = 1; t < nthreads; t++)
+   {
+      if (pthread_create(&thread[t], NULL, zjob_main, &job[t]))
+         job[t].status = NC_EIO;
+      else
+         started[t]++;
+   }
+   zjob_main(&job[0]);
+   for (int t = 1; t < nthreads; t++)
+      if (started[t])
+         pthread_join(thread[t], NULL);
+   for (int t = 0; t < nthreads; t++)
+      if (job[t].status && !ret)
+         ret = job[t].status;
+
+   /* Only frames that all came through are kept. */
+   if (!ret)
+      for (int m = 0; m < nmissing; m++)
+      {
+         z->slot[mslot[m]].frame = missing[m];
+         z->slot[mslot[m]].used = ++z->clock;
+      }
+   pthread_mutex_unlock(&z->lock);
+
+   return ret;
+}
+
+/**
+ * @internal Read bytes of the decompressed A file.
+ *
+ * @param z Pointer to zstd state.
+ * @param pos Offset in the decompressed A file.
+ * @param len Number of bytes.
+ * @param bufr Buffer that gets the bytes.
+ *
+ * @return ::NC_NOERR No error.
+ * @return ::NC_ENOMEM Out of memory.
+ * @return ::NC_EIO Read or decompression failed.
+ * @author Ed Hartnett
+ */
+int
+ab_zstd_read(SION_ZSTD_T *z, off_t pos, size_t len, void *bufr)
+{
+   char *dst = bufr;
+   int ret = NC_NOERR;
+
+   assert(z && bufr);
+
+   pthread_mutex_lock(&z->lock);
+   while (!ret && len)
+   {
+      long f = ab_zstd_frame(z, pos);
+      size_t off = pos - z->frame[f].d_off;
+      size_t n;
+      int s;
+
+      if (off >= z->frame[f].d_len)
+      {
+         ret = NC_EIO;
+         break;
+      }
+
+      /* Decompress the frame if it is not cached. */
+      if ((s = find_slot(z, f)) < 0)
+      {
+         int busy[SION_ZCACHE_SLOTS] = {0};
+
+         s = victim_slot(z, busy);
+         z->slot[s].frame = -1;
+         if (!z->slot[s].data && !(z->slot[s].data = malloc(z->max_d_len)))
+            ret = NC_ENOMEM;
+         else if (!(ret = decompress_frame(z, z->dctx, f, z->slot[s].data)))
+            z->slot[s].frame = f;
+         if (ret)
+            break;
+      }
+      z->slot[s].used = ++z->clock;
+
+      n = z->frame[f].d_len - off < len ? z->frame[f].d_len - off : len;
+      memcpy(dst, (char *)z->slot[s].data + off, n);
+      pos += n;
+      dst += n;
+      len -= n;
+   }
+   pthread_mutex_unlock(&z->lock);
+
+   return ret;
+}
+
+#else /* HAVE_ZSTD */
+
+/**
+ * @internal Seekable zstd A files need the zstd library.
+ *
+ * @param ab_file Ignored.
+ *
+ * @return ::NC_ENOTBUILT Not built with zstd.
+ */
+int
+ab_zstd_open(SION_FILE_INFO_T *ab_file)
+{
+   return NC_ENOTBUILT;
+}
+
+/**
+ * @internal Never called without zstd.
+ *
+ * @param z Ignored.
+ */
+void
+ab_zstd_close(SION_ZSTD_T *z)
+{
+}
+
+/**
+ * @internal Never called without zstd.
+ *
+ * @param z Ignored.
+ *
+ * @return 0 Always.
+ */
+off_t
+ab_zstd_size(SION_ZSTD_T *z)
+{
+   return 0;
+}
+
+/**
+ * @internal Never called without zstd.
+ *
+ * @param z Ignored.
+ * @param pos Ignored.
+ *
+ * @return 0 Always.
+ */
+long
+ab_zstd_frame(SION_ZSTD_T *z, off_t pos)
+{
+   return 0;
+}
+
+/**
+ * @internal Never called without zstd.
+ *
+ * @param z Ignored.
+ * @param frames Ignored.
+ * @param n Ignored.
+ *
+ * @return ::NC_ENOTBUILT Always.
+ */
+int
+ab_zstd_prefetch(SION_ZSTD_T *z, const long *frames, int n)
+{
+   return NC_ENOTBUILT;
+}
+
+/**
+ * @internal Never called without zstd.
+ *
+ * @param z Ignored.
+ * @param pos Ignored.
+ * @param len Ignored.
+ * @param bufr Ignored.
+ *
+ * @return ::NC_ENOTBUILT Always.
+ */
+int
+ab_zstd_read(SION_ZSTD_T *z, off_t pos, size_t len, void *bufr)
+{
+   return NC_ENOTBUILT;
+}
+
+#endif /* HAVE_ZSTD */
@@ -0,0 +1,7 @@
+#!/bin/sh
+# Run the parallel AB tests on four ranks.
+#
+# Ed Hartnett
+
+set -e
+${MPIEXEC:-mpiexec} -n 4 ./tst_mpi
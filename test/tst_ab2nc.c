@@ -0,0 +1,114 @@
+/* Test the ab2nc tool.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_ab2nc.b"
+#define OUT_FILE "tst_ab2nc.nc"
+#define AB2NC "../tools/ab2nc"
+#define T_LEN 6
+#define J_LEN 11
+#define I_LEN 13
+#define MAX_LINE 256
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   char cmd[MAX_LINE];
+   float data[T_LEN * J_LEN * I_LEN];
+   float day[T_LEN], ab_day[T_LEN];
+   int ncid, ab_ncid, varid;
+   int ret;
+
+   printf("\nTesting ab2nc...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+
+   /* Chunks of 4 rows leave a short one at the end of each record. */
+   sprintf(cmd, "%s -r 4 -n 3 -d 5 %s %s", AB2NC, TEST_FILE, OUT_FILE);
+   if (system(cmd))
+      ERR(2);
+
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ab_ncid)))
+      ERR(ret);
+   if ((ret = nc_open(OUT_FILE, NC_NOWRITE, &ncid)))
+      ERR(ret);
+
+   /* The data. */
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+   if ((ret = nc_get_var_float(ncid, varid, data)))
+      ERR(ret);
+   for (int t = 0, n = 0; t < T_LEN; t++)
+      for (int j = 0; j < J_LEN; j++)
+         for (int i = 0; i < I_LEN; i++)
+            if (data[n++] != TST_VAL(t, j, i))
+               ERR(3);
+
+   /* Chunked and deflated, with the default fill value. */
+   {
+      size_t chunks[SION_NDIMS3];
+      int storage, shuffle, deflate, level, no_fill;
+      float fill;
+
+      if ((ret = nc_inq_var_chunking(ncid, varid, &storage, chunks)))
+         ERR(ret);
+      if (storage != NC_CHUNKED || chunks[0] != 1 || chunks[1] != 4 ||
+          chunks[2] != I_LEN)
+         ERR(4);
+      if ((ret = nc_inq_var_deflate(ncid, varid, &shuffle, &deflate, &level)))
+         ERR(ret);
+      if (!deflate || level != 5)
+         ERR(5);
+      if ((ret = nc_inq_var_fill(ncid, varid, &no_fill, &fill)))
+         ERR(ret);
+      if (no_fill || fill != NC_FILL_FLOAT)
+         ERR(6);
+   }
+
+   /* The other var, and the atts. */
+   if ((ret = nc_get_var_float(ncid, 0, day)) ||
+       (ret = nc_get_var_float(ab_ncid, 0, ab_day)))
+      ERR(ret);
+   for (int t = 0; t < T_LEN; t++)
+      if (day[t] != ab_day[t])
+         ERR(7);
+   for (int v = NC_GLOBAL; v <= varid; v++)
+   {
+      int natts, ab_natts;
+
+      if ((ret = nc_inq_varnatts(ncid, v, &natts)) ||
+          (ret = nc_inq_varnatts(ab_ncid, v, &ab_natts)))
+         ERR(ret);
+      if (natts != ab_natts + (v == varid))
+         ERR(8);
+   }
+   {
+      float min[T_LEN];
+
+      if ((ret = nc_get_att_float(ncid, varid, MIN_NAME, min)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN; t++)
+         if (min[t] != TST_VAL(t, 0, 0))
+            ERR(9);
+   }
+
+   if ((ret = nc_close(ncid)) || (ret = nc_close(ab_ncid)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
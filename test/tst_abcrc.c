@@ -0,0 +1,68 @@
+/* Test the abcrc tool.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_abcrc.b"
+#define A_FILE "tst_abcrc.a"
+#define OUT_FILE "tst_abcrc.txt"
+#define ABCRC "../tools/abcrc"
+#define T_LEN 3
+#define J_LEN 7
+#define I_LEN 9
+#define MAX_LINE 256
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+int
+main()
+{
+   char cmd[MAX_LINE];
+   char line[MAX_LINE];
+   FILE *f;
+
+   printf("\nTesting abcrc...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+
+   /* No checksums yet. */
+   sprintf(cmd, "%s %s > /dev/null 2>&1", ABCRC, TEST_FILE);
+   if (!system(cmd))
+      ERR(2);
+
+   /* Build them, and check them. */
+   sprintf(cmd, "%s -w %s", ABCRC, TEST_FILE);
+   if (system(cmd))
+      ERR(3);
+   sprintf(cmd, "%s %s > %s", ABCRC, TEST_FILE, OUT_FILE);
+   if (system(cmd))
+      ERR(4);
+   if (!(f = fopen(OUT_FILE, "r")))
+      ERR(5);
+   if (!fgets(line, sizeof(line), f) || strcmp(line, TEST_FILE ": ok\n"))
+      ERR(6);
+   fclose(f);
+
+   /* Change the last value of the last record. */
+   if (!(f = fopen(A_FILE, "r+b")) ||
+       fseek(f, ((T_LEN - 1) * 4096 + J_LEN * I_LEN - 1) * 4, SEEK_SET) ||
+       fputc(0x7f, f) == EOF || fclose(f))
+      ERR(7);
+   sprintf(cmd, "%s %s > %s", ABCRC, TEST_FILE, OUT_FILE);
+   if (!system(cmd))
+      ERR(8);
+   if (!(f = fopen(OUT_FILE, "r")))
+      ERR(9);
+   if (!fgets(line, sizeof(line), f) ||
+       strcmp(line, TEST_FILE ": 1 bad record: 2\n"))
+      ERR(10);
+   fclose(f);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
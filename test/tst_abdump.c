@@ -0,0 +1,90 @@
+/* Test the abdump tool.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_abdump.b"
+#define OUT_FILE "tst_abdump.txt"
+#define ABDUMP "../tools/abdump"
+#define T_LEN 5
+#define J_LEN 40
+#define I_LEN 30000
+#define MAX_LINE 256
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+int
+main()
+{
+   char cmd[MAX_LINE];
+   char line[MAX_LINE];
+   FILE *f;
+
+   printf("\nTesting abdump...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+
+   /* CSV of a strided box, on more threads than rows. */
+   sprintf(cmd, "%s -t 1:2:2 -j 3::17 -i 29990:4:3 -n 8 -o %s %s", ABDUMP,
+           OUT_FILE, TEST_FILE);
+   if (system(cmd))
+      ERR(2);
+   if (!(f = fopen(OUT_FILE, "r")))
+      ERR(3);
+   if (!fgets(line, sizeof(line), f) || strcmp(line, "day,j,i," TST_VAR_NAME "\n"))
+      ERR(4);
+   for (int t = 1; t < T_LEN; t += 2)
+      for (int j = 3; j < J_LEN; j += 17)
+         for (int i = 29990; i < 30000; i += 3)
+         {
+            float day, val;
+            int jj, ii;
+
+            if (!fgets(line, sizeof(line), f) ||
+                sscanf(line, "%f,%d,%d,%f", &day, &jj, &ii, &val) != 4)
+               ERR(5);
+            if (day != 40000 + t || jj != j || ii != i || val != TST_VAL(t, j, i))
+               ERR(6);
+         }
+   if (fgets(line, sizeof(line), f))
+      ERR(7);
+   fclose(f);
+
+   /* CDL of a small box, one thread. */
+   sprintf(cmd, "%s -f cdl -t 4 -j 0:2 -i 0:3 -n 1 -o %s %s", ABDUMP, OUT_FILE,
+           TEST_FILE);
+   if (system(cmd))
+      ERR(8);
+   if (!(f = fopen(OUT_FILE, "r")))
+      ERR(9);
+   {
+      const char *expect[] = {"netcdf tst_abdump {\n", "dimensions:\n",
+                              "\tday = 1 ;\n", "\tj = 2 ;\n", "\ti = 3 ;\n",
+                              "variables:\n",
+                              "\tfloat " TST_VAR_NAME "(day, j, i) ;\n",
+                              "data:\n", "\n", " " TST_VAR_NAME " =\n",
+                              "  40000, 40001, 40002,\n",
+                              "  40100, 40101, 40102 ;\n", "}\n"};
+
+      for (int l = 0; l < sizeof(expect) / sizeof(expect[0]); l++)
+         if (!fgets(line, sizeof(line), f) || strcmp(line, expect[l]))
+            ERR(10);
+   }
+   fclose(f);
+
+   /* Bad arguments are refused. */
+   sprintf(cmd, "%s -f cdl -V skip %s > /dev/null 2>&1", ABDUMP, TEST_FILE);
+   if (!system(cmd))
+      ERR(11);
+   sprintf(cmd, "%s -j 41 %s > /dev/null 2>&1", ABDUMP, TEST_FILE);
+   if (!system(cmd))
+      ERR(12);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
@@ -0,0 +1,283 @@
+/* Test non-blocking reads of AB format with netCDF.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_async.b"
+#define NATIVE_FILE "tst_native.b"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+#define NREQ 3
+#define SHM_NAME "/tst_async_cache"
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   int req[NREQ];
+   float data[NREQ][J_LEN * I_LEN];
+   float day[T_LEN];
+   int ret;
+
+   printf("\nTesting AB format async reads...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+
+   /* Queue some reads, out of order, including a sub-box. */
+   {
+      size_t start[NREQ][SION_NDIMS3] = {{3, 0, 0}, {1, 0, 0}, {2, 2, 1}};
+      size_t count[NREQ][SION_NDIMS3] = {{1, J_LEN, I_LEN}, {1, J_LEN, I_LEN},
+                                         {1, 3, 2}};
+      int done;
+
+      for (int r = 0; r < NREQ; r++)
+         if ((ret = SION_iget_vara(ncid, varid, start[r], count[r], data[r],
+                                   &req[r])))
+            ERR(ret);
+      if ((ret = SION_test(req[0], &done)))
+         ERR(ret);
+      for (int r = NREQ - 1; r >= 0; r--)
+         if ((ret = SION_wait(req[r])))
+            ERR(ret);
+
+      /* Request IDs are gone after the wait. */
+      if (SION_wait(req[0]) != NC_EINVAL)
+         ERR(2);
+
+      for (int r = 0; r < NREQ; r++)
+      {
+         int n = 0;
+         for (int j = 0; j < count[r][1]; j++)
+            for (int i = 0; i < count[r][2]; i++)
+               if (data[r][n++] != TST_VAL(start[r][0], start[r][1] + j,
+                                           start[r][2] + i))
+                  ERR(3);
+      }
+   }
+
+   /* Read a batch of boxes in random order, with one bad request. */
+   {
+      SION_VARA_REQ_T breq[NREQ + 1] = {
+         {ncid, varid, {2, 3, 0}, {2, 2, I_LEN}, data[0]},
+         {ncid, varid, {0, 0, 3}, {1, J_LEN, 2}, data[1]},
+         {ncid, varid, {T_LEN + 1, 0, 0}, {1, 1, 1}, data[2]},
+         {ncid, varid, {1, 1, 1}, {1, 1, 1}, data[2]}};
+
+      if (SION_set_coalesce_gap(ncid, 64) || SION_set_coalesce_gap(-1, 0) != NC_EBADID)
+         ERR(4);
+      if (SION_get_vara_batch(NREQ + 1, breq) != NC_EINVALCOORDS)
+         ERR(5);
+      if (breq[0].status || breq[1].status || breq[3].status ||
+          breq[2].status != NC_EINVALCOORDS)
+         ERR(6);
+      for (int r = 0; r < NREQ + 1; r++)
+      {
+         int n = 0;
+         if (r == 2)
+            continue;
+         for (int t = 0; t < breq[r].count[0]; t++)
+            for (int j = 0; j < breq[r].count[1]; j++)
+               for (int i = 0; i < breq[r].count[2]; i++)
+                  if (breq[r].value[n++] != TST_VAL(breq[r].start[0] + t,
+                                                    breq[r].start[1] + j,
+                                                    breq[r].start[2] + i))
+                     ERR(7);
+      }
+   }
+
+   /* Coordinate var comes back already done. */
+   {
+      size_t start = 0, count = T_LEN;
+      int done = 0;
+
+      if ((ret = SION_iget_vara(ncid, 0, &start, &count, day, &req[0])))
+         ERR(ret);
+      if ((ret = SION_test(req[0], &done)) || !done)
+         ERR(8);
+      if ((ret = SION_wait(req[0])))
+         ERR(ret);
+      for (int t = 0; t < T_LEN; t++)
+         if (day[t] != 40000.0 + t)
+            ERR(9);
+   }
+
+   /* Coordinate reads with conversion, and the per-record atts,
+    * which are attached on first use. */
+   {
+      size_t start = 1, count = T_LEN - 1;
+      double dday[T_LEN];
+      char name[NC_MAX_NAME + 1];
+      int natts;
+
+      if ((ret = nc_get_vara_double(ncid, 0, &start, &count, dday)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN - 1; t++)
+         if (dday[t] != 40001.0 + t)
+            ERR(10);
+      if ((ret = nc_inq_varnatts(ncid, varid, &natts)) || natts < NUM_SION_VAR_ATTS)
+         ERR(11);
+      if ((ret = nc_inq_attname(ncid, varid, 0, name)) || strcmp(name, TIME_NAME))
+         ERR(12);
+      if ((ret = nc_inq_attname(ncid, varid, 3, name)) || strcmp(name, MAX_NAME))
+         ERR(13);
+      if ((ret = nc_get_att_float(ncid, varid, MAX_NAME, day)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN; t++)
+         if (day[t] != TST_VAL(t, J_LEN - 1, I_LEN - 1))
+            ERR(14);
+   }
+
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   /* Scan every record again, streamed with direct I/O. */
+   if ((ret = SION_set_open_flags(SION_OPEN_DIRECT | SION_OPEN_HUGEPAGES)))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   for (int t = 0; t < T_LEN; t++)
+   {
+      size_t start[SION_NDIMS3] = {t, 1, 0};
+      size_t count[SION_NDIMS3] = {1, J_LEN - 1, I_LEN};
+      int n = 0;
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data[0])))
+         ERR(ret);
+      for (int j = 1; j < J_LEN; j++)
+         for (int i = 0; i < I_LEN; i++)
+            if (data[0][n++] != TST_VAL(t, j, i))
+               ERR(15);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   /* Open with only the B file header read; records are counted
+    * from the A file, and times read when asked for. */
+   if ((ret = SION_set_open_flags(SION_OPEN_INSTANT)))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   {
+      size_t t_len, start = 0, count = T_LEN;
+
+      if ((ret = nc_inq_dimlen(ncid, 0, &t_len)) || t_len != T_LEN)
+         ERR(16);
+      if ((ret = nc_get_vara_float(ncid, 0, &start, &count, day)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN; t++)
+         if (day[t] != 40000.0 + t)
+            ERR(17);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+   if ((ret = SION_set_open_flags(0)))
+      ERR(ret);
+
+   /* The same file open twice shares its per-record arrays, header
+    * atts and fill value; closing one must leave the other intact. */
+   {
+      char text[MAX_B_LINE_LEN + 1], text2[MAX_B_LINE_LEN + 1];
+      size_t len;
+      float fill;
+      int ncid2, no_fill;
+
+      if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+         ERR(ret);
+      if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid2)))
+         ERR(ret);
+      if ((ret = nc_get_att_float(ncid, varid, MIN_NAME, day)))
+         ERR(ret);
+      if ((ret = nc_inq_attlen(ncid, NC_GLOBAL, "att_0", &len)) ||
+          len > MAX_B_LINE_LEN)
+         ERR(18);
+      if ((ret = nc_get_att_text(ncid, NC_GLOBAL, "att_0", text)))
+         ERR(ret);
+      if ((ret = nc_close(ncid)))
+         ERR(ret);
+      if ((ret = nc_get_att_float(ncid2, varid, MIN_NAME, day)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN; t++)
+         if (day[t] != TST_VAL(t, 0, 0))
+            ERR(19);
+      if ((ret = nc_get_att_text(ncid2, NC_GLOBAL, "att_0", text2)) ||
+          memcmp(text, text2, len))
+         ERR(20);
+      if ((ret = nc_inq_var_fill(ncid2, varid, &no_fill, &fill)) ||
+          fill != SION_VOID_VALUE)
+         ERR(21);
+      if ((ret = nc_close(ncid2)))
+         ERR(ret);
+   }
+
+   /* Read through the shared memory record cache: the first read
+    * fills it, the second is served from it. */
+   shm_unlink(SHM_NAME);
+   if ((ret = SION_set_shm_cache(SHM_NAME, 1024 * 1024,
+                                 J_LEN * I_LEN * sizeof(float))))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   for (int pass = 0; pass < 2; pass++)
+   {
+      size_t start[SION_NDIMS3] = {1, 2, 1};
+      size_t count[SION_NDIMS3] = {2, 3, 4};
+      int n = 0;
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data[0])))
+         ERR(ret);
+      for (int t = 0; t < count[0]; t++)
+         for (int j = 0; j < count[1]; j++)
+            for (int i = 0; i < count[2]; i++)
+               if (data[0][n++] != TST_VAL(start[0] + t, start[1] + j,
+                                           start[2] + i))
+                  ERR(22);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+   if ((ret = SION_set_shm_cache(NULL, 0, 0)))
+      ERR(ret);
+   shm_unlink(SHM_NAME);
+
+   /* A file written in host byte order reads the same. */
+   if (tst_write_ab(NATIVE_FILE, T_LEN, J_LEN, I_LEN, 0))
+      ERR(23);
+   if ((ret = nc_open(NATIVE_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS3] = {2, 1, 1};
+      size_t count[SION_NDIMS3] = {1, J_LEN - 1, I_LEN - 1};
+      int n = 0;
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data[0])))
+         ERR(ret);
+      for (int j = 0; j < count[1]; j++)
+         for (int i = 0; i < count[2]; i++)
+            if (data[0][n++] != TST_VAL(start[0], start[1] + j, start[2] + i))
+               ERR(24);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
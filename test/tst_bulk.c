@@ -0,0 +1,69 @@
+/* Test opening many AB files at once.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tst_utils.h"
+
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+#define NBULK 4
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   float data[1];
+   int varid;
+   int ret;
+
+   printf("\nTesting AB format bulk open...");
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* Open several files at once, one of them missing. */
+   {
+      const char *paths[NBULK] = {"tst_bulk0.b", "tst_bulk1.b", "tst_none.b",
+                                  "tst_bulk2.b"};
+      int bulk_ncid[NBULK];
+
+      for (int f = 0; f < NBULK; f++)
+         if (f != 2 && tst_write_ab(paths[f], T_LEN + f, J_LEN, I_LEN, 1))
+            ERR(1);
+      if (SION_open_many(NBULK, paths, NC_UF0, bulk_ncid) != NC_EIO)
+         ERR(2);
+      if (bulk_ncid[2] != -1)
+         ERR(3);
+      for (int f = 0; f < NBULK; f++)
+      {
+         size_t t_len;
+         size_t start[SION_NDIMS3] = {T_LEN - 1, 1, 2};
+         size_t count[SION_NDIMS3] = {1, 1, 1};
+
+         if (f == 2)
+            continue;
+         if ((ret = nc_inq_dimlen(bulk_ncid[f], 0, &t_len)) || t_len != T_LEN + f)
+            ERR(4);
+         if ((ret = nc_inq_varid(bulk_ncid[f], TST_VAR_NAME, &varid)))
+            ERR(ret);
+         if ((ret = nc_get_vara_float(bulk_ncid[f], varid, start, count, data)))
+            ERR(ret);
+         if (data[0] != TST_VAL(T_LEN - 1, 1, 2))
+            ERR(5);
+         if ((ret = nc_close(bulk_ncid[f])))
+            ERR(ret);
+      }
+   }
+
+   printf("SUCCESS!\n");
+   return 0;
+}
@@ -0,0 +1,160 @@
+/* Test record checksums of AB files.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_crc.b"
+#define A_FILE "tst_crc.a"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   float data[J_LEN * I_LEN];
+   int ret;
+
+   printf("\nTesting AB format record checksums...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* Record checksums: a corrupted record is found, and cannot be
+    * read when verifying. */
+   if ((ret = SION_build_checksums(TEST_FILE)))
+      ERR(ret);
+   {
+      size_t bad[T_LEN], nbad;
+
+      if ((ret = SION_verify_checksums(TEST_FILE, T_LEN, bad, &nbad)))
+         ERR(ret);
+      if (nbad)
+         ERR(2);
+   }
+   if ((ret = SION_set_open_flags(SION_OPEN_VERIFY)))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+   for (int t = 0; t < T_LEN; t++)
+   {
+      size_t start[SION_NDIMS3] = {t, 0, 0};
+      size_t count[SION_NDIMS3] = {1, J_LEN, I_LEN};
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+   {
+      FILE *f;
+      int c;
+
+      if (!(f = fopen(A_FILE, "r+b")) ||
+          fseek(f, 2 * ab_rec_len(J_LEN, I_LEN) + 9, SEEK_SET) ||
+          (c = fgetc(f)) == EOF || fseek(f, -1, SEEK_CUR) ||
+          fputc(c ^ 0x10, f) == EOF || fclose(f))
+         ERR(3);
+   }
+   {
+      size_t bad[T_LEN], nbad;
+
+      if ((ret = SION_verify_checksums(TEST_FILE, T_LEN, bad, &nbad)))
+         ERR(ret);
+      if (nbad != 1 || bad[0] != 2)
+         ERR(4);
+   }
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS3] = {1, 0, 0};
+      size_t count[SION_NDIMS3] = {1, J_LEN, I_LEN};
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+      if (data[J_LEN * I_LEN - 1] != TST_VAL(1, J_LEN - 1, I_LEN - 1))
+         ERR(5);
+      start[0] = 2;
+      for (int k = 0; k < 2; k++)
+         if (nc_get_vara_float(ncid, varid, start, count, data) != NC_EIO)
+            ERR(6);
+      start[0] = 3;
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   /* Only reads of whole records are checked, whichever way they
+    * are done; once a record is found bad, no part of it can be
+    * read. */
+   for (int hint = 0; hint < 2; hint++)
+   {
+      size_t start[SION_NDIMS3] = {2, 1, 1};
+      size_t count[SION_NDIMS3] = {1, 2, 2};
+      size_t whole[SION_NDIMS3] = {1, J_LEN, I_LEN};
+      int req;
+
+      if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+         ERR(ret);
+      if (hint && (ret = SION_set_access_hint(ncid, varid, SION_HINT_TIME_SERIES)))
+         ERR(ret);
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+      start[1] = start[2] = 0;
+      if (hint)
+         ret = nc_get_vara_float(ncid, varid, start, whole, data);
+      else if (!(ret = SION_iget_vara(ncid, varid, start, whole, data, &req)))
+         ret = SION_wait(req);
+      if (ret != NC_EIO)
+         ERR(7);
+      start[1] = start[2] = 1;
+      if (nc_get_vara_float(ncid, varid, start, count, data) != NC_EIO)
+         ERR(8);
+      if ((ret = nc_close(ncid)))
+         ERR(ret);
+   }
+   /* Rows of a good record and a bad one close together in a batch
+    * are not read as one; only the bad record fails. */
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS3] = {2, 0, 0};
+      size_t count[SION_NDIMS3] = {1, J_LEN, I_LEN};
+      float row[2][I_LEN];
+      SION_VARA_REQ_T req[2] = {{ncid, varid, {1, J_LEN - 1, 0}, {1, 1, I_LEN},
+                                 row[0]},
+                                {ncid, varid, {2, 0, 0}, {1, 1, I_LEN},
+                                 row[1]}};
+
+      if (nc_get_vara_float(ncid, varid, start, count, data) != NC_EIO)
+         ERR(9);
+      if (SION_get_vara_batch(2, req) != NC_EIO || req[0].status ||
+          req[1].status != NC_EIO)
+         ERR(10);
+      if (row[0][I_LEN - 1] != TST_VAL(1, J_LEN - 1, I_LEN - 1))
+         ERR(11);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+   if ((ret = SION_set_open_flags(0)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
@@ -0,0 +1,71 @@
+/* Test regional grid coordinates of AB files.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_grid.b"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   int ret;
+
+   printf("\nTesting AB format regional grid...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* With a regional grid alongside, plon and plat are coordinate
+    * vars of the data. */
+   if (tst_write_grid("regional.grid.b", J_LEN, I_LEN))
+      ERR(2);
+   if ((ret = SION_set_open_flags(SION_OPEN_GRID)))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS2] = {1, 2};
+      size_t count[SION_NDIMS2] = {J_LEN - 1, 2};
+      double lat[J_LEN * I_LEN];
+      char coords[NC_MAX_NAME + 1];
+      int lat_varid, n = 0;
+
+      if ((ret = nc_inq_varid(ncid, "plat", &lat_varid)))
+         ERR(ret);
+      if ((ret = nc_get_vara_double(ncid, lat_varid, start, count, lat)))
+         ERR(ret);
+      for (int j = 0; j < count[0]; j++)
+         for (int i = 0; i < count[1]; i++)
+            if (lat[n++] != start[0] + j)
+               ERR(3);
+      if ((ret = nc_get_att_text(ncid, varid, "coordinates", coords)) ||
+          strncmp(coords, "plon plat", 9))
+         ERR(4);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+   if ((ret = SION_set_open_flags(0)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
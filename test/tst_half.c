@@ -0,0 +1,119 @@
+/* Test reads of AB files as 16-bit floats.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_half.b"
+#define A_FILE "tst_half.a"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+#define SPECIAL 7
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   int ret;
+
+   printf("\nTesting AB format 16-bit float reads...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* Put a void, two ties, a value too big for a half and three
+    * subnormals at the start of record 1. */
+   {
+      const float val[SPECIAL] = {1.2676506e30f, 2049, 2051, 70000,
+                                  0x1p-20f, 0x3p-26f, -0x1p-25f};
+      uint32_t be[SPECIAL];
+      FILE *f;
+
+      for (int v = 0; v < SPECIAL; v++)
+      {
+         memcpy(&be[v], &val[v], sizeof(float));
+         be[v] = htonl(be[v]);
+      }
+      if (!(f = fopen(A_FILE, "r+b")) ||
+          fseek(f, ab_rec_len(J_LEN, I_LEN), SEEK_SET) ||
+          fwrite(be, sizeof(be), 1, f) != 1 || fclose(f))
+         ERR(2);
+   }
+
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS3] = {0, 1, 0};
+      size_t count[SION_NDIMS3] = {1, 1, 2};
+      uint16_t half[2];
+
+      /* 100 and 101. */
+      if ((ret = SION_get_vara_half(ncid, varid, start, count, SION_HALF_IEEE,
+                                    0, half)))
+         ERR(ret);
+      if (half[0] != 0x5640 || half[1] != 0x5650)
+         ERR(3);
+      if ((ret = SION_get_vara_half(ncid, varid, start, count,
+                                    SION_HALF_BFLOAT16, 0, half)))
+         ERR(ret);
+      if (half[0] != 0x42c8 || half[1] != 0x42ca)
+         ERR(4);
+   }
+   {
+      /* Voids become -1; 2049 and 2051 round to even; 70000 is too
+       * big; the subnormals round, the last to -0. */
+      const uint16_t expect[SPECIAL] = {0xbc00, 0x6800, 0x6802, 0x7c00,
+                                        0x0010, 0x0001, 0x8000};
+      size_t start[SION_NDIMS3] = {1, 0, 0};
+      size_t count[SION_NDIMS3] = {1, 1, I_LEN};
+      uint16_t half[T_LEN * J_LEN * I_LEN];
+
+      /* Part of a row, converted one value at a time. */
+      if ((ret = SION_get_vara_half(ncid, varid, start, count, SION_HALF_IEEE,
+                                    -1, half)))
+         ERR(ret);
+      if (memcmp(half, expect, I_LEN * sizeof(uint16_t)))
+         ERR(5);
+
+      /* Every record at once, converted in vectors where the CPU
+       * can. */
+      start[0] = 0;
+      count[0] = T_LEN;
+      count[1] = J_LEN;
+      if ((ret = SION_get_vara_half(ncid, varid, start, count, SION_HALF_IEEE,
+                                    -1, half)))
+         ERR(ret);
+      if (memcmp(half + J_LEN * I_LEN, expect, sizeof(expect)))
+         ERR(6);
+      if (half[I_LEN + 1] != 0x5650 || half[J_LEN * I_LEN + SPECIAL] != 0x70ef ||
+          half[(T_LEN - 1) * J_LEN * I_LEN] != 0x7753)
+         ERR(7);
+      if ((ret = SION_get_vara_half(ncid, varid, start, count,
+                                    SION_HALF_BFLOAT16, -1, half)))
+         ERR(ret);
+      if (half[J_LEN * I_LEN] != 0xbf80 || half[J_LEN * I_LEN + 3] != 0x4789)
+         ERR(8);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
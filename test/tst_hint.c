@@ -0,0 +1,106 @@
+/* Test access hints for reads of AB files.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_hint.b"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   float data[2][T_LEN * J_LEN * I_LEN];
+   int ret;
+
+   printf("\nTesting AB format access hints...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* Access hints change how reads are done, but not what they
+    * return. */
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS3] = {1, 1, 1};
+      size_t count[SION_NDIMS3] = {T_LEN - 1, 3, 2};
+      size_t served[SION_NSERVED];
+      int hint, n = 0;
+
+      if (SION_set_access_hint(ncid, varid, SION_HINT_SCAN + 1) != NC_EINVAL ||
+          SION_set_access_hint(ncid, 0, SION_HINT_BOX) != NC_EINVAL)
+         ERR(2);
+      if ((ret = SION_set_access_hint(ncid, varid, SION_HINT_BOX)))
+         ERR(ret);
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data[0])))
+         ERR(ret);
+      if ((ret = SION_set_access_hint(ncid, varid, SION_HINT_TIME_SERIES)))
+         ERR(ret);
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data[1])))
+         ERR(ret);
+      for (int t = 0; t < count[0]; t++)
+         for (int j = 0; j < count[1]; j++)
+            for (int i = 0; i < count[2]; i++, n++)
+               if (data[0][n] != TST_VAL(start[0] + t, start[1] + j, start[2] + i) ||
+                   data[1][n] != data[0][n])
+                  ERR(3);
+      if ((ret = SION_inq_read_stats(ncid, varid, &hint, served)))
+         ERR(ret);
+      if (hint != SION_HINT_TIME_SERIES || served[SION_SERVED_SHM] ||
+          served[SION_SERVED_SPANS] != 1 || served[SION_SERVED_ROWS] != 1)
+         ERR(4);
+
+      /* Whole records in no order are read as spans. */
+      if ((ret = SION_set_access_hint(ncid, varid, SION_HINT_RANDOM)))
+         ERR(ret);
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data[1])))
+         ERR(ret);
+      if ((ret = SION_inq_read_stats(ncid, varid, &hint, served)))
+         ERR(ret);
+      if (hint != SION_HINT_RANDOM || served[SION_SERVED_SHM] ||
+          served[SION_SERVED_SPANS] != 2 || served[SION_SERVED_ROWS] != 1 ||
+          memcmp(data[0], data[1], n * sizeof(float)))
+         ERR(7);
+
+      /* Whichever way a read is done, its hyperslab is checked. */
+      for (hint = SION_HINT_NONE; hint <= SION_HINT_SCAN; hint++)
+      {
+         size_t bad_start[SION_NDIMS3] = {T_LEN + 1, 0, 0};
+         size_t bad_count[SION_NDIMS3] = {1, 1, I_LEN};
+
+         if ((ret = SION_set_access_hint(ncid, varid, hint)))
+            ERR(ret);
+         if (nc_get_vara_float(ncid, varid, bad_start, bad_count,
+                               data[0]) != NC_EINVALCOORDS)
+            ERR(5);
+         bad_start[0] = 0;
+         bad_start[2] = 1;
+         if (nc_get_vara_float(ncid, varid, bad_start, bad_count,
+                               data[0]) != NC_EEDGE)
+            ERR(6);
+      }
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
@@ -0,0 +1,95 @@
+/* Test reads of AB files between records.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_interp.b"
+#define A_FILE "tst_interp.a"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   float data[J_LEN * I_LEN];
+   int ret;
+
+   printf("\nTesting AB format reads between records...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* Put a void in record 1 at j 1, i 2. */
+   {
+      const unsigned char big_void[4] = {0x71, 0x80, 0, 0};
+      FILE *f;
+
+      if (!(f = fopen(A_FILE, "r+b")) ||
+          fseek(f, ab_rec_len(J_LEN, I_LEN) + (I_LEN + 2) * sizeof(float),
+                SEEK_SET) ||
+          fwrite(big_void, sizeof(big_void), 1, f) != 1 || fclose(f))
+         ERR(2);
+   }
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS2] = {1, 1};
+      size_t count[SION_NDIMS2] = {J_LEN - 1, I_LEN - 2};
+      const double time[] = {40000.5, 40000.75, 40001.25, 40002, 40003};
+      const float w[] = {0.5, 0.75, 0.25, 0, 0};
+      const int t0[] = {0, 0, 1, 2, 3};
+
+      for (int k = 0; k < sizeof(time) / sizeof(time[0]); k++)
+      {
+         if ((ret = SION_get_vara_time(ncid, varid, time[k], start, count,
+                                       data)))
+            ERR(ret);
+         for (int j = 0, n = 0; j < count[0]; j++)
+            for (int i = 0; i < count[1]; i++, n++)
+            {
+               int jj = start[0] + j, ii = start[1] + i;
+               float expect = (1 - w[k]) * TST_VAL(t0[k], jj, ii) +
+                  w[k] * TST_VAL(t0[k] + 1, jj, ii);
+
+               if (jj == 1 && ii == 2 && (t0[k] == 1 || (t0[k] == 0 && w[k])))
+                  expect = SION_VOID_VALUE;
+               if (fabsf(data[n] - expect) > 1e-3f * fabsf(expect))
+                  ERR(3);
+            }
+      }
+      if (SION_get_vara_time(ncid, varid, 39999.5, start, count,
+                             data) != NC_EINVALCOORDS ||
+          SION_get_vara_time(ncid, varid, 40003.5, start, count,
+                             data) != NC_EINVALCOORDS)
+         ERR(4);
+      if (SION_get_vara_time(ncid, varid, NAN, start, count,
+                             data) != NC_EINVAL)
+         ERR(5);
+      count[1] = I_LEN;
+      if (SION_get_vara_time(ncid, varid, 40001, start, count,
+                             data) != NC_EEDGE)
+         ERR(6);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
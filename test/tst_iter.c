@@ -0,0 +1,118 @@
+/* Test record iterators over AB files.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_iter.b"
+#define NATIVE_FILE "tst_iter_native.b"
+#define A_FILE "tst_iter.a"
+#define NATIVE_A_FILE "tst_iter_native.a"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   float data[J_LEN * I_LEN];
+   int ret;
+
+   printf("\nTesting AB format record iterators...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1) ||
+       tst_write_ab(NATIVE_FILE, T_LEN, J_LEN, I_LEN, 0))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* Iterate over records without copying them, both read and
+    * mapped. */
+   for (int f = 0; f < 2; f++)
+   {
+      SION_ITER_T *iter;
+      const float *rec[2], *none;
+      size_t t;
+
+      if ((ret = nc_open(f ? NATIVE_FILE : TEST_FILE, NC_UF0, &ncid)))
+         ERR(ret);
+      if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+         ERR(ret);
+      if ((ret = SION_iter_open(ncid, varid, 1, T_LEN - 1, &iter)))
+         ERR(ret);
+      if ((ret = SION_iter_next(iter, &t, &rec[0])))
+         ERR(ret);
+      if ((ret = SION_iter_next(iter, NULL, &rec[1])))
+         ERR(ret);
+      if (t != 1 || rec[0][J_LEN * I_LEN - 1] != TST_VAL(1, J_LEN - 1, I_LEN - 1) ||
+          rec[1][I_LEN + 2] != TST_VAL(2, 1, 2))
+         ERR(2);
+      if (SION_iter_next(iter, NULL, &none) != NC_EINVAL ||
+          SION_iter_release(iter, data) != NC_EINVAL)
+         ERR(3);
+      if ((ret = SION_iter_release(iter, rec[0])))
+         ERR(ret);
+      if ((ret = SION_iter_next(iter, &t, &rec[0])))
+         ERR(ret);
+      if (t != T_LEN - 1 || rec[0][0] != TST_VAL(T_LEN - 1, 0, 0))
+         ERR(4);
+      if ((ret = SION_iter_next(iter, NULL, &rec[0])) || rec[0])
+         ERR(5);
+      if ((ret = SION_iter_close(iter)))
+         ERR(ret);
+      if ((ret = nc_close(ncid)))
+         ERR(ret);
+   }
+
+   /* A record that fails to read fails again when asked for again;
+    * it is not skipped. Verified files are read rather than mapped,
+    * so this holds in host byte order too. */
+   for (int f = 0; f < 2; f++)
+   {
+      SION_ITER_T *iter;
+      const float *rec;
+      FILE *fp;
+      size_t t;
+      int c;
+
+      if ((ret = SION_build_checksums(f ? NATIVE_FILE : TEST_FILE)))
+         ERR(ret);
+      if (!(fp = fopen(f ? NATIVE_A_FILE : A_FILE, "r+b")) ||
+          fseek(fp, ab_rec_len(J_LEN, I_LEN) + 9, SEEK_SET) ||
+          (c = fgetc(fp)) == EOF || fseek(fp, -1, SEEK_CUR) ||
+          fputc(c ^ 0x10, fp) == EOF || fclose(fp))
+         ERR(6);
+      if ((ret = SION_set_open_flags(SION_OPEN_VERIFY)))
+         ERR(ret);
+      if ((ret = nc_open(f ? NATIVE_FILE : TEST_FILE, NC_UF0, &ncid)))
+         ERR(ret);
+      if ((ret = SION_iter_open(ncid, varid, 0, T_LEN, &iter)))
+         ERR(ret);
+      if ((ret = SION_iter_next(iter, &t, &rec)) || t)
+         ERR(7);
+      if ((ret = SION_iter_release(iter, rec)))
+         ERR(ret);
+      for (int k = 0; k < 2; k++)
+         if (SION_iter_next(iter, &t, &rec) != NC_EIO)
+            ERR(8);
+      if ((ret = SION_iter_close(iter)))
+         ERR(ret);
+      if ((ret = nc_close(ncid)))
+         ERR(ret);
+      if ((ret = SION_set_open_flags(0)))
+         ERR(ret);
+   }
+
+   printf("SUCCESS!\n");
+   return 0;
+}
@@ -0,0 +1,85 @@
+/* Test AB files opened from memory.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_mem.b"
+#define A_FILE "tst_mem.a"
+#define MEM_NAME "tst_mem_copy.b"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   float data[T_LEN * J_LEN * I_LEN];
+   float day[T_LEN];
+   int ret;
+
+   printf("\nTesting AB format opened from memory...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* Open a copy of a file held in memory, with no file behind it. */
+   {
+      void *b_data, *a_data;
+      size_t b_size, a_size;
+      size_t start[SION_NDIMS3] = {2, 1, 3};
+      size_t count[SION_NDIMS3] = {2, J_LEN - 1, 2};
+      size_t tstart = 0, tcount = T_LEN;
+      SION_ITER_T *iter;
+      const float *rec;
+      int n = 0;
+
+      if (tst_read_file(TEST_FILE, &b_data, &b_size) ||
+          tst_read_file(A_FILE, &a_data, &a_size))
+         ERR(2);
+      if ((ret = SION_open_mem(MEM_NAME, NC_UF0, b_data, b_size, a_data,
+                               a_size, &ncid)))
+         ERR(ret);
+      if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+         ERR(ret);
+      if ((ret = nc_get_vara_float(ncid, 0, &tstart, &tcount, day)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN; t++)
+         if (day[t] != 40000.0 + t)
+            ERR(3);
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+      for (int t = 0; t < count[0]; t++)
+         for (int j = 0; j < count[1]; j++)
+            for (int i = 0; i < count[2]; i++)
+               if (data[n++] != TST_VAL(start[0] + t, start[1] + j,
+                                        start[2] + i))
+                  ERR(4);
+      if ((ret = SION_iter_open(ncid, varid, T_LEN - 1, 1, &iter)))
+         ERR(ret);
+      if ((ret = SION_iter_next(iter, NULL, &rec)) ||
+          rec[0] != TST_VAL(T_LEN - 1, 0, 0))
+         ERR(5);
+      if ((ret = SION_iter_close(iter)))
+         ERR(ret);
+      if ((ret = nc_close(ncid)))
+         ERR(ret);
+      free(a_data);
+      free(b_data);
+   }
+
+   printf("SUCCESS!\n");
+   return 0;
+}
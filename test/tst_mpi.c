@@ -0,0 +1,142 @@
+/* Test parallel read of AB files with netCDF and MPI.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <mpi.h>
+#include <netcdf.h>
+#include <netcdf_par.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_mpi.b"
+#define T_LEN 6
+#define ROWS 3
+#define I_LEN 11
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); \
+      MPI_Abort(MPI_COMM_WORLD, 1); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main(int argc, char **argv)
+{
+   int rank, size, j_len, provided;
+   int ncid, varid;
+   float *data;
+   int ret;
+
+   /* Async reads work at any thread level; with less than
+    * MPI_THREAD_MULTIPLE they are done at once. */
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+   MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+   /* Each rank gets its own rows of every record. */
+   j_len = ROWS * size;
+   if (!rank)
+      printf("\nTesting parallel AB reads on %d ranks...", size);
+   if (!rank && tst_write_ab(TEST_FILE, T_LEN, j_len, I_LEN, 1))
+      ERR(1);
+   MPI_Barrier(MPI_COMM_WORLD);
+   if (!(data = malloc(T_LEN * ROWS * I_LEN * sizeof(float))))
+      ERR(2);
+
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+   if ((ret = nc_open_par(TEST_FILE, NC_UF0|NC_MPIIO, MPI_COMM_WORLD,
+                          MPI_INFO_NULL, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+
+   /* Every rank sees the same metadata. */
+   {
+      size_t len;
+      float time;
+      size_t idx = T_LEN - 1;
+
+      if ((ret = nc_inq_dimlen(ncid, 1, &len)) || len != j_len)
+         ERR(3);
+      if ((ret = nc_get_var1_float(ncid, 0, &idx, &time)))
+         ERR(ret);
+   }
+
+   /* An independent read of one record, by each rank. */
+   {
+      size_t start[SION_NDIMS3] = {rank % T_LEN, 0, 0};
+      size_t count[SION_NDIMS3] = {1, ROWS, I_LEN};
+      int n = 0;
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+      for (int j = 0; j < ROWS; j++)
+         for (int i = 0; i < I_LEN; i++)
+            if (data[n++] != TST_VAL(rank % T_LEN, j, i))
+               ERR(4);
+   }
+
+   /* An async read of another record, by each rank. */
+   {
+      size_t start[SION_NDIMS3] = {(rank + 1) % T_LEN, 0, 0};
+      size_t count[SION_NDIMS3] = {1, ROWS, I_LEN};
+      int req, n = 0;
+
+      if ((ret = SION_iget_vara(ncid, varid, start, count, data, &req)))
+         ERR(ret);
+      if ((ret = SION_wait(req)))
+         ERR(ret);
+      for (int j = 0; j < ROWS; j++)
+         for (int i = 0; i < I_LEN; i++)
+            if (data[n++] != TST_VAL(start[0], j, i))
+               ERR(8);
+   }
+
+   /* Collective reads: each rank its own rows of all records, then
+    * a box read by rank 0 alone while the others read nothing. */
+   if ((ret = nc_var_par_access(ncid, varid, NC_COLLECTIVE)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS3] = {0, rank * ROWS, 0};
+      size_t count[SION_NDIMS3] = {T_LEN, ROWS, I_LEN};
+      int n = 0;
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN; t++)
+         for (int j = rank * ROWS; j < (rank + 1) * ROWS; j++)
+            for (int i = 0; i < I_LEN; i++)
+               if (data[n++] != TST_VAL(t, j, i))
+                  ERR(5);
+   }
+   {
+      size_t start[SION_NDIMS3] = {2, 1, 4};
+      size_t count[SION_NDIMS3] = {rank ? 0 : 3, 2, 5};
+      int n = 0;
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+      for (int t = 2; t < 2 + count[0]; t++)
+         for (int j = 1; j < 3; j++)
+            for (int i = 4; i < 9; i++)
+               if (data[n++] != TST_VAL(t, j, i))
+                  ERR(6);
+   }
+
+   /* Appended records can't be picked up in parallel. */
+   if (SION_refresh(ncid, NULL) != NC_EINVAL)
+      ERR(7);
+
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+   free(data);
+
+   if (!rank)
+      printf("SUCCESS!\n");
+   MPI_Finalize();
+   return 0;
+}
@@ -0,0 +1,68 @@
+/* Test overview levels of AB files.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_ovr.b"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   float day[T_LEN];
+   int ret;
+
+   printf("\nTesting AB format overview levels...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* Overview levels: block means, down to a single point. */
+   if ((ret = SION_build_overviews(TEST_FILE, SION_OVR_MAX_LEVELS)))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS3] = {1, 0, 0};
+      size_t count[SION_NDIMS3] = {T_LEN - 1, 1, 1};
+      size_t j_len, i_len;
+      int nlevels;
+
+      if ((ret = SION_inq_level(ncid, 1, &nlevels, NULL, &j_len, &i_len)))
+         ERR(ret);
+      if (nlevels != 3 || j_len != (J_LEN + 1) / 2 || i_len != (I_LEN + 1) / 2)
+         ERR(2);
+      if ((ret = SION_get_vara_level(ncid, varid, 1, start, count, day)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN - 1; t++)
+         if (day[t] != TST_VAL(t + 1, 0, 0) + 50.5)
+            ERR(3);
+      if ((ret = SION_get_vara_level(ncid, varid, 3, start, count, day)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN - 1; t++)
+         if (day[t] != TST_VAL(t + 1, 0, 0) + 252)
+            ERR(4);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
@@ -0,0 +1,117 @@
+/* Test time reductions of AB files.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_reduce.b"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   float data[SION_NSTATS][J_LEN * I_LEN];
+   int ret;
+
+   printf("\nTesting AB format time reductions...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* Time mean, min and max over windows of two records. */
+   if ((ret = SION_set_reduce_window(2)))
+      ERR(ret);
+   if ((ret = SION_set_open_flags(SION_OPEN_REDUCE)))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS3] = {1, 1, 0};
+      size_t count[SION_NDIMS3] = {1, J_LEN - 1, I_LEN};
+      size_t nwin;
+      int mean_varid, n = 0;
+
+      if ((ret = nc_inq_varid(ncid, TST_VAR_NAME "_mean", &mean_varid)))
+         ERR(ret);
+      if ((ret = nc_inq_dimlen(ncid, 3, &nwin)) || nwin != T_LEN / 2)
+         ERR(2);
+      for (int s = 0; s < SION_NSTATS; s++)
+      {
+         if ((ret = nc_get_vara_float(ncid, mean_varid + s, start, count,
+                                      data[s])))
+            ERR(ret);
+      }
+      for (int j = 0; j < count[1]; j++)
+         for (int i = 0; i < count[2]; i++, n++)
+         {
+            float lo = TST_VAL(2, start[1] + j, i), hi = TST_VAL(3, start[1] + j, i);
+
+            if (data[SION_STAT_MEAN][n] != (lo + hi) / 2)
+               ERR(3);
+            if (data[SION_STAT_MIN][n] != lo || data[SION_STAT_MAX][n] != hi)
+               ERR(4);
+         }
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   /* A short last window is worked out again when a refresh adds
+    * records to it, and new windows are added. */
+   if (tst_write_ab(TEST_FILE, T_LEN - 1, J_LEN, I_LEN, 1))
+      ERR(5);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   {
+      size_t start[SION_NDIMS3] = {1, 0, 0};
+      size_t count[SION_NDIMS3] = {1, J_LEN, I_LEN};
+      size_t nwin;
+      int mean_varid;
+
+      if ((ret = nc_inq_varid(ncid, TST_VAR_NAME "_mean", &mean_varid)))
+         ERR(ret);
+      if ((ret = nc_get_vara_float(ncid, mean_varid, start, count, data[0])))
+         ERR(ret);
+      if (data[0][J_LEN * I_LEN - 1] != TST_VAL(2, J_LEN - 1, I_LEN - 1))
+         ERR(6);
+      if (tst_write_ab(TEST_FILE, T_LEN + 1, J_LEN, I_LEN, 1))
+         ERR(7);
+      if ((ret = SION_refresh(ncid, NULL)))
+         ERR(ret);
+      if ((ret = nc_inq_dimlen(ncid, 3, &nwin)) || nwin != T_LEN / 2 + 1)
+         ERR(8);
+      count[0] = 2;
+      if ((ret = nc_get_vara_float(ncid, mean_varid, start, count, data[0])))
+         ERR(ret);
+      for (int w = 0; w < 2; w++)
+      {
+         float lo = TST_VAL(2 + 2 * w, J_LEN - 1, I_LEN - 1);
+         float hi = w ? lo : TST_VAL(3, J_LEN - 1, I_LEN - 1);
+
+         if (data[0][(w + 1) * J_LEN * I_LEN - 1] != (lo + hi) / 2)
+            ERR(9);
+      }
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+   if ((ret = SION_set_open_flags(0)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
@@ -0,0 +1,68 @@
+/* Test refresh of AB files that grow while open.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_refresh.b"
+#define T_LEN 4
+#define J_LEN 6
+#define I_LEN 5
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+int
+main()
+{
+   int ncid, varid;
+   float data[J_LEN * I_LEN];
+   float day[T_LEN];
+   int ret;
+
+   printf("\nTesting AB format refresh...");
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+
+   /* A file that grows while open picks up the new records on
+    * refresh. */
+   if (tst_write_ab(TEST_FILE, T_LEN - 1, J_LEN, I_LEN, 1))
+      ERR(1);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+   {
+      size_t t_len, start[SION_NDIMS3] = {T_LEN - 1, 2, 3};
+      size_t count[SION_NDIMS3] = {1, 1, 1};
+
+      if ((ret = nc_get_att_float(ncid, varid, TIME_NAME, day)))
+         ERR(ret);
+      if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+         ERR(2);
+      if ((ret = SION_refresh(ncid, &t_len)) || t_len != T_LEN)
+         ERR(3);
+      if ((ret = nc_inq_dimlen(ncid, 0, &t_len)) || t_len != T_LEN)
+         ERR(4);
+      if ((ret = nc_get_att_float(ncid, varid, TIME_NAME, day)))
+         ERR(ret);
+      if (day[T_LEN - 1] != 40000.0 + T_LEN - 1)
+         ERR(5);
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+      if (data[0] != TST_VAL(T_LEN - 1, 2, 3))
+         ERR(6);
+   }
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
@@ -0,0 +1,132 @@
+/* Helpers for the AB dispatch layer tests. These write small AB
+* files with known contents, so the tests do not need data files.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "tst_utils.h"
+
+#define PAD 4096
+
+/* Write an AB pair. The B file is b_path, the A file has the same
+ * name ending in .a. Values are TST_VAL(t, j, i). Returns 0 on
+ * success. */
+int
+tst_write_ab(const char *b_path, int t_len, int j_len, int i_len,
+             int big_endian)
+{
+   FILE *a, *b;
+   char a_path[256];
+   size_t nwords = ((size_t)j_len * i_len + PAD - 1) / PAD * PAD;
+   uint32_t *rec;
+
+   strcpy(a_path, b_path);
+   a_path[strlen(a_path) - 1] = 'a';
+   if (!(a = fopen(a_path, "w")) || !(b = fopen(b_path, "w")))
+      return 1;
+   if (!(rec = calloc(nwords, sizeof(uint32_t))))
+      return 1;
+
+   fprintf(b, "Test AB file for netCDF AB dispatch layer\n");
+   fprintf(b, "Written by tst_utils.c\n");
+   fprintf(b, "\n");
+   fprintf(b, "i/jdm =  %d %d\n", i_len, j_len);
+   for (int t = 0; t < t_len; t++)
+   {
+      for (int j = 0; j < j_len; j++)
+         for (int i = 0; i < i_len; i++)
+         {
+            float f = TST_VAL(t, j, i);
+            uint32_t u;
+
+            memcpy(&u, &f, sizeof(u));
+            rec[j * i_len + i] = big_endian ? htonl(u) : u;
+         }
+      if (fwrite(rec, sizeof(uint32_t), nwords, a) != nwords)
+         return 1;
+      fprintf(b, "%s: day,span,range =  %f  %f  %f  %f\n", TST_VAR_NAME,
+              40000.0 + t, 1.0, TST_VAL(t, 0, 0),
+              TST_VAL(t, j_len - 1, i_len - 1));
+   }
+
+   free(rec);
+   fclose(a);
+   fclose(b);
+   return 0;
+}
+
+/* Write a regional grid AB pair, with plon = i and plat = j at each
+ * point. Returns 0 on success. */
+int
+tst_write_grid(const char *b_path, int j_len, int i_len)
+{
+   FILE *a, *b;
+   char a_path[256];
+   size_t nwords = ((size_t)j_len * i_len + PAD - 1) / PAD * PAD;
+   const char *name[2] = {"plon", "plat"};
+   uint32_t *rec;
+
+   strcpy(a_path, b_path);
+   a_path[strlen(a_path) - 1] = 'a';
+   if (!(a = fopen(a_path, "w")) || !(b = fopen(b_path, "w")))
+      return 1;
+   if (!(rec = calloc(nwords, sizeof(uint32_t))))
+      return 1;
+
+   fprintf(b, "%5d    'idm   ' = longitudinal array size\n", i_len);
+   fprintf(b, "%5d    'jdm   ' = latitudinal  array size\n", j_len);
+   fprintf(b, "    0    'mapflg' = map flag (0=mercator,10=panam,12=ulon-panam)\n");
+   for (int f = 0; f < 2; f++)
+   {
+      for (int j = 0; j < j_len; j++)
+         for (int i = 0; i < i_len; i++)
+         {
+            float v = f ? j : i;
+            uint32_t u;
+
+            memcpy(&u, &v, sizeof(u));
+            rec[j * i_len + i] = htonl(u);
+         }
+      if (fwrite(rec, sizeof(uint32_t), nwords, a) != nwords)
+         return 1;
+      fprintf(b, "%s:  min,max = %14.5f %14.5f\n", name[f], 0.0,
+              (double)(f ? j_len - 1 : i_len - 1));
+   }
+
+   free(rec);
+   fclose(a);
+   fclose(b);
+   return 0;
+}
+
+/* Read a whole file into memory, which the caller frees. Returns 0
+ * on success. */
+int
+tst_read_file(const char *path, void **datap, size_t *sizep)
+{
+   FILE *f;
+   long len;
+
+   if (!(f = fopen(path, "r")))
+      return 1;
+   if (fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) ||
+       !(*datap = malloc(len ? len : 1)))
+   {
+      fclose(f);
+      return 1;
+   }
+   if (fread(*datap, 1, len, f) != (size_t)len)
+   {
+      free(*datap);
+      fclose(f);
+      return 1;
+   }
+   *sizep = len;
+   fclose(f);
+   return 0;
+}
@@ -0,0 +1,20 @@
+/* Helpers for the AB dispatch layer tests.
+*
+* Ed Hartnett */
+
+#ifndef _TST_UTILS_H
+#define _TST_UTILS_H
+
+#include <stddef.h>
+
+#define TST_VAR_NAME "surtmp"
+
+/* Value stored at each point of the test files. */
+#define TST_VAL(t, j, i) ((float)((t) * 10000 + (j) * 100 + (i)))
+
+extern int tst_write_ab(const char *b_path, int t_len, int j_len, int i_len,
+                        int big_endian);
+extern int tst_write_grid(const char *b_path, int j_len, int i_len);
+extern int tst_read_file(const char *path, void **datap, size_t *sizep);
+
+#endif /* _TST_UTILS_H */
@@ -0,0 +1,135 @@
+/* Test read of seekable zstd compressed AB files with netCDF.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <nc4dispatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zstd.h>
+#include "tst_utils.h"
+
+#define TEST_FILE "tst_zstd.b"
+#define A_FILE "tst_zstd.a"
+#define Z_FILE "tst_zstd.a.zst"
+#define T_LEN 20
+#define J_LEN 7
+#define I_LEN 9
+
+#define ERR(r) do {printf("Error %d at line %d\n", (r), __LINE__); return 1;} while (0)
+
+extern NC_Dispatch SION_dispatcher;
+
+/* Write a little-endian 32-bit value. */
+static void
+put_le32(FILE *f, unsigned int v)
+{
+   unsigned char b[4] = {v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24};
+   fwrite(b, 1, 4, f);
+}
+
+/* Compress the A file into the seekable format, one frame per
+ * record, and remove the A file. */
+static int
+compress_a_file(size_t rec_len, int nrec)
+{
+   FILE *a, *z;
+   char *rec, *frame;
+   size_t bound = ZSTD_compressBound(rec_len);
+   unsigned int c_len[T_LEN];
+
+   if (!(a = fopen(A_FILE, "r")) || !(z = fopen(Z_FILE, "w")))
+      return 1;
+   if (!(rec = malloc(rec_len)) || !(frame = malloc(bound)))
+      return 1;
+   for (int r = 0; r < nrec; r++)
+   {
+      size_t n;
+
+      if (fread(rec, 1, rec_len, a) != rec_len)
+         return 1;
+      n = ZSTD_compress(frame, bound, rec, rec_len, 3);
+      if (ZSTD_isError(n) || fwrite(frame, 1, n, z) != n)
+         return 1;
+      c_len[r] = n;
+   }
+
+   /* The seek table, in a skippable frame, then the footer. */
+   put_le32(z, 0x184D2A5E);
+   put_le32(z, nrec * 8 + 9);
+   for (int r = 0; r < nrec; r++)
+   {
+      put_le32(z, c_len[r]);
+      put_le32(z, rec_len);
+   }
+   put_le32(z, nrec);
+   fputc(0, z);
+   put_le32(z, 0x8F92EAB1);
+
+   free(rec);
+   free(frame);
+   fclose(a);
+   fclose(z);
+   return unlink(A_FILE);
+}
+
+int
+main()
+{
+   int ncid, varid;
+   float *data;
+   int ret;
+
+   printf("\nTesting seekable zstd AB files...");
+   if (tst_write_ab(TEST_FILE, T_LEN, J_LEN, I_LEN, 1))
+      ERR(1);
+   if (compress_a_file(ab_rec_len(J_LEN, I_LEN), T_LEN))
+      ERR(2);
+   if (!(data = malloc(T_LEN * J_LEN * I_LEN * sizeof(float))))
+      ERR(3);
+
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)))
+      ERR(ret);
+   if ((ret = nc_open(TEST_FILE, NC_UF0, &ncid)))
+      ERR(ret);
+   if ((ret = nc_inq_varid(ncid, TST_VAR_NAME, &varid)))
+      ERR(ret);
+
+   /* One record, then a box through all records, which is more
+    * frames than the cache holds. */
+   {
+      size_t start[SION_NDIMS3] = {5, 0, 0};
+      size_t count[SION_NDIMS3] = {1, J_LEN, I_LEN};
+      int n = 0;
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+      for (int j = 0; j < J_LEN; j++)
+         for (int i = 0; i < I_LEN; i++)
+            if (data[n++] != TST_VAL(5, j, i))
+               ERR(4);
+   }
+   {
+      size_t start[SION_NDIMS3] = {0, 2, 3};
+      size_t count[SION_NDIMS3] = {T_LEN, 3, 4};
+      int n = 0;
+
+      if ((ret = nc_get_vara_float(ncid, varid, start, count, data)))
+         ERR(ret);
+      for (int t = 0; t < T_LEN; t++)
+         for (int j = 2; j < 5; j++)
+            for (int i = 3; i < 7; i++)
+               if (data[n++] != TST_VAL(t, j, i))
+                  ERR(5);
+   }
+
+   if ((ret = nc_close(ncid)))
+      ERR(ret);
+   free(data);
+
+   printf("SUCCESS!\n");
+   return 0;
+}
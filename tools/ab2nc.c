@@ -0,0 +1,599 @@
+/* ab2nc converts an AB file to a compressed netCDF-4 file, reading it
+* through the AB dispatch layer.
+*
+* The data var is converted by a pipeline of three stages, joined by
+* bounded queues: a reader thread reads and decodes each record and
+* cuts it into chunks, a pool of threads deflates the chunks, and the
+* main thread writes them into the file with HDF5 direct chunk
+* writes. So deflate, which is most of the work, runs on all cores,
+* and no more than a few records are held at once.
+*
+* The file is first defined with netCDF, with all dims, vars and
+* attributes of the AB file, and the other vars written. It is then
+* reopened with HDF5 for the chunks of the data var. Data voids become
+* the default netCDF fill value, which is set as _FillValue.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <hdf5.h>
+
+#define USAGE "Usage: ab2nc [-d level] [-r rows] [-n threads] file.b file.nc\n" \
+   "  -d  Deflate level, 1 to 9. Default is 1.\n" \
+   "  -r  Rows in each chunk. Default is about 1 MB of rows.\n" \
+   "  -n  Number of deflate threads. Default is one per CPU.\n"
+
+/* Default deflate level. */
+#define DEFAULT_LEVEL 1
+
+/* Default chunk size in bytes. */
+#define CHUNK_BYTES (1 << 20)
+
+/* Most deflate threads. */
+#define MAX_THREADS 64
+
+/* Chunks waiting in each queue, for each deflate thread. */
+#define QUEUE_PER_THREAD 2
+
+/* A record, shared by the chunks cut from it. */
+typedef struct REC
+{
+   float *data;
+   int refs; /* Chunks not yet deflated. */
+} REC_T;
+
+/* A chunk on its way through the pipeline. */
+typedef struct JOB
+{
+   size_t t; /* Record. */
+   size_t band; /* Band of rows in the record. */
+   REC_T *rec;
+   void *zbuf; /* Deflated chunk. */
+   size_t zlen;
+} JOB_T;
+
+/* A bounded queue of jobs. */
+typedef struct QUEUE
+{
+   JOB_T **job;
+   int cap;
+   int head;
+   int len;
+   int closed; /* No more jobs will be pushed. */
+   pthread_mutex_t lock;
+   pthread_cond_t not_full;
+   pthread_cond_t not_empty;
+} QUEUE_T;
+
+/* The conversion of the data var. */
+typedef struct CONV
+{
+   int ncid; /* The AB file. */
+   int varid; /* The data var. */
+   size_t dim_len[SION_NDIMS3];
+   size_t rows; /* Rows in each chunk. */
+   size_t nbands; /* Chunks in each record. */
+   int level;
+   int nthreads;
+   int running; /* Deflate threads not yet done. */
+   QUEUE_T read_q; /* Chunks to deflate. */
+   QUEUE_T write_q; /* Chunks to write. */
+   int status; /* First error of any stage. */
+   pthread_mutex_t lock; /* Protects running and status. */
+} CONV_T;
+
+extern NC_Dispatch SION_dispatcher;
+
+/* Set up a queue that holds cap jobs. */
+static int
+queue_init(QUEUE_T *q, int cap)
+{
+   memset(q, 0, sizeof(QUEUE_T));
+   if (!(q->job = malloc(cap * sizeof(JOB_T *))))
+      return NC_ENOMEM;
+   q->cap = cap;
+   pthread_mutex_init(&q->lock, NULL);
+   pthread_cond_init(&q->not_full, NULL);
+   pthread_cond_init(&q->not_empty, NULL);
+   return NC_NOERR;
+}
+
+/* Free a queue. */
+static void
+queue_free(QUEUE_T *q)
+{
+   pthread_cond_destroy(&q->not_empty);
+   pthread_cond_destroy(&q->not_full);
+   pthread_mutex_destroy(&q->lock);
+   free(q->job);
+}
+
+/* Add a job, waiting while the queue is full. */
+static void
+queue_push(QUEUE_T *q, JOB_T *job)
+{
+   pthread_mutex_lock(&q->lock);
+   while (q->len == q->cap)
+      pthread_cond_wait(&q->not_full, &q->lock);
+   q->job[(q->head + q->len++) % q->cap] = job;
+   pthread_cond_signal(&q->not_empty);
+   pthread_mutex_unlock(&q->lock);
+}
+
+/* Take a job, waiting while the queue is empty. Returns NULL once the
+ * queue is closed and empty. */
+static JOB_T *
+queue_pop(QUEUE_T *q)
+{
+   JOB_T *job = NULL;
+
+   pthread_mutex_lock(&q->lock);
+   while (!q->len && !q->closed)
+      pthread_cond_wait(&q->not_empty, &q->lock);
+   if (q->len)
+   {
+      job = q->job[q->head];
+      q->head = (q->head + 1) % q->cap;
+      q->len--;
+      pthread_cond_signal(&q->not_full);
+   }
+   pthread_mutex_unlock(&q->lock);
+   return job;
+}
+
+/* Say no more jobs are coming. */
+static void
+queue_close(QUEUE_T *q)
+{
+   pthread_mutex_lock(&q->lock);
+   q->closed++;
+   pthread_cond_broadcast(&q->not_empty);
+   pthread_mutex_unlock(&q->lock);
+}
+
+/* Free the jobs left in a queue until it is closed. */
+static void
+drop_jobs(QUEUE_T *q)
+{
+   JOB_T *job;
+
+   while ((job = queue_pop(q)))
+   {
+      if (!__atomic_sub_fetch(&job->rec->refs, 1, __ATOMIC_ACQ_REL))
+      {
+         free(job->rec->data);
+         free(job->rec);
+      }
+      free(job);
+   }
+}
+
+/* Remember the first error of any stage. */
+static void
+set_status(CONV_T *c, int ret)
+{
+   pthread_mutex_lock(&c->lock);
+   if (!c->status)
+      c->status = ret;
+   pthread_mutex_unlock(&c->lock);
+}
+
+/* Get the first error of any stage. */
+static int
+get_status(CONV_T *c)
+{
+   int ret;
+
+   pthread_mutex_lock(&c->lock);
+   ret = c->status;
+   pthread_mutex_unlock(&c->lock);
+   return ret;
+}
+
+/* Stage 1: read each record, turn voids into fill values, and queue
+ * its chunks for deflate. */
+static void *
+reader(void *arg)
+{
+   CONV_T *c = arg;
+   size_t n = c->dim_len[1] * c->dim_len[2];
+   int ret = NC_NOERR;
+
+   for (size_t t = 0; !ret && t < c->dim_len[0] && !get_status(c); t++)
+   {
+      size_t start[SION_NDIMS3] = {t, 0, 0};
+      size_t count[SION_NDIMS3] = {1, c->dim_len[1], c->dim_len[2]};
+      REC_T *rec;
+
+      if (!(rec = calloc(1, sizeof(REC_T))) ||
+          !(rec->data = malloc(n * sizeof(float))))
+      {
+         free(rec);
+         ret = NC_ENOMEM;
+         break;
+      }
+      if ((ret = nc_get_vara_float(c->ncid, c->varid, start, count, rec->data)))
+      {
+         free(rec->data);
+         free(rec);
+         break;
+      }
+      for (size_t v = 0; v < n; v++)
+         if (fabsf(rec->data[v]) >= SION_VOID)
+            rec->data[v] = NC_FILL_FLOAT;
+
+      rec->refs = c->nbands;
+      for (size_t b = 0; b < c->nbands; b++)
+      {
+         JOB_T *job;
+
+         if (!(job = calloc(1, sizeof(JOB_T))))
+         {
+            /* The chunks not queued will not be deflated. */
+            if (!__atomic_sub_fetch(&rec->refs, c->nbands - b, __ATOMIC_ACQ_REL))
+            {
+               free(rec->data);
+               free(rec);
+            }
+            ret = NC_ENOMEM;
+            break;
+         }
+         job->t = t;
+         job->band = b;
+         job->rec = rec;
+         queue_push(&c->read_q, job);
+      }
+   }
+   if (ret)
+      set_status(c, ret);
+   queue_close(&c->read_q);
+   return NULL;
+}
+
+/* Stage 2: deflate chunks, and queue them to be written. */
+static void *
+deflater(void *arg)
+{
+   CONV_T *c = arg;
+   size_t row_len = c->dim_len[2] * sizeof(float);
+   size_t chunk_len = c->rows * row_len;
+   float *pad;
+   JOB_T *job;
+   int ret = NC_NOERR;
+
+   /* Chunks at the end of the j dim are padded with fill values. */
+   if (!(pad = malloc(chunk_len)))
+      ret = NC_ENOMEM;
+   for (size_t v = 0; pad && v < c->rows * c->dim_len[2]; v++)
+      pad[v] = NC_FILL_FLOAT;
+
+   while ((job = queue_pop(&c->read_q)))
+   {
+      size_t j0 = job->band * c->rows;
+      size_t nrows = c->dim_len[1] - j0 < c->rows ? c->dim_len[1] - j0 : c->rows;
+      const Bytef *src = (const Bytef *)(job->rec->data + j0 * c->dim_len[2]);
+      uLongf zlen = compressBound(chunk_len);
+
+      if (!ret && !get_status(c))
+      {
+         if (nrows < c->rows)
+         {
+            memcpy(pad, src, nrows * row_len);
+            src = (const Bytef *)pad;
+         }
+         if (!(job->zbuf = malloc(zlen)))
+            ret = NC_ENOMEM;
+         else if (compress2(job->zbuf, &zlen, src, chunk_len, c->level) != Z_OK)
+            ret = NC_EINVAL;
+         job->zlen = zlen;
+      }
+      if (!__atomic_sub_fetch(&job->rec->refs, 1, __ATOMIC_ACQ_REL))
+      {
+         free(job->rec->data);
+         free(job->rec);
+      }
+      job->rec = NULL;
+      queue_push(&c->write_q, job);
+   }
+   free(pad);
+   if (ret)
+      set_status(c, ret);
+
+   /* The last deflate thread to finish ends the write queue. */
+   pthread_mutex_lock(&c->lock);
+   if (!--c->running)
+      queue_close(&c->write_q);
+   pthread_mutex_unlock(&c->lock);
+   return NULL;
+}
+
+/* Stage 3, on the calling thread: write each chunk as it comes. */
+static int
+write_chunks(CONV_T *c, hid_t dsid)
+{
+   JOB_T *job;
+
+   while ((job = queue_pop(&c->write_q)))
+   {
+      hsize_t offset[SION_NDIMS3] = {job->t, job->band * c->rows, 0};
+
+      if (job->zbuf && !get_status(c) &&
+          H5Dwrite_chunk(dsid, H5P_DEFAULT, 0, offset, job->zlen, job->zbuf) < 0)
+         set_status(c, NC_EHDFERR);
+      free(job->zbuf);
+      free(job);
+   }
+   return get_status(c);
+}
+
+/* Copy all attributes of a var, or the global ones. */
+static int
+copy_atts(int ncid, int varid, int out_ncid, int out_varid)
+{
+   char name[NC_MAX_NAME + 1];
+   int natts;
+   int ret;
+
+   if ((ret = nc_inq_varnatts(ncid, varid, &natts)))
+      return ret;
+   for (int a = 0; a < natts; a++)
+      if ((ret = nc_inq_attname(ncid, varid, a, name)) ||
+          (ret = nc_copy_att(ncid, varid, name, out_ncid, out_varid)))
+         return ret;
+   return NC_NOERR;
+}
+
+/* Define the netCDF-4 file: all dims, vars and atts of the AB file,
+ * the data var chunked and deflated. Copy the other vars. */
+static int
+define_file(CONV_T *c, const char *out_path)
+{
+   char name[NC_MAX_NAME + 1];
+   int out_ncid, nvars, ndims;
+   int ret;
+
+   if ((ret = nc_create(out_path, NC_NETCDF4|NC_CLOBBER, &out_ncid)))
+      return ret;
+   if ((ret = nc_inq_ndims(c->ncid, &ndims)))
+      goto exit;
+   for (int d = 0; d < ndims; d++)
+   {
+      size_t len;
+      int dimid;
+
+      if ((ret = nc_inq_dim(c->ncid, d, name, &len)) ||
+          (ret = nc_def_dim(out_ncid, name, len, &dimid)))
+         goto exit;
+   }
+   if ((ret = copy_atts(c->ncid, NC_GLOBAL, out_ncid, NC_GLOBAL)) ||
+       (ret = nc_inq_nvars(c->ncid, &nvars)))
+      goto exit;
+   for (int v = 0; v < nvars; v++)
+   {
+      nc_type xtype;
+      int dimids[NC_MAX_VAR_DIMS];
+      int var_ndims, varid;
+
+      if ((ret = nc_inq_var(c->ncid, v, name, &xtype, &var_ndims, dimids, NULL)) ||
+          (ret = nc_def_var(out_ncid, name, xtype, var_ndims, dimids, &varid)) ||
+          (ret = copy_atts(c->ncid, v, out_ncid, varid)))
+         goto exit;
+      if (v == c->varid)
+      {
+         size_t chunks[SION_NDIMS3] = {1, c->rows, c->dim_len[2]};
+         float fill = NC_FILL_FLOAT;
+
+         if ((ret = nc_def_var_chunking(out_ncid, varid, NC_CHUNKED, chunks)) ||
+             (ret = nc_def_var_deflate(out_ncid, varid, 0, 1, c->level)) ||
+             (ret = nc_def_var_fill(out_ncid, varid, 0, &fill)))
+            goto exit;
+      }
+   }
+   if ((ret = nc_enddef(out_ncid)))
+      goto exit;
+
+   /* The other vars are small; copy them whole. */
+   for (int v = 0; v < nvars; v++)
+   {
+      int dimids[NC_MAX_VAR_DIMS];
+      size_t n = 1, len;
+      float *data;
+      int var_ndims;
+
+      if (v == c->varid)
+         continue;
+      if ((ret = nc_inq_varndims(c->ncid, v, &var_ndims)) ||
+          (ret = nc_inq_vardimid(c->ncid, v, dimids)))
+         goto exit;
+      for (int d = 0; d < var_ndims; d++)
+      {
+         if ((ret = nc_inq_dimlen(c->ncid, dimids[d], &len)))
+            goto exit;
+         n *= len;
+      }
+      if (!(data = malloc((n + 1) * sizeof(float))))
+      {
+         ret = NC_ENOMEM;
+         goto exit;
+      }
+      if (!(ret = nc_get_var_float(c->ncid, v, data)))
+         ret = nc_put_var_float(out_ncid, v, data);
+      free(data);
+      if (ret)
+         goto exit;
+   }
+
+exit:
+   if (ret)
+   {
+      nc_close(out_ncid);
+      return ret;
+   }
+   return nc_close(out_ncid);
+}
+
+int
+main(int argc, char **argv)
+{
+   CONV_T c;
+   pthread_t read_thread;
+   pthread_t *deflate_thread = NULL;
+   int reading = 0, started;
+   char name[NC_MAX_NAME + 1];
+   int dimids[SION_NDIMS3];
+   size_t rows = 0;
+   hid_t fid = -1, dsid = -1;
+   int nvars, ndims;
+   int opt, ret;
+
+   memset(&c, 0, sizeof(CONV_T));
+   c.varid = -1;
+   c.level = DEFAULT_LEVEL;
+   c.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+   while ((opt = getopt(argc, argv, "d:r:n:h")) != -1)
+   {
+      switch (opt)
+      {
+      case 'd':
+         c.level = atoi(optarg);
+         break;
+      case 'r':
+         rows = strtoul(optarg, NULL, 10);
+         break;
+      case 'n':
+         c.nthreads = atoi(optarg);
+         break;
+      default:
+         fprintf(stderr, USAGE);
+         return opt == 'h' ? 0 : 2;
+      }
+   }
+   if (optind != argc - 2 || c.level < 1 || c.level > 9)
+   {
+      fprintf(stderr, USAGE);
+      return 2;
+   }
+   if (c.nthreads < 1)
+      c.nthreads = 1;
+   if (c.nthreads > MAX_THREADS)
+      c.nthreads = MAX_THREADS;
+
+   /* Open the AB file and find the data var, the one with three
+    * dims. */
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)) ||
+       (ret = nc_open(argv[optind], NC_UF0, &c.ncid)))
+   {
+      fprintf(stderr, "ab2nc: %s: %s\n", argv[optind], nc_strerror(ret));
+      return 1;
+   }
+   if ((ret = nc_inq_nvars(c.ncid, &nvars)))
+      goto exit;
+   for (int v = 0; c.varid < 0 && v < nvars; v++)
+      if (!(ret = nc_inq_varndims(c.ncid, v, &ndims)) && ndims == SION_NDIMS3)
+         c.varid = v;
+   if (c.varid < 0)
+   {
+      ret = NC_ENOTVAR;
+      goto exit;
+   }
+   if ((ret = nc_inq_varname(c.ncid, c.varid, name)) ||
+       (ret = nc_inq_vardimid(c.ncid, c.varid, dimids)))
+      goto exit;
+   for (int d = 0; d < SION_NDIMS3; d++)
+      if ((ret = nc_inq_dimlen(c.ncid, dimids[d], &c.dim_len[d])))
+         goto exit;
+   if (!c.dim_len[1] || !c.dim_len[2])
+   {
+      ret = NC_EINVAL;
+      goto exit;
+   }
+
+   /* Chunks are bands of whole rows of one record. */
+   if (!rows)
+      rows = CHUNK_BYTES / (c.dim_len[2] * sizeof(float));
+   c.rows = rows < 1 ? 1 : rows > c.dim_len[1] ? c.dim_len[1] : rows;
+   c.nbands = (c.dim_len[1] + c.rows - 1) / c.rows;
+
+   /* Define the file, then reopen it for the chunks. */
+   if ((ret = define_file(&c, argv[optind + 1])))
+      goto exit;
+   if ((fid = H5Fopen(argv[optind + 1], H5F_ACC_RDWR, H5P_DEFAULT)) < 0 ||
+       (dsid = H5Dopen2(fid, name, H5P_DEFAULT)) < 0)
+   {
+      ret = NC_EHDFERR;
+      goto exit;
+   }
+
+   /* Run the pipeline. */
+   if (!(deflate_thread = malloc(c.nthreads * sizeof(pthread_t))))
+   {
+      ret = NC_ENOMEM;
+      goto exit;
+   }
+   if ((ret = queue_init(&c.read_q, QUEUE_PER_THREAD * c.nthreads)))
+      goto exit;
+   if ((ret = queue_init(&c.write_q, QUEUE_PER_THREAD * c.nthreads)))
+   {
+      queue_free(&c.read_q);
+      goto exit;
+   }
+   pthread_mutex_init(&c.lock, NULL);
+   c.running = c.nthreads;
+
+   /* A stage that can't start ends its queue itself, so the stages
+    * after it still finish. */
+   if (pthread_create(&read_thread, NULL, reader, &c))
+   {
+      set_status(&c, NC_EIO);
+      queue_close(&c.read_q);
+   }
+   else
+      reading++;
+   for (started = 0; started < c.nthreads; started++)
+      if (pthread_create(&deflate_thread[started], NULL, deflater, &c))
+         break;
+   if (started < c.nthreads)
+   {
+      set_status(&c, NC_EIO);
+      pthread_mutex_lock(&c.lock);
+      c.running -= c.nthreads - started;
+      if (!c.running)
+         queue_close(&c.write_q);
+      pthread_mutex_unlock(&c.lock);
+   }
+   ret = write_chunks(&c, dsid);
+
+   /* With no deflate thread, the reader is still waiting on its
+    * queue. */
+   drop_jobs(&c.read_q);
+   if (reading)
+      pthread_join(read_thread, NULL);
+   for (int t = 0; t < started; t++)
+      pthread_join(deflate_thread[t], NULL);
+   pthread_mutex_destroy(&c.lock);
+   queue_free(&c.write_q);
+   queue_free(&c.read_q);
+
+exit:
+   free(deflate_thread);
+   if (dsid >= 0 && H5Dclose(dsid) < 0 && !ret)
+      ret = NC_EHDFERR;
+   if (fid >= 0 && H5Fclose(fid) < 0 && !ret)
+      ret = NC_EHDFERR;
+   nc_close(c.ncid);
+   if (ret)
+   {
+      fprintf(stderr, "ab2nc: %s: %s\n", argv[optind], nc_strerror(ret));
+      return 1;
+   }
+   return 0;
+}
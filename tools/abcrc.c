@@ -0,0 +1,83 @@
+/* abcrc builds the record checksums of AB files, or checks AB files
+* against them.
+*
+* Without -w, each file is checked against the checksums built
+* earlier, and the records that do not match are listed. The exit
+* status is 1 if any record does not match, or a file could not be
+* checked.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define USAGE "Usage: abcrc [-w] file.b...\n" \
+   "  -w  Build the checksums of each file, instead of checking them.\n"
+
+/* Most bad records listed for one file. */
+#define MAX_BAD 100
+
+int
+main(int argc, char **argv)
+{
+   int build = 0;
+   int status = 0;
+   int opt, ret;
+
+   while ((opt = getopt(argc, argv, "wh")) != -1)
+   {
+      switch (opt)
+      {
+      case 'w':
+         build = 1;
+         break;
+      default:
+         fprintf(stderr, USAGE);
+         return opt == 'h' ? 0 : 2;
+      }
+   }
+   if (optind == argc)
+   {
+      fprintf(stderr, USAGE);
+      return 2;
+   }
+
+   for (int f = optind; f < argc; f++)
+   {
+      size_t bad[MAX_BAD], nbad;
+
+      if (build)
+      {
+         if ((ret = SION_build_checksums(argv[f])))
+         {
+            fprintf(stderr, "abcrc: %s: %s\n", argv[f], nc_strerror(ret));
+            status = 1;
+         }
+         continue;
+      }
+
+      if ((ret = SION_verify_checksums(argv[f], MAX_BAD, bad, &nbad)))
+      {
+         fprintf(stderr, "abcrc: %s: %s\n", argv[f],
+                 ret == NC_ENOTFOUND ? "no checksums" : nc_strerror(ret));
+         status = 1;
+         continue;
+      }
+      if (!nbad)
+      {
+         printf("%s: ok\n", argv[f]);
+         continue;
+      }
+      printf("%s: %zu bad record%s:", argv[f], nbad, nbad == 1 ? "" : "s");
+      for (size_t b = 0; b < nbad && b < MAX_BAD; b++)
+         printf(" %zu", bad[b]);
+      printf("%s\n", nbad > MAX_BAD ? " ..." : "");
+      status = 1;
+   }
+
+   return status;
+}
@@ -0,0 +1,561 @@
+/* abdump writes the data of an AB file as CSV or as ncdump-like
+* text, reading it through the AB dispatch layer.
+*
+* Records are read two at a time: while one is formatted, the next
+* is read on the background I/O thread. Each record is formatted in
+* bands of rows, spread over worker threads, and each band is written
+* out before the next is started, so memory use does not grow with
+* the size of the file. Floats are written with the fewest
+* significant digits that read back as the same float.
+*
+* Ed Hartnett */
+
+#include <config.h>
+#include <netcdf.h>
+#include "siondispatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#define USAGE "Usage: abdump [-f csv|cdl] [-t start[:count[:stride]]]\n" \
+   "              [-j start[:count[:stride]]] [-i start[:count[:stride]]]\n" \
+   "              [-V text|keep|skip] [-n threads] [-o file] file.b\n" \
+   "  -f  Output format: csv (default), one line per point, or cdl,\n" \
+   "      like ncdump.\n" \
+   "  -t, -j, -i  Records, rows and columns to write.\n" \
+   "  -V  Text written for data voids, \"keep\" to write their values,\n" \
+   "      or \"skip\" to leave them out (csv only). Default is an\n" \
+   "      empty field for csv and _ for cdl.\n" \
+   "  -n  Number of formatting threads. Default is one per CPU.\n" \
+   "  -o  Output file. Default is standard output.\n"
+
+/* Output formats. */
+#define FMT_CSV 0
+#define FMT_CDL 1
+
+/* Points formatted by each thread in one band. */
+#define BAND_POINTS 65536
+
+/* Most text for one point, not counting void text. */
+#define MAX_POINT_LEN 96
+
+/* Most formatting threads. */
+#define MAX_THREADS 64
+
+/* Output buffer size. */
+#define OUT_BUF_LEN (1 << 20)
+
+/* Part of a dimension to write. */
+typedef struct SLICE
+{
+   size_t start;
+   size_t count;
+   size_t stride;
+} SLICE_T;
+
+struct DUMP;
+
+/* A formatting thread, and the text of its part of a band. */
+typedef struct WORKER
+{
+   struct DUMP *d;
+   int id;
+   pthread_t thread;
+   char *text;
+   size_t len;
+} WORKER_T;
+
+/* Everything needed to format a band of rows. */
+typedef struct DUMP
+{
+   int format;
+   const char *void_text; /* NULL to write voids as they are. */
+   size_t void_len;
+   int skip_voids;
+   SLICE_T sl[SION_NDIMS3];
+   size_t box_i; /* Row length of the box read from each record. */
+   const float *rec; /* Box read from the record being written. */
+   char t_text[MAX_POINT_LEN]; /* Time of the record being written. */
+   size_t t_text_len;
+   int last_rec; /* Non-zero while writing the last record. */
+   size_t row0; /* First row of the band. */
+   size_t nrows; /* Rows in the band. */
+   int nthreads;
+   WORKER_T *w;
+   pthread_mutex_t lock;
+   pthread_cond_t go; /* A band is ready to format. */
+   pthread_cond_t done; /* All threads have formatted the band. */
+   int gen; /* Band number. */
+   int pending; /* Threads still formatting the band. */
+   int quit;
+} DUMP_T;
+
+extern NC_Dispatch SION_dispatcher;
+
+/* Write an unsigned number, and return its length. */
+static int
+fmt_size(size_t v, char *s)
+{
+   char tmp[24];
+   int n = 0;
+
+   do
+      tmp[n++] = '0' + v % 10;
+   while (v /= 10);
+   for (int k = 0; k < n; k++)
+      s[k] = tmp[n - 1 - k];
+   return n;
+}
+
+/* Write a float with the fewest significant digits that read back as
+ * the same float, and return its length. */
+static int
+fmt_float(float v, char *s)
+{
+   int n;
+
+   if (!isfinite(v))
+      return sprintf(s, "%g", v);
+
+   /* Whole numbers, which are common, need no search. */
+   if (fabsf(v) < 1e7f && v == (float)(int32_t)v)
+   {
+      int32_t iv = (int32_t)v;
+
+      if (signbit(v))
+      {
+         s[0] = '-';
+         return 1 + fmt_size((size_t)(-(int64_t)iv), s + 1);
+      }
+      return fmt_size((size_t)iv, s);
+   }
+
+   /* No float needs more than 9 digits. Only one decimal with 6 or
+    * fewer digits can read back as a normal float, so %.6g finds it
+    * if there is one; subnormals have less precision, and need a
+    * search from 1 digit. */
+   for (int p = isnormal(v) ? 6 : 1; p < 9; p++)
+   {
+      n = sprintf(s, "%.*g", p, v);
+      if (strtof(s, NULL) == v)
+         return n;
+   }
+   return sprintf(s, "%.9g", v);
+}
+
+/* Format rows a to b of the selection in the record being written,
+ * and return the length of the text. */
+static size_t
+format_rows(DUMP_T *d, size_t a, size_t b, char *out)
+{
+   size_t ni = d->sl[2].count;
+   char *p = out;
+
+   for (size_t r = a; r < b; r++)
+   {
+      const float *row = d->rec + r * d->sl[1].stride * d->box_i;
+      size_t j = d->sl[1].start + r * d->sl[1].stride;
+      int last_row = d->last_rec && r == d->sl[1].count - 1;
+
+      for (size_t c = 0; c < ni; c++)
+      {
+         float v = row[c * d->sl[2].stride];
+         int is_void = d->void_text && fabsf(v) >= SION_VOID;
+
+         if (d->format == FMT_CSV)
+         {
+            if (is_void && d->skip_voids)
+               continue;
+            memcpy(p, d->t_text, d->t_text_len);
+            p += d->t_text_len;
+            *p++ = ',';
+            p += fmt_size(j, p);
+            *p++ = ',';
+            p += fmt_size(d->sl[2].start + c * d->sl[2].stride, p);
+            *p++ = ',';
+         }
+
+         if (is_void)
+         {
+            memcpy(p, d->void_text, d->void_len);
+            p += d->void_len;
+         }
+         else
+            p += fmt_float(v, p);
+
+         if (d->format == FMT_CSV)
+            *p++ = '\n';
+         else if (last_row && c == ni - 1)
+            p += sprintf(p, " ;\n");
+         else if (c == ni - 1)
+            p += sprintf(p, ",\n  ");
+         else
+            p += sprintf(p, ", ");
+      }
+   }
+   return p - out;
+}
+
+/* Format this thread's share of the current band. */
+static void
+format_share(WORKER_T *w)
+{
+   DUMP_T *d = w->d;
+   size_t per = (d->nrows + d->nthreads - 1) / d->nthreads;
+   size_t a = d->row0 + w->id * per;
+   size_t b = a + per;
+
+   if (b > d->row0 + d->nrows)
+      b = d->row0 + d->nrows;
+   w->len = a < b ? format_rows(d, a, b, w->text) : 0;
+}
+
+/* A formatting thread: format each band as it comes. */
+static void *
+worker(void *arg)
+{
+   WORKER_T *w = arg;
+   DUMP_T *d = w->d;
+   int gen = 0;
+
+   for (;;)
+   {
+      pthread_mutex_lock(&d->lock);
+      while (d->gen == gen && !d->quit)
+         pthread_cond_wait(&d->go, &d->lock);
+      if (d->quit)
+      {
+         pthread_mutex_unlock(&d->lock);
+         return NULL;
+      }
+      gen = d->gen;
+      pthread_mutex_unlock(&d->lock);
+
+      format_share(w);
+
+      pthread_mutex_lock(&d->lock);
+      if (!--d->pending)
+         pthread_cond_signal(&d->done);
+      pthread_mutex_unlock(&d->lock);
+   }
+}
+
+/* Format the current band on all threads, and write it out. */
+static void
+write_band(DUMP_T *d, FILE *out)
+{
+   if (d->nthreads == 1)
+      format_share(&d->w[0]);
+   else
+   {
+      pthread_mutex_lock(&d->lock);
+      d->pending = d->nthreads;
+      d->gen++;
+      pthread_cond_broadcast(&d->go);
+      while (d->pending)
+         pthread_cond_wait(&d->done, &d->lock);
+      pthread_mutex_unlock(&d->lock);
+   }
+   for (int t = 0; t < d->nthreads; t++)
+      fwrite(d->w[t].text, 1, d->w[t].len, out);
+}
+
+/* Parse start[:count[:stride]] for a dimension of length len. A
+ * missing count means to the end. */
+static int
+parse_slice(const char *arg, size_t len, SLICE_T *sl)
+{
+   char *end = "";
+
+   sl->start = 0;
+   sl->count = len;
+   sl->stride = 1;
+   if (arg)
+   {
+      sl->start = strtoul(arg, &end, 10);
+      if (*end == ':' && end[1] != ':' && end[1])
+         sl->count = strtoul(end + 1, &end, 10);
+      else if (*end == ':')
+         end++;
+      if (*end == ':')
+         sl->stride = strtoul(end + 1, &end, 10);
+   }
+   if (*end || !sl->stride || sl->start > len)
+      return 1;
+
+   /* Clip the count to what the dimension holds. */
+   if (sl->count > (len - sl->start + sl->stride - 1) / sl->stride)
+      sl->count = (len - sl->start + sl->stride - 1) / sl->stride;
+   return 0;
+}
+
+/* Write the ncdump-like header. */
+static void
+write_cdl_header(FILE *out, const char *path, int ncid, int varid,
+                 const int *dimids, DUMP_T *d)
+{
+   char name[NC_MAX_NAME + 1];
+   char dim_name[SION_NDIMS3][NC_MAX_NAME + 1];
+   const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+   int base_len = strrchr(base, '.') ? strrchr(base, '.') - base : strlen(base);
+
+   nc_inq_varname(ncid, varid, name);
+   for (int d2 = 0; d2 < SION_NDIMS3; d2++)
+      nc_inq_dimname(ncid, dimids[d2], dim_name[d2]);
+
+   fprintf(out, "netcdf %.*s {\ndimensions:\n", base_len, base);
+   for (int d2 = 0; d2 < SION_NDIMS3; d2++)
+      fprintf(out, "\t%s = %zu ;\n", dim_name[d2], d->sl[d2].count);
+   fprintf(out, "variables:\n\tfloat %s(%s, %s, %s) ;\ndata:\n", name,
+           dim_name[0], dim_name[1], dim_name[2]);
+   if (d->sl[0].count && d->sl[1].count && d->sl[2].count)
+      fprintf(out, "\n %s =\n  ", name);
+}
+
+int
+main(int argc, char **argv)
+{
+   DUMP_T d;
+   FILE *out = stdout;
+   const char *slice_arg[SION_NDIMS3] = {NULL, NULL, NULL};
+   const char *void_arg = NULL;
+   const char *out_path = NULL;
+   char name[NC_MAX_NAME + 1];
+   float *times = NULL;
+   float *box[2] = {NULL, NULL};
+   int req[2];
+   int dimids[SION_NDIMS3];
+   size_t dim_len[SION_NDIMS3];
+   size_t box_len, band_rows;
+   int ncid, varid = -1, time_varid, nvars, ndims;
+   int c, started = 0, ret = NC_NOERR;
+
+   memset(&d, 0, sizeof(DUMP_T));
+   d.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+   while ((c = getopt(argc, argv, "f:t:j:i:V:n:o:h")) != -1)
+   {
+      switch (c)
+      {
+      case 'f':
+         if (!strcmp(optarg, "cdl"))
+            d.format = FMT_CDL;
+         else if (strcmp(optarg, "csv"))
+         {
+            fprintf(stderr, USAGE);
+            return 2;
+         }
+         break;
+      case 't':
+         slice_arg[0] = optarg;
+         break;
+      case 'j':
+         slice_arg[1] = optarg;
+         break;
+      case 'i':
+         slice_arg[2] = optarg;
+         break;
+      case 'V':
+         void_arg = optarg;
+         break;
+      case 'n':
+         d.nthreads = atoi(optarg);
+         break;
+      case 'o':
+         out_path = optarg;
+         break;
+      default:
+         fprintf(stderr, USAGE);
+         return c == 'h' ? 0 : 2;
+      }
+   }
+   if (optind != argc - 1)
+   {
+      fprintf(stderr, USAGE);
+      return 2;
+   }
+   if (d.nthreads < 1)
+      d.nthreads = 1;
+   if (d.nthreads > MAX_THREADS)
+      d.nthreads = MAX_THREADS;
+
+   /* Voids. */
+   d.void_text = d.format == FMT_CSV ? "" : "_";
+   if (void_arg && !strcmp(void_arg, "keep"))
+      d.void_text = NULL;
+   else if (void_arg && !strcmp(void_arg, "skip"))
+   {
+      if (d.format != FMT_CSV)
+      {
+         fprintf(stderr, "abdump: -V skip is only for csv\n");
+         return 2;
+      }
+      d.skip_voids++;
+   }
+   else if (void_arg)
+      d.void_text = void_arg;
+   d.void_len = d.void_text ? strlen(d.void_text) : 0;
+
+   /* Open the file and find the data var, the one with three dims. */
+   if ((ret = nc_def_user_format(NC_UF0, &SION_dispatcher, NULL)) ||
+       (ret = nc_open(argv[optind], NC_UF0, &ncid)))
+   {
+      fprintf(stderr, "abdump: %s: %s\n", argv[optind], nc_strerror(ret));
+      return 1;
+   }
+   if ((ret = nc_inq_nvars(ncid, &nvars)))
+      goto exit;
+   for (int v = 0; varid < 0 && v < nvars; v++)
+      if (!(ret = nc_inq_varndims(ncid, v, &ndims)) && ndims == SION_NDIMS3)
+         varid = v;
+   if (varid < 0)
+   {
+      ret = NC_ENOTVAR;
+      goto exit;
+   }
+   if ((ret = nc_inq_vardimid(ncid, varid, dimids)))
+      goto exit;
+   for (int d2 = 0; d2 < SION_NDIMS3; d2++)
+   {
+      if ((ret = nc_inq_dimlen(ncid, dimids[d2], &dim_len[d2])))
+         goto exit;
+      if (parse_slice(slice_arg[d2], dim_len[d2], &d.sl[d2]))
+      {
+         fprintf(stderr, "abdump: bad slice %s\n", slice_arg[d2]);
+         nc_close(ncid);
+         return 2;
+      }
+   }
+
+   /* The time of every record. */
+   if ((ret = nc_inq_varid(ncid, TIME_NAME, &time_varid)))
+      goto exit;
+   if (!(times = malloc((dim_len[0] + 1) * sizeof(float))))
+   {
+      ret = NC_ENOMEM;
+      goto exit;
+   }
+   if ((ret = nc_get_var_float(ncid, time_varid, times)))
+      goto exit;
+
+   /* Room for two boxes, and the text of a band on each thread. */
+   d.box_i = d.sl[2].count ? (d.sl[2].count - 1) * d.sl[2].stride + 1 : 0;
+   box_len = d.sl[1].count ? ((d.sl[1].count - 1) * d.sl[1].stride + 1) *
+      d.box_i : 0;
+   band_rows = d.sl[2].count && d.sl[2].count < BAND_POINTS ?
+      BAND_POINTS / d.sl[2].count : 1;
+   if (!(d.w = calloc(d.nthreads, sizeof(WORKER_T))))
+   {
+      ret = NC_ENOMEM;
+      goto exit;
+   }
+   for (int b = 0; b < 2; b++)
+      if (!(box[b] = malloc((box_len + 1) * sizeof(float))))
+      {
+         ret = NC_ENOMEM;
+         goto exit;
+      }
+   for (int t = 0; t < d.nthreads; t++)
+   {
+      d.w[t].d = &d;
+      d.w[t].id = t;
+      if (!(d.w[t].text = malloc(band_rows * d.sl[2].count *
+                                 (MAX_POINT_LEN + d.void_len) + 1)))
+      {
+         ret = NC_ENOMEM;
+         goto exit;
+      }
+   }
+   pthread_mutex_init(&d.lock, NULL);
+   pthread_cond_init(&d.go, NULL);
+   pthread_cond_init(&d.done, NULL);
+   for (; d.nthreads > 1 && started < d.nthreads; started++)
+      if (pthread_create(&d.w[started].thread, NULL, worker, &d.w[started]))
+      {
+         ret = NC_EIO;
+         goto stop;
+      }
+
+   if (out_path && !(out = fopen(out_path, "w")))
+   {
+      perror(out_path);
+      ret = NC_EIO;
+      goto stop;
+   }
+   setvbuf(out, NULL, _IOFBF, OUT_BUF_LEN);
+
+   nc_inq_varname(ncid, varid, name);
+   if (d.format == FMT_CSV)
+      fprintf(out, "%s,j,i,%s\n", TIME_NAME, name);
+   else
+      write_cdl_header(out, argv[optind], ncid, varid, dimids, &d);
+
+   /* Read each record while the one before it is written. */
+   for (size_t r = 0; box_len && r < d.sl[0].count; r++)
+   {
+      size_t start[SION_NDIMS3] = {0, d.sl[1].start, d.sl[2].start};
+      size_t count[SION_NDIMS3] = {1, box_len / d.box_i, d.box_i};
+
+      if (!r)
+      {
+         start[0] = d.sl[0].start;
+         if ((ret = SION_iget_vara(ncid, varid, start, count, box[0], &req[0])))
+            break;
+      }
+      if ((ret = SION_wait(req[r % 2])))
+         break;
+      if (r + 1 < d.sl[0].count)
+      {
+         start[0] = d.sl[0].start + (r + 1) * d.sl[0].stride;
+         if ((ret = SION_iget_vara(ncid, varid, start, count, box[(r + 1) % 2],
+                                   &req[(r + 1) % 2])))
+            break;
+      }
+
+      d.rec = box[r % 2];
+      d.last_rec = r == d.sl[0].count - 1;
+      d.t_text_len = fmt_float(times[d.sl[0].start + r * d.sl[0].stride],
+                               d.t_text);
+      for (d.row0 = 0; d.row0 < d.sl[1].count; d.row0 += d.nrows)
+      {
+         d.nrows = band_rows * d.nthreads;
+         if (d.nrows > d.sl[1].count - d.row0)
+            d.nrows = d.sl[1].count - d.row0;
+         write_band(&d, out);
+      }
+   }
+   if (d.format == FMT_CDL)
+      fprintf(out, "}\n");
+   if (fflush(out) || ferror(out))
+      ret = NC_EIO;
+   if (out != stdout)
+      fclose(out);
+
+stop:
+   pthread_mutex_lock(&d.lock);
+   d.quit++;
+   pthread_cond_broadcast(&d.go);
+   pthread_mutex_unlock(&d.lock);
+   for (int t = 0; t < started; t++)
+      pthread_join(d.w[t].thread, NULL);
+   pthread_cond_destroy(&d.done);
+   pthread_cond_destroy(&d.go);
+   pthread_mutex_destroy(&d.lock);
+
+exit:
+   for (int t = 0; d.w && t < d.nthreads; t++)
+      free(d.w[t].text);
+   free(d.w);
+   free(box[0]);
+   free(box[1]);
+   free(times);
+   nc_close(ncid);
+   if (ret)
+   {
+      fprintf(stderr, "abdump: %s: %s\n", argv[optind], nc_strerror(ret));
+      return 1;
+   }
+   return 0;
+}